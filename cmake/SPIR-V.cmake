@@ -10,6 +10,15 @@ if(NOT SPIRVCROSS)
 	message(FATAL_ERROR "spirv-cross was not found. Install the Vulkan SDK.")
 endif()
 
+# Bakes the reflection JSON into the binary blob the app reads. Without Python
+# only the JSON is produced, which the app falls back to.
+find_program(PYTHON
+	NAMES python3 python)
+if(NOT PYTHON)
+	message(WARNING "Python was not found. Shader reflection will be loaded from JSON.")
+endif()
+set(SPIRV_REFLECTION_SCRIPT "${CMAKE_CURRENT_LIST_DIR}/spirv_reflection.py")
+
 function(spirv_shader)
     cmake_parse_arguments(
         SPIRV_SHADER
@@ -36,8 +45,17 @@ function(spirv_shader)
             OUTPUT ${JSON_FILE_PATH}
             COMMAND ${SPIRVCROSS} --output ${JSON_FILE_PATH} ${OUT_FILE_PATH} --reflect
             DEPENDS ${OUT_FILE_PATH})
+        set(SHADER_OUTPUTS ${OUT_FILE_PATH} ${JSON_FILE_PATH})
+        if(PYTHON)
+            string(CONCAT REFL_FILE_PATH ${SPIRV_SHADER_OUTPUT_DEST} "/" ${GLSL_FILENAME} ".refl")
+            add_custom_command(
+                OUTPUT ${REFL_FILE_PATH}
+                COMMAND ${PYTHON} ${SPIRV_REFLECTION_SCRIPT} ${JSON_FILE_PATH} ${REFL_FILE_PATH}
+                DEPENDS ${JSON_FILE_PATH} ${SPIRV_REFLECTION_SCRIPT})
+            list(APPEND SHADER_OUTPUTS ${REFL_FILE_PATH})
+        endif()
         add_custom_target(
-            ${GLSL_FILENAME} ALL DEPENDS ${OUT_FILE_PATH} ${JSON_FILE_PATH}
+            ${GLSL_FILENAME} ALL DEPENDS ${SHADER_OUTPUTS}
         )
 	endforeach()
 endfunction(spirv_shader)
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Bake spirv-cross --reflect JSON into the binary reflection blob read by the
+resource manager. The layout is described in src/shader_reflection.h, and the
+two must change together (bump REFLECTION_BLOB_VERSION in both).
+
+Usage: spirv_reflection.py <input.json> <output.refl>
+"""
+
+import json
+import struct
+import sys
+
+REFLECTION_BLOB_MAGIC = 0x4C464552  # "REFL"
+REFLECTION_BLOB_VERSION = 2
+
+MAX_DESCRIPTOR_SETS = 8
+MAX_DESCRIPTOR_BINDINGS = 16
+MAX_VERTEX_INPUTS = 8
+
+# VkShaderStageFlagBits
+STAGES = {
+    "vert": 0x01,
+    "tesc": 0x02,
+    "tese": 0x04,
+    "geom": 0x08,
+    "frag": 0x10,
+    "comp": 0x20,
+}
+
+# VkFormat of a vertex input, as get_type_info in vulkan_utils.cpp
+VERTEX_FORMATS = {
+    "float": 100,  # VK_FORMAT_R32_SFLOAT
+    "vec2": 103,   # VK_FORMAT_R32G32_SFLOAT
+    "vec3": 106,   # VK_FORMAT_R32G32B32_SFLOAT
+    "vec4": 109,   # VK_FORMAT_R32G32B32A32_SFLOAT
+    "mat2": 103,
+    "mat3": 106,
+    "mat4": 109,
+}
+
+# VkDescriptorType, as get_descriptor_type in vulkan_resource_manager.cpp
+DESCRIPTOR_TYPE_UNIFORM_BUFFER = 6
+DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER = 1
+
+# Sizes of the basic block member types, in bytes
+BASIC_TYPE_SIZES = {
+    "int": 4, "uint": 4, "float": 4, "bool": 4,
+    "vec2": 8, "vec3": 12, "vec4": 16,
+    "ivec2": 8, "ivec3": 12, "ivec4": 16,
+    "uvec2": 8, "uvec3": 12, "uvec4": 16,
+    "mat2": 16, "mat3": 36, "mat4": 64,
+}
+
+MATRIX_COLUMNS = {"mat2": 2, "mat3": 3, "mat4": 4}
+
+
+def fail(message):
+    sys.exit("spirv_reflection.py: " + message)
+
+
+def member_size(member, types):
+    type_name = member["type"]
+    if type_name in types:
+        size = block_size(types[type_name], types)
+    elif "matrix_stride" in member and type_name in MATRIX_COLUMNS:
+        size = member["matrix_stride"] * MATRIX_COLUMNS[type_name]
+    elif type_name in BASIC_TYPE_SIZES:
+        size = BASIC_TYPE_SIZES[type_name]
+    else:
+        fail("unknown type " + type_name)
+
+    for count in member.get("array", []):
+        size = member.get("array_stride", size) * count
+    return size
+
+
+def block_size(block_type, types):
+    end = 0
+    for member in block_type["members"]:
+        end = max(end, member.get("offset", 0) + member_size(member, types))
+    return end
+
+
+class Strings:
+    def __init__(self):
+        self.data = bytearray()
+
+    def add(self, string):
+        encoded = string.encode("utf-8")
+        offset = len(self.data)
+        # Null terminated, so names can be handed to C APIs directly
+        self.data += encoded + b"\0"
+        return offset, len(encoded)
+
+
+def bake(reflection):
+    strings = Strings()
+
+    entry_points = reflection.get("entryPoints", [])
+    if len(entry_points) == 0:
+        fail("no entry point")
+    if len(entry_points) > 1:
+        fail("multiple entry points are not supported")
+    entry_point = entry_points[0]
+    if entry_point["mode"] not in STAGES:
+        fail("unsupported stage " + entry_point["mode"])
+    stage = STAGES[entry_point["mode"]]
+    entry_point_name = strings.add(entry_point["name"])
+
+    vertex_inputs = []
+    if entry_point["mode"] == "vert":
+        for vertex_input in reflection.get("inputs", []):
+            location = vertex_input["location"]
+            if vertex_input["type"] not in VERTEX_FORMATS:
+                fail("unsupported vertex input type " + vertex_input["type"])
+            # Matrices take one location per column
+            location_span = MATRIX_COLUMNS.get(vertex_input["type"], 1)
+            if location + location_span > MAX_VERTEX_INPUTS:
+                fail("vertex input %s at location %d out of range" % (vertex_input["name"], location))
+            vertex_inputs.append((location, VERTEX_FORMATS[vertex_input["type"]], location_span)
+                                 + strings.add(vertex_input["name"]))
+
+    bindings = []
+    for node_name in ("textures", "ubos"):
+        for binding in reflection.get(node_name, []):
+            if node_name == "ubos":
+                descriptor_type = DESCRIPTOR_TYPE_UNIFORM_BUFFER
+            elif binding["type"] == "sampler2D":
+                descriptor_type = DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+            else:
+                fail("unsupported node %s, type %s" % (node_name, binding["type"]))
+
+            array = binding.get("array", [])
+            if len(array) > 1:
+                fail("only single dimension arrays supported")
+            count = array[0] if array else 1
+
+            if binding["set"] >= MAX_DESCRIPTOR_SETS or binding["binding"] >= MAX_DESCRIPTOR_BINDINGS:
+                fail("descriptor set %d, binding %d out of range" % (binding["set"], binding["binding"]))
+            bindings.append((binding["set"], binding["binding"], descriptor_type, count)
+                            + strings.add(binding["name"]))
+
+    push_constant_offset = 0
+    push_constant_size = 0
+    push_constants = reflection.get("push_constants", [])
+    if len(push_constants) > 1:
+        fail("only one push constant block supported")
+    for push_constant in push_constants:
+        block = reflection["types"][push_constant["type"]]
+        push_constant_offset = min(member.get("offset", 0) for member in block["members"])
+        push_constant_size = block_size(block, reflection["types"]) - push_constant_offset
+
+    while len(strings.data) % 4:
+        strings.data += b"\0"
+
+    blob = struct.pack("<10I", REFLECTION_BLOB_MAGIC, REFLECTION_BLOB_VERSION, stage,
+                       entry_point_name[0], entry_point_name[1], len(vertex_inputs), len(bindings),
+                       push_constant_offset, push_constant_size, len(strings.data))
+    for vertex_input in sorted(vertex_inputs):
+        blob += struct.pack("<5I", *vertex_input)
+    for binding in sorted(bindings):
+        blob += struct.pack("<6I", *binding)
+    return blob + bytes(strings.data)
+
+
+def main():
+    if len(sys.argv) != 3:
+        fail("usage: spirv_reflection.py <input.json> <output.refl>")
+
+    with open(sys.argv[1], "r") as file:
+        reflection = json.load(file)
+
+    blob = bake(reflection)
+    with open(sys.argv[2], "wb") as file:
+        file.write(blob)
+
+
+if __name__ == "__main__":
+    main()
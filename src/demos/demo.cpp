@@ -2,16 +2,8 @@
 #include "../vulkan_app.h"
 
 void Demo::render_frame(Vulkan::App& app, const std::function< void(const size_t, VkCommandBuffer) >& render) {
-    // Advance to a new frame
-    size_t last_frame    = app.current_frame;
-    size_t current_frame = app.current_frame = (app.current_frame + 1) % app.max_rendering_frames;
-
-    // Get frame resources
-    Vulkan::FrameResources& frame_resources = app.frame_resources[current_frame];
-
-    // Wait for the last queue that used these frame resources to finish rendering. This is mainly
-    // to signal it's safe to reuse the command buffer
-    vkWaitForFences(app.device, 1, &frame_resources.draw_complete_fence, VK_TRUE, UINT64_MAX);
+    // Get frame resources. App::begin_frame has already waited for the GPU to finish with them
+    Vulkan::FrameResources& frame_resources = app.frame_resources[app.current_frame];
     vkResetFences(app.device, 1, &frame_resources.draw_complete_fence);
 
     // Acquire a swapchain image
@@ -9,10 +9,14 @@ class Demo {
     virtual void init(Vulkan::App& app, Vulkan::ResourceManager& resource_manager,
                       Memory::VirtualHeap& demo_heap)
         = 0;
+    // frame_heap belongs to the current frame slot. It's only cleared once the GPU has finished
+    // with the frame, so it can hold data the GPU reads (uploads, draw lists) as well as CPU
+    // scratch
     virtual void render(Vulkan::App& app, Vulkan::ResourceManager& resource_manager,
                         Memory::VirtualHeap& frame_heap)
         = 0;
-    virtual void destroy(Vulkan::App& app) = 0;
+    // Objects the GPU may still be using must go through the resource manager's deletion queue
+    virtual void destroy(Vulkan::App& app, Vulkan::ResourceManager& resource_manager) = 0;
 
   protected:
     void render_frame(Vulkan::App& app,
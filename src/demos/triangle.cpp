@@ -3,20 +3,18 @@
 #include "../file_system.h"
 
 void TriangleDemo::init(Vulkan::App& app, Vulkan::ResourceManager& resource_manager, Memory::VirtualHeap& demo_heap) {
-    const char* shader_files[] = { "shaders/triangle.vert.spv", "shaders/triangle.vert.json",
-                                   "shaders/triangle.frag.spv", "shaders/triangle.frag.json" };
+    const char* shader_files[] = { "shaders/triangle.vert.spv", "shaders/triangle.frag.spv" };
 
     std::vector< Vulkan::ShaderModule > shader_modules;
     FileSystem::load_temp_files(
         shader_files, ARRAY_LENGTH(shader_files),
-        [&shader_modules, &resource_manager](const Memory::Buffer* results, size_t num_results) {
-            const Memory::Buffer& test_vert_spv_file  = results[0];
-            const Memory::Buffer& test_vert_json_file = results[1];
-            const Memory::Buffer& test_frag_spv_file  = results[2];
-            const Memory::Buffer& test_frag_json_file = results[3];
-
-            shader_modules.push_back(resource_manager.request_shader_module({"test_vert", test_vert_spv_file, test_vert_json_file}));
-            shader_modules.push_back(resource_manager.request_shader_module({"test_frag", test_frag_spv_file, test_frag_json_file}));
+        [&shader_files, &shader_modules, &resource_manager](const Memory::Buffer* results, size_t num_results) {
+            const Memory::Buffer& test_vert_spv_file = results[0];
+            const Memory::Buffer& test_frag_spv_file = results[1];
+
+            // Reflected from the SPIR-V itself. Named after their files, so they can be hot reloaded
+            shader_modules.push_back(resource_manager.request_shader_module({shader_files[0], test_vert_spv_file, {}}));
+            shader_modules.push_back(resource_manager.request_shader_module({shader_files[1], test_frag_spv_file, {}}));
         });
     pipeline_layout = create_pipeline_layout(resource_manager, shader_modules);
 
@@ -219,7 +217,8 @@ void TriangleDemo::init(Vulkan::App& app, Vulkan::ResourceManager& resource_mana
         pipeline_create_info.layout = pipeline_layout;
         pipeline_create_info.renderPass = final_pass;
 
-        pipeline = resource_manager.request_pipeline(pipeline_create_info);
+        // Compiled in the background. Frames are cleared without drawing until it's ready
+        pipeline = resource_manager.request_pipeline_async(pipeline_create_info);
     }
 }
 
@@ -227,7 +226,8 @@ void TriangleDemo::render(Vulkan::App& app, Vulkan::ResourceManager& resource_ma
     // TODO: Clear color is another per-attachment thing. This should be
     // pulled from pass config
     VkClearValue clear_color = {0.5f, 0.0f, 0.25f, 1.0f};
-    render_frame(app, [&app, &clear_color, this](const size_t image_index, VkCommandBuffer cmd_buf) {
+    VkPipeline vk_pipeline = resource_manager.get_pipeline(pipeline);
+    render_frame(app, [&app, &clear_color, vk_pipeline, this](const size_t image_index, VkCommandBuffer cmd_buf) {
         VkRenderPassBeginInfo final_pass_begin = {};
         final_pass_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
         final_pass_begin.renderPass = final_pass;
@@ -249,17 +249,19 @@ void TriangleDemo::render(Vulkan::App& app, Vulkan::ResourceManager& resource_ma
         viewport.maxDepth = 1;
 
         vkCmdSetViewport(cmd_buf, 0, 1, &viewport);
-        vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-        vkCmdDraw(cmd_buf, 3, 1, 0, 0);
+        if (vk_pipeline != VK_NULL_HANDLE) {
+            vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_pipeline);
+            vkCmdDraw(cmd_buf, 3, 1, 0, 0);
+        }
 
         vkCmdEndRenderPass(cmd_buf);
     });
 }
 
-void TriangleDemo::destroy(Vulkan::App& app) {
-    vkDestroyRenderPass(app.device, final_pass, nullptr);
+void TriangleDemo::destroy(Vulkan::App& app, Vulkan::ResourceManager& resource_manager) {
+    resource_manager.destroy_deferred(final_pass);
     for (auto& framebuffer : swapchain_framebuffers) {
-        vkDestroyFramebuffer(app.device, framebuffer, nullptr);
+        resource_manager.destroy_deferred(framebuffer);
     }
 
     swapchain_framebuffers.clear();
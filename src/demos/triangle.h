@@ -11,10 +11,10 @@ class TriangleDemo : public Demo {
               Memory::VirtualHeap& demo_heap);
     void render(Vulkan::App& app, Vulkan::ResourceManager& resource_manager,
                 Memory::VirtualHeap& frame_heap);
-    void destroy(Vulkan::App& app);
+    void destroy(Vulkan::App& app, Vulkan::ResourceManager& resource_manager);
   private:
     VkPipelineLayout pipeline_layout;
-    VkPipeline pipeline;
+    Vulkan::AsyncPipeline pipeline;
     std::vector< VkFramebuffer > swapchain_framebuffers;
     VkRenderPass final_pass;
 };
\ No newline at end of file
@@ -1,17 +1,22 @@
 #include "file_system.h"
 #include "utils.h"
+#include "platform.h"
 
 #include <physfs.h>
 
-#include <vector>
-
 /////////////////////////////////////////////////////////////////////////////////////////////////
 // Files ////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////
 
 namespace FileSystem {
 
-void load_temp_file(const char* filename, const std::function< void(const Memory::Buffer&) >& on_file_load) {
+// Backs temp file buffers. Each load opens a scratch scope, so buffers are
+// released as soon as the callback returns, including for nested loads.
+static Memory::VirtualHeap* scratch_heap = nullptr;
+
+static Memory::Buffer read_file(const char* filename, Memory::IAllocator& allocator) {
+    MEMORY_TAG("file_system");
+
     int result = PHYSFS_exists(filename);
     if (!result) {
         RUNTIME_ERROR("Error loading %s", filename);
@@ -20,39 +25,91 @@ void load_temp_file(const char* filename, const std::function< void(const Memory
     PHYSFS_file*  file      = PHYSFS_openRead(filename);
     PHYSFS_sint64 file_size = PHYSFS_fileLength(file);
 
-    uint8_t* buffer = new uint8_t[file_size];
+    uint8_t* buffer = allocator.allocate< uint8_t >(file_size, 16);
     PHYSFS_read(file, buffer, 1, file_size);
     PHYSFS_close(file);
 
-    on_file_load({ buffer, (size_t) file_size });
-    delete[] buffer;
+    return { buffer, (size_t) file_size };
+}
+
+bool exists(const char* filename) {
+    return PHYSFS_exists(filename);
+}
+
+void load_temp_file(const char* filename, const std::function< void(const Memory::Buffer&) >& on_file_load) {
+    ASSERT_MSG(scratch_heap, "FileSystem not initialized");
+    Memory::ScratchScope scratch(*scratch_heap);
+
+    on_file_load(read_file(filename, scratch));
 }
 
 void load_temp_files(const char** filenames, size_t num_files,
                      const std::function< void(const Memory::Buffer*, size_t) >& on_files_load) {
-    std::vector< Memory::Buffer > results;
+    ASSERT_MSG(scratch_heap, "FileSystem not initialized");
+    Memory::ScratchScope scratch(*scratch_heap);
+
+    Memory::Buffer* results = scratch.allocate< Memory::Buffer >(num_files);
     for (size_t i = 0; i < num_files; i++) {
-        const char* filename = filenames[i];
-        int         result   = PHYSFS_exists(filename);
-        if (!result) {
-            RUNTIME_ERROR("Error loading %s", filename);
-        }
+        results[i] = read_file(filenames[i], scratch);
+    }
+
+    on_files_load(results, num_files);
+}
 
-        PHYSFS_file*  file      = PHYSFS_openRead(filename);
-        PHYSFS_sint64 file_size = PHYSFS_fileLength(file);
+bool load_native_file(const char* path, const std::function< void(const Memory::Buffer&) >& on_file_load) {
+    ASSERT_MSG(scratch_heap, "FileSystem not initialized");
+    MEMORY_TAG("file_system");
 
-        uint8_t* buffer = new uint8_t[file_size];
-        PHYSFS_read(file, buffer, 1, file_size);
-        PHYSFS_close(file);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
 
-        results.push_back({ buffer, (size_t) file_size });
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_size < 0) {
+        fclose(file);
+        return false;
     }
 
-    on_files_load(results.data(), results.size());
+    Memory::ScratchScope scratch(*scratch_heap);
+    uint8_t* buffer = scratch.allocate< uint8_t >(file_size, 16);
+    size_t read     = fread(buffer, 1, file_size, file);
+    fclose(file);
 
-    for (const Memory::Buffer& result : results) {
-        delete[] result.data;
+    if (read != (size_t) file_size) {
+        return false;
     }
+
+    on_file_load({ buffer, (size_t) file_size });
+    return true;
+}
+
+bool write_native_file(const char* path, const void* data, size_t size) {
+    char temp_path[1024];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int) sizeof(temp_path)) {
+        LOG_ERROR("Path too long: %s", path);
+        return false;
+    }
+
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) {
+        LOG_ERROR("Failed to open %s for writing", temp_path);
+        return false;
+    }
+
+    bool written = fwrite(data, 1, size, file) == size;
+    Platform::flush_file(file);
+    fclose(file);
+
+    if (!written || !Platform::replace_file(temp_path, path)) {
+        LOG_ERROR("Failed to write %s", path);
+        remove(temp_path);
+        return false;
+    }
+
+    return true;
 }
 
 void initialize(const char* path_to_mount) {
@@ -60,8 +117,16 @@ void initialize(const char* path_to_mount) {
     if (!PHYSFS_mount(path_to_mount, "", 1)) {
         RUNTIME_ERROR("Failed to mount %s folder", path_to_mount);
     }
+
+    scratch_heap = new Memory::VirtualHeap(GB(4));
+    scratch_heap->set_name("FileSystem scratch");
 }
 
-void deinit() { PHYSFS_deinit(); }
+void deinit() {
+    delete scratch_heap;
+    scratch_heap = nullptr;
+
+    PHYSFS_deinit();
+}
 
 }    // namespace FileSystem
\ No newline at end of file
@@ -7,10 +7,20 @@
 
 namespace FileSystem {
 
+bool exists(const char* filename);
+
 void load_temp_file(const char* filename, const std::function< void(const Memory::Buffer&) >& on_file_load);
 void load_temp_files(const char** filenames, size_t num_files,
                      const std::function< void(const Memory::Buffer*, size_t) >& on_files_load);
 
+// Files outside the mounted folder, for data the app writes itself (caches,
+// settings). Paths are native paths. load_native_file returns false without
+// calling on_file_load if the file can't be read.
+bool load_native_file(const char* path, const std::function< void(const Memory::Buffer&) >& on_file_load);
+// Writes to a temporary file next to path and moves it into place, so a crash
+// mid-write leaves the previous file intact
+bool write_native_file(const char* path, const void* data, size_t size);
+
 void initialize(const char* path_to_mount);
 void deinit();
 
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "memory.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <utility>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles //////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const uint32_t HANDLE_INVALID_INDEX = (uint32_t) (~0);
+
+// Index of a slot in a SlotMap, plus the generation the slot had when the
+// handle was made. Releasing a slot bumps its generation, so handles to a
+// released resource are recognised as stale even after the slot is reused.
+template < typename PHANTOM_T >
+struct Handle {
+    uint32_t index      = HANDLE_INVALID_INDEX;
+    uint32_t generation = 0;
+
+    inline bool is_valid() const {
+        return index != HANDLE_INVALID_INDEX;
+    }
+    inline static Handle< PHANTOM_T > create_invalid() {
+        return { HANDLE_INVALID_INDEX, 0 };
+    }
+
+    inline bool operator==(const Handle< PHANTOM_T >& other) const {
+        return index == other.index && generation == other.generation;
+    }
+    inline bool operator!=(const Handle< PHANTOM_T >& other) const {
+        return !(*this == other);
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Slot map /////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Objects of type T addressed by generation checked handles. Slots live in a
+// Pool, so they never move, their pool index is the handle's index, and
+// released slots are reused first. Create and release are O(1) and the table
+// only grows to the peak number of live objects.
+//
+// A slot's generation is odd while it's live and even while it's free. It's
+// bumped on create and on release, so a handle matches its slot only until
+// the object it was made for is released.
+template < typename T, typename HANDLE_T >
+class SlotMap {
+  private:
+    // The pool keeps its free list link at the front of free blocks. The
+    // object storage covers it, so the generation survives while a slot is
+    // free
+    struct Slot {
+        alignas(T) alignas(void*) uint8_t data[std::max(sizeof(T), sizeof(void*))];
+        uint32_t generation;
+    };
+
+    Memory::Pool< Slot > pool;
+    // Slots below this have been handed out at least once, so their
+    // generation is initialized
+    uint32_t num_slots = 0;
+
+    static inline bool is_live(const Slot& slot) {
+        return (slot.generation & 1) != 0;
+    }
+
+    inline Slot* find(const HANDLE_T& handle) {
+        if (handle.index >= num_slots) {
+            return nullptr;
+        }
+        Slot* slot = pool.at(handle.index);
+        return slot->generation == handle.generation && is_live(*slot) ? slot : nullptr;
+    }
+
+  public:
+    SlotMap(size_t reserve_size, size_t chunk_size = KB(64))
+        : pool(reserve_size, chunk_size) {
+    }
+
+    ~SlotMap() {
+        clear();
+    }
+
+    SlotMap(const SlotMap&) = delete;
+    SlotMap& operator=(const SlotMap&) = delete;
+
+    template < typename... Args >
+    HANDLE_T create(Args&&... args) {
+        Slot* slot     = pool.allocate();
+        uint32_t index = (uint32_t) pool.index_of(slot);
+        for (; num_slots <= index; num_slots++) {
+            pool.at(num_slots)->generation = 0;
+        }
+
+        slot->generation++;
+        new (slot->data) T(std::forward< Args >(args)...);
+
+        HANDLE_T handle;
+        handle.index      = index;
+        handle.generation = slot->generation;
+        return handle;
+    }
+
+    // Destroys the object and frees its slot. Stale handles are ignored
+    void release(const HANDLE_T& handle) {
+        Slot* slot = find(handle);
+        if (!slot) {
+            return;
+        }
+
+        ((T*) slot->data)->~T();
+        slot->generation++;
+        pool.free(slot);
+    }
+
+    // Null if the handle is invalid or stale
+    inline T* get(const HANDLE_T& handle) {
+        Slot* slot = find(handle);
+        return slot ? (T*) slot->data : nullptr;
+    }
+
+    inline bool contains(const HANDLE_T& handle) {
+        return find(handle) != nullptr;
+    }
+
+    // Calls f(handle, object) for every live object
+    template < typename F >
+    void for_each(F&& f) {
+        for (uint32_t i = 0; i < num_slots; i++) {
+            Slot& slot = *pool.at(i);
+            if (is_live(slot)) {
+                HANDLE_T handle;
+                handle.index      = i;
+                handle.generation = slot.generation;
+                f(handle, *(T*) slot.data);
+            }
+        }
+    }
+
+    // Releases every object. Slots are kept for reuse, with their
+    // generations, so handles from before the clear stay stale
+    void clear() {
+        for (uint32_t i = 0; i < num_slots; i++) {
+            Slot& slot = *pool.at(i);
+            if (is_live(slot)) {
+                HANDLE_T handle;
+                handle.index      = i;
+                handle.generation = slot.generation;
+                release(handle);
+            }
+        }
+    }
+
+    // Number of live objects
+    inline size_t size() const {
+        return pool.size();
+    }
+
+    // Number of slots carved out so far, live or free
+    inline size_t capacity() const {
+        return pool.capacity();
+    }
+};
+
+}    // namespace Vulkan
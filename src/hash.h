@@ -1,12 +1,47 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// SIMD kernel for hash64, picked at compile time. Every kernel produces the
+// same hashes, so they can be stored on disk. Define HASH_FORCE_SCALAR to use
+// the portable one.
+#if !defined(HASH_FORCE_SCALAR) && defined(__AVX2__)
+#define HASH_AVX2
+#include <immintrin.h>
+#elif !defined(HASH_FORCE_SCALAR) \
+    && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HASH_SSE2
+#include <emmintrin.h>
+#elif !defined(HASH_FORCE_SCALAR) && (defined(__ARM_NEON) || defined(_M_ARM64))
+#define HASH_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
 namespace Hash {
 
 template < typename T >
 struct Hash : std::false_type {};
 
+// Bernstein's hash, folded from the last character to the first
 constexpr unsigned long djb2_hash(const char* str) {
-    return str[0] == 0 ? 0 : str[0] + (5381 * djb2_hash(str + 1));
+    size_t length = 0;
+    while (str[length]) {
+        length++;
+    }
+
+    unsigned long hash = 0;
+    while (length > 0) {
+        length--;
+        hash = str[length] + 5381 * hash;
+    }
+    return hash;
 }
 
 inline size_t djb2_hash(const char* str, size_t size, size_t seed = 5381) {
@@ -18,11 +53,250 @@ inline size_t djb2_hash(const char* str, size_t size, size_t seed = 5381) {
     return hash;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// hash64 ///////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// 64 bit hash for blobs of data such as SPIR-V and cache keys, built the same
+// way as XXH3. Long inputs are consumed in 64 byte stripes by eight 64 bit
+// accumulators, each adding the product of the low and high halves of
+// (data ^ secret). That maps directly onto 32x32->64 bit SIMD multiplies. The
+// accumulators are scrambled every block of 16 stripes and merged at the end.
+// Inputs of 64 bytes or less take a scalar path built on 64x64->128 bit
+// multiplies.
+namespace Detail {
+
+static const size_t HASH_STRIPE_SIZE        = 64;
+static const size_t HASH_STRIPES_PER_BLOCK  = 16;
+static const size_t HASH_SECRET_WORDS       = 24;
+static const size_t HASH_SCRAMBLE_SECRET    = 16;
+static const size_t HASH_LAST_STRIPE_SECRET = 9;
+static const size_t HASH_MERGE_SECRET       = 11;
+
+static const uint64_t HASH_PRIME32_1 = 0x9E3779B1u;
+static const uint64_t HASH_PRIME32_2 = 0x85EBCA77u;
+static const uint64_t HASH_PRIME32_3 = 0xC2B2AE3Du;
+static const uint64_t HASH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64_t HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t HASH_PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64_t HASH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t HASH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+// Output of splitmix64. Stripe n is keyed with the words starting at n
+alignas(64) static const uint64_t HASH_SECRET[HASH_SECRET_WORDS] = {
+    0xe220a8397b1dcdafull, 0x6e789e6aa1b965f4ull, 0x06c45d188009454full,
+    0xf88bb8a8724c81ecull, 0x1b39896a51a8749bull, 0x53cb9f0c747ea2eaull,
+    0x2c829abe1f4532e1ull, 0xc584133ac916ab3cull, 0x3ee5789041c98ac3ull,
+    0xf3b8488c368cb0a6ull, 0x657eecdd3cb13d09ull, 0xc2d326e0055bdef6ull,
+    0x8621a03fe0bbdb7bull, 0x8e1f7555983aa92full, 0xb54e0f1600cc4d19ull,
+    0x84bb3f97971d80abull, 0x7d29825c75521255ull, 0xc3cf17102b7f7f86ull,
+    0x3466e9a083914f64ull, 0xd81a8d2b5a4485acull, 0xdb01602b100b9ed7ull,
+    0xa9038a921825f10dull, 0xedf5f1d90dca2f6aull, 0x54496ad67bd2634cull,
+};
+
+inline uint64_t read64(const uint8_t* ptr) {
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+inline uint32_t read32(const uint8_t* ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+// Multiply to 128 bits and fold the halves together
+inline uint64_t mul_fold64(uint64_t lhs, uint64_t rhs) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t) lhs * rhs;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    uint64_t low = _umul128(lhs, rhs, &high);
+    return low ^ high;
+#else
+    uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t high  = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t low   = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return low ^ high;
+#endif
+}
+
+inline uint64_t avalanche(uint64_t hash) {
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+inline uint64_t mix16(const uint8_t* data, const uint64_t* secret, uint64_t seed) {
+    return mul_fold64(read64(data) ^ (secret[0] + seed), read64(data + 8) ^ (secret[1] - seed));
+}
+
+// Feed num_stripes stripes into the accumulators. Stripe i is keyed with the
+// secret words starting at secret + i
+inline void accumulate(uint64_t* acc, const uint8_t* data, const uint64_t* secret,
+                       size_t num_stripes) {
+#if defined(HASH_AVX2)
+    __m256i acc_vec[2] = { _mm256_loadu_si256((const __m256i*) acc),
+                           _mm256_loadu_si256((const __m256i*) (acc + 4)) };
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        const uint8_t* stripe_data = data + stripe * HASH_STRIPE_SIZE;
+        for (size_t i = 0; i < 2; i++) {
+            __m256i data_vec = _mm256_loadu_si256((const __m256i*) (stripe_data + i * 32));
+            __m256i key_vec  = _mm256_loadu_si256((const __m256i*) (secret + stripe + i * 4));
+            __m256i data_key = _mm256_xor_si256(data_vec, key_vec);
+            // Low 32 bits of each lane times the high 32 bits
+            __m256i product = _mm256_mul_epu32(
+                data_key, _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+            // Each lane also takes its neighbor's data
+            __m256i swapped = _mm256_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            acc_vec[i] = _mm256_add_epi64(acc_vec[i], _mm256_add_epi64(product, swapped));
+        }
+    }
+    _mm256_storeu_si256((__m256i*) acc, acc_vec[0]);
+    _mm256_storeu_si256((__m256i*) (acc + 4), acc_vec[1]);
+#elif defined(HASH_SSE2)
+    __m128i acc_vec[4];
+    for (size_t i = 0; i < 4; i++) {
+        acc_vec[i] = _mm_loadu_si128((const __m128i*) (acc + i * 2));
+    }
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        const uint8_t* stripe_data = data + stripe * HASH_STRIPE_SIZE;
+        for (size_t i = 0; i < 4; i++) {
+            __m128i data_vec = _mm_loadu_si128((const __m128i*) (stripe_data + i * 16));
+            __m128i key_vec  = _mm_loadu_si128((const __m128i*) (secret + stripe + i * 2));
+            __m128i data_key = _mm_xor_si128(data_vec, key_vec);
+            __m128i product
+                = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            acc_vec[i]      = _mm_add_epi64(acc_vec[i], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (size_t i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*) (acc + i * 2), acc_vec[i]);
+    }
+#elif defined(HASH_NEON)
+    uint64x2_t acc_vec[4];
+    for (size_t i = 0; i < 4; i++) {
+        acc_vec[i] = vld1q_u64(acc + i * 2);
+    }
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        const uint8_t* stripe_data = data + stripe * HASH_STRIPE_SIZE;
+        for (size_t i = 0; i < 4; i++) {
+            uint64x2_t data_vec = vreinterpretq_u64_u8(vld1q_u8(stripe_data + i * 16));
+            uint64x2_t key_vec  = vld1q_u64(secret + stripe + i * 2);
+            uint64x2_t data_key = veorq_u64(data_vec, key_vec);
+            uint64x2_t product  = vmull_u32(vmovn_u64(data_key), vshrn_n_u64(data_key, 32));
+            uint64x2_t swapped  = vextq_u64(data_vec, data_vec, 1);
+            acc_vec[i]          = vaddq_u64(acc_vec[i], vaddq_u64(product, swapped));
+        }
+    }
+    for (size_t i = 0; i < 4; i++) {
+        vst1q_u64(acc + i * 2, acc_vec[i]);
+    }
+#else
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        const uint8_t* stripe_data = data + stripe * HASH_STRIPE_SIZE;
+        for (size_t i = 0; i < 8; i++) {
+            uint64_t data_value = read64(stripe_data + i * 8);
+            uint64_t data_key   = data_value ^ secret[stripe + i];
+            acc[i ^ 1] += data_value;
+            acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+        }
+    }
+#endif
+}
+
+// Once per block, so it isn't worth vectorizing
+inline void scramble(uint64_t* acc) {
+    for (size_t i = 0; i < 8; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= HASH_SECRET[HASH_SCRAMBLE_SECRET + i];
+        acc[i] *= HASH_PRIME32_1;
+    }
+}
+
+inline uint64_t hash64_short(const uint8_t* data, size_t size, uint64_t seed) {
+    const uint64_t* secret = HASH_SECRET;
+
+    if (size > 16) {
+        // Up to four 16 byte lanes, the last one overlapping the end
+        uint64_t hash = size * HASH_PRIME64_1;
+        size_t lane   = 0;
+        for (; lane * 16 + 16 < size; lane++) {
+            hash += mix16(data + lane * 16, secret + lane * 2, seed);
+        }
+        hash += mix16(data + size - 16, secret + 6, seed);
+        return avalanche(hash);
+    }
+
+    if (size >= 8) {
+        uint64_t low  = read64(data) ^ (secret[0] + seed);
+        uint64_t high = read64(data + size - 8) ^ (secret[1] - seed);
+        return avalanche(size * HASH_PRIME64_1 + mul_fold64(low, high));
+    }
+
+    if (size >= 4) {
+        uint64_t value = read32(data) | ((uint64_t) read32(data + size - 4) << 32);
+        return avalanche(mul_fold64(value ^ (secret[2] + seed), HASH_PRIME64_1 ^ size));
+    }
+
+    if (size > 0) {
+        uint64_t value = ((uint64_t) data[0] << 16) | ((uint64_t) data[size >> 1] << 24)
+                         | data[size - 1] | ((uint64_t) size << 8);
+        return avalanche(mul_fold64(value ^ (secret[3] + seed), HASH_PRIME64_2));
+    }
+
+    return avalanche(seed ^ secret[4]);
+}
+
+inline uint64_t hash64_long(const uint8_t* data, size_t size, uint64_t seed) {
+    uint64_t acc[8] = { HASH_PRIME32_3 + seed, HASH_PRIME64_1 - seed, HASH_PRIME64_2 + seed,
+                        HASH_PRIME64_3 - seed, HASH_PRIME64_4 + seed, HASH_PRIME32_2 - seed,
+                        HASH_PRIME64_5 + seed, HASH_PRIME32_1 - seed };
+
+    // Every full stripe but the last, in blocks
+    size_t num_stripes = (size - 1) / HASH_STRIPE_SIZE;
+    size_t block_size  = HASH_STRIPES_PER_BLOCK * HASH_STRIPE_SIZE;
+    size_t num_blocks  = num_stripes / HASH_STRIPES_PER_BLOCK;
+    for (size_t block = 0; block < num_blocks; block++) {
+        accumulate(acc, data + block * block_size, HASH_SECRET, HASH_STRIPES_PER_BLOCK);
+        scramble(acc);
+    }
+    accumulate(acc, data + num_blocks * block_size, HASH_SECRET,
+               num_stripes - num_blocks * HASH_STRIPES_PER_BLOCK);
+
+    // The last 64 bytes, overlapping what came before
+    accumulate(acc, data + size - HASH_STRIPE_SIZE, HASH_SECRET + HASH_LAST_STRIPE_SECRET, 1);
+
+    uint64_t hash = size * HASH_PRIME64_1;
+    for (size_t i = 0; i < 4; i++) {
+        hash += mul_fold64(acc[i * 2] ^ HASH_SECRET[HASH_MERGE_SECRET + i * 2],
+                           acc[i * 2 + 1] ^ HASH_SECRET[HASH_MERGE_SECRET + i * 2 + 1]);
+    }
+    return avalanche(hash);
+}
+
+}    // namespace Detail
+
+inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0) {
+    if (size <= Detail::HASH_STRIPE_SIZE) {
+        return Detail::hash64_short((const uint8_t*) data, size, seed);
+    }
+    return Detail::hash64_long((const uint8_t*) data, size, seed);
+}
+
 template <>
 struct Hash< const char* > {
     inline size_t operator()(const char* string) const {
-        return djb2_hash(string);
+        return hash64(string, strlen(string));
     }
 };
 
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #include <vector>
+#include <memory>
 #include <algorithm>
+#include <string>
 
 #include <glm/glm.hpp>
 
@@ -9,6 +11,7 @@
 #include "file_system.h"
 #include "vulkan_resource_manager.h"
 #include "memory.h"
+#include "platform.h"
 
 #include "demos/demo.h"
 #include "demos/triangle.h"
@@ -27,13 +30,13 @@ static Demo* demos[] = {
 };
 static int current_demo_index = -1;
 
-void end_demo(int demo_index, Vulkan::App& app);
+void end_demo(int demo_index, Vulkan::App& app, Vulkan::ResourceManager& resource_manager);
 
 void start_demo(int demo_index,
                 Vulkan::App& app,
                 Vulkan::ResourceManager& resource_manager,
                 Memory::VirtualHeap& demo_heap) {
-    if (demo_index < 0 || demo_index >= ARRAYSIZE(demos)) {
+    if (demo_index < 0 || demo_index >= ARRAY_LENGTH(demos)) {
         return;
     }
     if (current_demo_index == demo_index) {
@@ -41,11 +44,13 @@ void start_demo(int demo_index,
     }
 
     // Destroy current demo
-    end_demo(demo_index, app);
+    end_demo(current_demo_index, app, resource_manager);
     resource_manager.clear();
     demo_heap.clear();
 
     current_demo_index = demo_index;
+
+    MEMORY_TAG("demo_init");
     demos[current_demo_index]->init(app, resource_manager, demo_heap);
 }
 
@@ -53,21 +58,63 @@ void step_demo(int demo_index,
                Vulkan::App& app, 
                Vulkan::ResourceManager& resource_manager,
                Memory::VirtualHeap& frame_heap) {
+    MEMORY_TAG("demo_render");
     demos[demo_index]->render(app, resource_manager, frame_heap);
 }
 
-void end_demo(int demo_index, Vulkan::App& app) {
+// Doesn't wait for the device, the demo's objects are destroyed once the frames in flight that
+// use them have finished
+void end_demo(int demo_index, Vulkan::App& app, Vulkan::ResourceManager& resource_manager) {
     if (demo_index < 0) {
         return;
     }
-    app.wait_for_device();
-    demos[demo_index]->destroy(app);
+    demos[demo_index]->destroy(app, resource_manager);
+}
+
+// Shaders are loaded from here, relative to the working directory which is also the mounted folder
+static const char* SHADER_DIRECTORY = "shaders";
+
+// Hot reload shaders rebuilt while the app is running. Reflection files sit next to their SPIR-V,
+// eg. test.vert.refl for test.vert.spv, and modules are reflected from the SPIR-V, so a changed
+// reflection file only re-checks its SPIR-V
+void reload_changed_shaders(Platform::DirectoryWatcher& shader_watcher,
+                            Vulkan::ResourceManager& resource_manager) {
+    std::vector< std::string > changed;
+    shader_watcher.poll([&changed](const char* file_name) {
+        std::string path = std::string(SHADER_DIRECTORY) + "/" + file_name;
+        size_t extension = path.rfind('.');
+        if (extension == std::string::npos) {
+            return;
+        }
+
+        std::string suffix = path.substr(extension);
+        if (suffix == ".refl" || suffix == ".json") {
+            path.replace(extension, std::string::npos, ".spv");
+        } else if (suffix != ".spv") {
+            return;
+        }
+
+        if (std::find(changed.begin(), changed.end(), path) == changed.end()) {
+            changed.push_back(path);
+        }
+    });
+    if (changed.empty()) {
+        return;
+    }
+
+    std::vector< const char* > paths;
+    for (const std::string& path : changed) {
+        paths.push_back(path.c_str());
+    }
+    resource_manager.reload_shader_modules(paths.data(), paths.size());
 }
 
 int main() {
-    Memory::VirtualHeap app_heap(GB(8));
+    // Long lived objects which are created and destroyed at runtime
+    Memory::TLSFAllocator app_heap(GB(8));
     Memory::VirtualHeap demo_heap(GB(8));
-    Memory::VirtualHeap frame_heap(GB(8));
+    app_heap.set_name("app_heap");
+    demo_heap.set_name("demo_heap");
 
     // Load external resources
     FileSystem::initialize("./");
@@ -78,22 +125,67 @@ int main() {
     device_config.instance_extensions = std::vector< const char* >({ "VK_EXT_debug_utils" });
     device_config.device_extensions
         = std::vector< const char* >({ VK_KHR_SWAPCHAIN_EXTENSION_NAME });
+    device_config.optional_device_extensions
+        = std::vector< const char* >({ VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME });
 
     Vulkan::App app(800, 600, "App", device_config);
 
-    Vulkan::ResourceManager resource_manager(app, app_heap);
+    // One frame heap per frame in flight. A frame's heap is only cleared once
+    // the GPU has signaled that frame's fence, so it can hold data the GPU
+    // still reads. They're cleared and refilled every frame, so back them with
+    // huge pages and fault them in as they grow rather than during the first
+    // frames.
+    std::vector< std::unique_ptr< Memory::VirtualHeap > > frame_heaps;
+    for (unsigned int i = 0; i < app.max_rendering_frames; i++) {
+        frame_heaps.emplace_back(new Memory::VirtualHeap(
+            GB(4), Platform::VIRTUAL_MEMORY_TRANSPARENT_HUGE_PAGES | Platform::VIRTUAL_MEMORY_PREFAULT));
+        frame_heaps.back()->set_name("frame_heap");
+    }
+
+    // Relative to the working directory, like the shaders
+    Vulkan::ResourceManager resource_manager(app, app_heap, "pipeline_cache.bin");
 
     start_demo(0, app, resource_manager, demo_heap);
 
+    Platform::DirectoryWatcher shader_watcher(SHADER_DIRECTORY);
+
+#ifdef MEMORY_TRACKING
+    bool dump_key_was_down = false;
+#endif
+
     // Render loop
     while (!glfwWindowShouldClose(app.window)) {
         glfwPollEvents();
+
+#ifdef MEMORY_TRACKING
+        // F12 writes a snapshot of the allocator stats
+        bool dump_key_down = glfwGetKey(app.window, GLFW_KEY_F12) == GLFW_PRESS;
+        if (dump_key_down && !dump_key_was_down) {
+            MEMORY_DUMP_STATS("memory_stats.json");
+        }
+        dump_key_was_down = dump_key_down;
+#endif
+        MEMORY_NEW_FRAME();
+
+        unsigned int frame = app.begin_frame();
+        Memory::VirtualHeap& frame_heap = *frame_heaps[frame];
         frame_heap.clear();
+        resource_manager.begin_frame();
+        reload_changed_shaders(shader_watcher, resource_manager);
+
         step_demo(current_demo_index, app, resource_manager, frame_heap);
     }
 
-    // Clean up resources
-    end_demo(current_demo_index, app);
+    MEMORY_DUMP_STATS("memory_stats.json");
+
+    // Clean up resources. The resource manager idles the device and flushes its deletion queue
+    // when it's destroyed
+    end_demo(current_demo_index, app, resource_manager);
+
+    for (unsigned int i = 0; i < frame_heaps.size(); i++) {
+        LOG_DEBUG("Frame heap %u: %zu bytes committed, %zu bytes resident", i,
+                  frame_heaps[i]->committed_bytes(), frame_heaps[i]->resident_bytes());
+    }
 
     // Deinit fs
     FileSystem::deinit();
@@ -4,6 +4,9 @@
 #include "platform.h"
 
 #include <algorithm>
+#ifdef MEMORY_TRACKING
+#include <mutex>
+#endif
 
 namespace Memory {
 
@@ -26,23 +29,41 @@ void* Arena::push(size_t size, size_t align) {
 
     // If it fits, update the total used bytes in the arena and return the
     // result
+#ifdef MEMORY_TRACKING
+    if (stats) {
+        stats->record_allocation(size, (buffer.size - unused) + size - used);
+    }
+#endif
+
     used = (buffer.size - unused) + size;
+
     return aligned_top;
 }
 
 void Arena::clear() {
+#ifdef MEMORY_TRACKING
+    if (stats) {
+        stats->record_free(used);
+    }
+#endif
     used = 0;
 }
 
 void Arena::reset() {
-    used = 0;
+    clear();
     buffer.size = 0;
 }
 
 void Arena::rewind(void* ptr) {
     ASSERT(this->inside(ptr));
 
-    used = (uint8_t*) ptr - buffer.data;
+    size_t new_used = (uint8_t*) ptr - buffer.data;
+#ifdef MEMORY_TRACKING
+    if (stats) {
+        stats->record_free(used - new_used);
+    }
+#endif
+    used = new_used;
 }
 
 void* Arena::top() {
@@ -53,12 +74,40 @@ bool Arena::inside(void* ptr) {
     return (uint8_t*) ptr >= buffer.data && (uint8_t*) ptr <= (uint8_t*) this->top();
 }
 
-VirtualHeap::VirtualHeap(size_t reserve_size) {
-    arena.buffer.data = (uint8_t*) Platform::virtual_reserve(reserve_size, num_pages_reserved);
+VirtualHeap::VirtualHeap(size_t reserve_size, uint32_t flags)
+    : flags(flags) {
+    arena.buffer.data = (uint8_t*) Platform::virtual_reserve(reserve_size, num_pages_reserved, flags);
+    ASSERT_MSG(arena.buffer.data, "Failed to reserve %zu bytes", reserve_size);
+#ifdef MEMORY_TRACKING
+    arena.stats = &stats;
+#endif
+}
+
+VirtualHeap::VirtualHeap(void* reserved_base, size_t reserved_size, uint32_t flags)
+    : num_pages_reserved(reserved_size / Platform::get_page_size())
+    , flags(flags)
+    , owns_reservation(false) {
+    ASSERT(((size_t) reserved_base & (Platform::get_page_size() - 1)) == 0);
+    arena.buffer.data = (uint8_t*) reserved_base;
+#ifdef MEMORY_TRACKING
+    arena.stats = &stats;
+#endif
 }
 
 VirtualHeap::~VirtualHeap() {
-    Platform::virtual_release(arena.buffer.data);
+    if (owns_reservation) {
+        Platform::virtual_release(arena.buffer.data, num_pages_reserved * Platform::get_page_size());
+    } else if (!Platform::virtual_decommit(arena.buffer.data, committed_bytes(), flags)) {
+        LOG_ERROR("Failed to decommit %zu bytes", committed_bytes());
+    }
+}
+
+size_t VirtualHeap::committed_bytes() const {
+    return num_pages_committed * Platform::get_page_size();
+}
+
+size_t VirtualHeap::resident_bytes() {
+    return Platform::virtual_resident_bytes(arena.buffer.data, committed_bytes());
 }
 
 void* VirtualHeap::allocate_data(size_t size, size_t align) {
@@ -76,16 +125,20 @@ void* VirtualHeap::allocate_data(size_t size, size_t align) {
     size_t size_needed = num_pages_committed == 0 ? size : std::max(arena.buffer.size, size + align) * GROWTH_FACTOR;
 
     // If growth size required > amount reserved, panic
-    ASSERT_MSG(num_pages_reserved >= Platform::get_num_pages(size_needed),
-               "Cannot commit (%llu) pages more than reserved (%llu) pages",
+    ASSERT_MSG(num_pages_reserved >= num_pages_committed + Platform::get_num_pages(size_needed),
+               "Cannot commit (%zu) pages more than reserved (%zu) pages",
                Platform::get_num_pages(size_needed), num_pages_reserved);
 
     // Commit additional memory in reserved region
     size_t pages_committed;
-    Platform::virtual_commit(arena.buffer.data + num_pages_committed * Platform::get_page_size(), size_needed, pages_committed);
+    Platform::virtual_commit(arena.buffer.data + num_pages_committed * Platform::get_page_size(),
+                             size_needed, pages_committed, flags);
 
     // Add to pages committed
     num_pages_committed += pages_committed;
+#ifdef MEMORY_TRACKING
+    stats.record_commit(pages_committed * Platform::get_page_size());
+#endif
 
     // Increase the size of the arena to the total number of pages
     // committed
@@ -101,12 +154,20 @@ void VirtualHeap::clear() {
 }
 
 void VirtualHeap::release() {
+    // Give the committed pages back but keep the address range reserved
+    if (!Platform::virtual_decommit(arena.buffer.data, committed_bytes(), flags)) {
+        LOG_ERROR("Failed to decommit %zu bytes", committed_bytes());
+    }
+#ifdef MEMORY_TRACKING
+    stats.record_decommit(committed_bytes());
+#endif
     arena.reset();
-    Platform::virtual_decommit(arena.buffer.data, arena.buffer.size);
+    num_pages_committed = 0;
 }
 
 LinearAllocator::LinearAllocator(size_t size, IAllocator& backing_allocator)
-    : backing_allocator(backing_allocator) {
+    : initial_size(size)
+    , backing_allocator(backing_allocator) {
 }
 
 LinearAllocator::~LinearAllocator() {
@@ -117,86 +178,214 @@ Arena* LinearAllocator::append_arena(Arena* parent, size_t size) {
     // Request a new arena from backing arena or virtual memory and append
     // it to an existing arena
 
-    Arena* new_arena = nullptr;
-    size_t buffer_size = 0;
-    // Push a new arena onto backing arena
-    buffer_size = size;
-    new_arena = (Arena*) backing_allocator.allocate<uint8_t>(sizeof(Arena) + buffer_size);
+    // Push a new arena onto backing arena. The arena metadata lives at the
+    // front of the block
+    void* block = backing_allocator.allocate_data(sizeof(Arena) + size, alignof(Arena));
+    Arena* new_arena = new (block) Arena();
 
     // Fill in the buffer info for the new arena
     // The start of the buffer is right after the arena metadata we allocated
     new_arena->buffer.data = (uint8_t*) (new_arena + 1);
-    new_arena->buffer.size = buffer_size;
+    new_arena->buffer.size = size;
+#ifdef MEMORY_TRACKING
+    new_arena->stats = &stats;
+    stats.record_commit(sizeof(Arena) + size);
+#endif
 
     // Append this new arena to the parent arena if it exists
     if (parent) {
         parent->next = new_arena;
     }
-    
+
+    last_arena = new_arena;
+    num_arenas++;
+
     return new_arena;
 }
 
+void LinearAllocator::index_arena(Arena* arena) {
+    // Full arenas aren't indexed; nothing can be allocated from them
+    size_t remaining = arena->remaining();
+    if (remaining == 0) {
+        return;
+    }
+
+    size_t size_class = Utils::bit_scan_reverse(remaining);
+
+    arena->prev_free = nullptr;
+    arena->next_free = free_lists[size_class];
+    if (arena->next_free) {
+        arena->next_free->prev_free = arena;
+    }
+    free_lists[size_class] = arena;
+    free_list_bitmap |= (uint64_t) 1 << size_class;
+}
+
+void LinearAllocator::unindex_arena(Arena* arena) {
+    // The size class is derived from the remaining space, so this must be
+    // called before pushing onto the arena
+    size_t size_class = Utils::bit_scan_reverse(arena->remaining());
+
+    if (arena->prev_free) {
+        arena->prev_free->next_free = arena->next_free;
+    } else {
+        ASSERT(free_lists[size_class] == arena);
+        free_lists[size_class] = arena->next_free;
+        if (!free_lists[size_class]) {
+            free_list_bitmap &= ~((uint64_t) 1 << size_class);
+        }
+    }
+
+    if (arena->next_free) {
+        arena->next_free->prev_free = arena->prev_free;
+    }
+
+    arena->next_free = nullptr;
+    arena->prev_free = nullptr;
+}
+
+Arena* LinearAllocator::find_arena(size_t size_needed) {
+    // Best fit: the smallest size class an arena that fits could be in is
+    // floor(log2(size_needed)). Arenas in that class may or may not fit, so
+    // only check the head of the list. Every arena in a larger class fits, so
+    // take the head of the smallest non-empty one.
+    size_t size_class = Utils::bit_scan_reverse(size_needed);
+
+    Arena* candidate = free_lists[size_class];
+    if (candidate && candidate->remaining() >= size_needed) {
+        return candidate;
+    }
+
+    if (size_class + 1 >= NUM_SIZE_CLASSES) {
+        return nullptr;
+    }
+
+    uint64_t larger_classes = free_list_bitmap & ~(((uint64_t) 2 << size_class) - 1);
+    if (!larger_classes) {
+        return nullptr;
+    }
+
+    return free_lists[Utils::bit_scan_forward(larger_classes)];
+}
+
 void* LinearAllocator::allocate_data(size_t size, size_t align) {
     // If the alignment is not a power of 2, set it to 16
     if (!Utils::is_power_of_2(align)) {
         align = 16;
     }
 
+    // Worst case space needed to fit the allocation at any alignment of the
+    // arena top
+    size_t size_needed = std::max< size_t >(size + align - 1, 1);
+
     //Check if root arena exists
     if (!root_arena) {
         // No root arena exists, append a new one
+        root_arena = append_arena(nullptr, std::max(initial_size, size_needed));
+        index_arena(root_arena);
+    }
 
-        root_arena = append_arena(nullptr, size);
+    if (scope_depth > 0) {
+        return push_stack(size, size_needed, align);
     }
 
-    // Iterate through current arenas, starting at the root arena. 
-    // If any has enough space, allocate and return the pointer. 
-    // If not, create a new arena at the end of the chain.
-    //
-    // TODO: Look into ways to speed this up, EG maintain a bitfield
-    // and a fixed list of offsets to skip to an arena which best fits
-    Arena* current_arena = root_arena;
-    void* result = nullptr;
-    while (current_arena != nullptr) {
-        // Attempt to push onto the current arena
-        result = current_arena->push(size, align);
+    // Look up an arena with enough space in the free space index. If none
+    // fit, request a new one from the backing allocator and append it to the
+    // end of the chain.
+    Arena* arena = find_arena(size_needed);
+    if (arena) {
+        unindex_arena(arena);
+    } else {
+        arena = append_arena(last_arena, LinearAllocator::GROWTH_FACTOR
+                                             * std::max(size_needed, last_arena->buffer.size));
+    }
+
+    void* result = arena->push(size, align);
+    ASSERT(result);
+
+    // Re-file the arena under its new remaining space
+    index_arena(arena);
+
+    return result;
+}
+
+void* LinearAllocator::push_stack(size_t size, size_t size_needed, size_t align) {
+    // Arenas after the stack arena are empty and not indexed. Move through
+    // them until the allocation fits, appending a new one if none do
+    while (true) {
+        void* result = stack_arena->push(size, align);
         if (result) {
-            // Can push onto current arena. Return the result.
-            break;
+            return result;
         }
 
-        // Can't push onto arena, move onto the next
-        // If there's no next, request a arena that will fit and return
-        if (!current_arena->next) {
-            // None of the current arenas fit. Request a new one from 
-            // backing arena or virtual memory
-            Arena* new_arena = append_arena(
-                current_arena, LinearAllocator::GROWTH_FACTOR * std::max(size, current_arena->buffer.size));
+        if (stack_arena->next) {
+            stack_arena = stack_arena->next;
+        } else {
+            stack_arena = append_arena(last_arena, LinearAllocator::GROWTH_FACTOR
+                                                       * std::max(size_needed, last_arena->buffer.size));
+        }
+    }
+}
 
-            // Push onto new arena
-            result = new_arena->push(size, align);
+LinearAllocator::Marker LinearAllocator::begin_scope() {
+    if (!root_arena) {
+        root_arena = append_arena(nullptr, initial_size);
+        index_arena(root_arena);
+    }
 
-            break;
-        } else {
-            // Else, move on to next arena
-            current_arena = current_arena->next;
+    if (scope_depth == 0) {
+        // Switch to stack mode on the last arena. It's the only one which
+        // can have anything after it, and none of what's after is indexed.
+        stack_arena = last_arena;
+        if (stack_arena->remaining() > 0) {
+            unindex_arena(stack_arena);
         }
     }
+    scope_depth++;
 
-    return result;
+    return { stack_arena, stack_arena->used };
+}
+
+void LinearAllocator::end_scope(const Marker& marker) {
+    ASSERT_MSG(scope_depth > 0, "end_scope called without a matching begin_scope");
+
+    // Everything after the marker was allocated inside the scope
+    for (Arena* arena = marker.arena->next; arena; arena = arena->next) {
+        arena->clear();
+    }
+    marker.arena->rewind(marker.arena->buffer.data + marker.used);
+    stack_arena = marker.arena;
+    scope_depth--;
+
+    // Leaving the outermost scope, so hand the stack arenas back to the index
+    if (scope_depth == 0) {
+        for (Arena* arena = marker.arena; arena; arena = arena->next) {
+            index_arena(arena);
+        }
+        stack_arena = nullptr;
+    }
 }
 
 void LinearAllocator::clear() {
-    // Iterate through all the arenas and reset the used memory to 0
+    ASSERT_MSG(scope_depth == 0, "Cannot clear a LinearAllocator with open scopes");
+
+    // Iterate through all the arenas and reset the used memory to 0. Every
+    // arena is empty again, so rebuild the index from scratch
+    memset(free_lists, 0, sizeof(free_lists));
+    free_list_bitmap = 0;
+
     Arena* current_arena = root_arena;
     while (current_arena) {
-        current_arena->reset();
+        current_arena->clear();
+        index_arena(current_arena);
         current_arena = current_arena->next;
     }
 }
 
 
 void LinearAllocator::release() {
+    ASSERT_MSG(scope_depth == 0, "Cannot release a LinearAllocator with open scopes");
+
     // Iterate through all the arenas and free them. Set the root arena
     // to null
     Arena* current_arena = root_arena;
@@ -204,9 +393,766 @@ void LinearAllocator::release() {
         Arena* arena_to_free = current_arena;
         current_arena = current_arena->next;
 
+#ifdef MEMORY_TRACKING
+        arena_to_free->clear();
+        stats.record_decommit(sizeof(Arena) + arena_to_free->buffer.size);
+#endif
         backing_allocator.free(arena_to_free);
     }
     root_arena = nullptr;
+    last_arena = nullptr;
+    num_arenas = 0;
+
+    memset(free_lists, 0, sizeof(free_lists));
+    free_list_bitmap = 0;
+}
+
+// Each thread remembers which slot it was given in each registry it has
+// allocated from. A registry's slices are never handed back while it's alive,
+// so registries are meant for long lived worker threads
+struct ThreadHeapsSlot {
+    uint32_t registry_id = 0;
+    size_t index         = 0;
+};
+static const size_t MAX_THREAD_HEAPS_PER_THREAD = 8;
+static thread_local ThreadHeapsSlot thread_heaps_slots[MAX_THREAD_HEAPS_PER_THREAD];
+static std::atomic< uint32_t > next_thread_heaps_id(1);
+
+// Ids of the registries that are alive. Registries can't reach into other
+// threads' slots when they're destroyed, so threads treat a slot whose
+// registry is gone as unused instead. Ids are never reused
+static const size_t MAX_LIVE_THREAD_HEAPS = 64;
+static std::atomic< uint32_t > live_thread_heaps[MAX_LIVE_THREAD_HEAPS];
+
+static bool is_thread_heaps_live(uint32_t id) {
+    for (size_t i = 0; i < MAX_LIVE_THREAD_HEAPS; i++) {
+        if (live_thread_heaps[i].load(std::memory_order_acquire) == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ThreadHeaps::ThreadHeaps(size_t max_threads, size_t slice_size, uint32_t flags)
+    : max_threads(max_threads)
+    , num_threads(0)
+    , id(next_thread_heaps_id.fetch_add(1)) {
+    size_t live_index = 0;
+    for (; live_index < MAX_LIVE_THREAD_HEAPS; live_index++) {
+        uint32_t expected = 0;
+        if (live_thread_heaps[live_index].compare_exchange_strong(expected, id)) {
+            break;
+        }
+    }
+    if (live_index == MAX_LIVE_THREAD_HEAPS) {
+        RUNTIME_ERROR("At most %zu ThreadHeaps can be alive at once", MAX_LIVE_THREAD_HEAPS);
+    }
+
+    // Align slices so that huge pages can back them if requested
+    size_t page_size = (flags & (Platform::VIRTUAL_MEMORY_TRANSPARENT_HUGE_PAGES
+                                 | Platform::VIRTUAL_MEMORY_EXPLICIT_HUGE_PAGES))
+                           ? Platform::get_huge_page_size()
+                           : Platform::get_page_size();
+    slice_size          = ((slice_size + page_size - 1) / page_size) * page_size;
+    size_t slots_size   = ((max_threads * sizeof(Slot) + page_size - 1) / page_size) * page_size;
+
+    // Heap metadata lives at the front of the reservation, followed by a
+    // slice per thread
+    reservation = (uint8_t*) Platform::virtual_reserve(slots_size + max_threads * slice_size,
+                                                       reservation_pages, flags);
+    if (!reservation) {
+        RUNTIME_ERROR("Failed to reserve %zu thread heaps", max_threads);
+    }
+
+    size_t pages_committed;
+    Platform::virtual_commit(reservation, slots_size, pages_committed, flags);
+
+    slots = (Slot*) reservation;
+    for (size_t i = 0; i < max_threads; i++) {
+        new (&slots[i]) Slot(reservation + slots_size + i * slice_size, slice_size, flags);
+        slots[i].heap.set_name("ThreadHeaps slice");
+    }
+}
+
+ThreadHeaps::~ThreadHeaps() {
+    for (size_t i = 0; i < max_threads; i++) {
+        slots[i].~Slot();
+    }
+    Platform::virtual_release(reservation, reservation_pages * Platform::get_page_size());
+
+    // Frees up the slot every thread that used this registry kept for it
+    for (size_t i = 0; i < MAX_LIVE_THREAD_HEAPS; i++) {
+        uint32_t expected = id;
+        if (live_thread_heaps[i].compare_exchange_strong(expected, 0)) {
+            break;
+        }
+    }
+}
+
+VirtualHeap& ThreadHeaps::local() {
+    // Look for this registry in the thread's slots, remembering the first
+    // unused entry in case this thread hasn't been here before
+    ThreadHeapsSlot* unused = nullptr;
+    for (size_t i = 0; i < MAX_THREAD_HEAPS_PER_THREAD; i++) {
+        ThreadHeapsSlot& slot = thread_heaps_slots[i];
+        if (slot.registry_id == id) {
+            return slots[slot.index].heap;
+        }
+        if (!unused && slot.registry_id == 0) {
+            unused = &slot;
+        }
+    }
+
+    // Every slot is taken, reuse one left behind by a destroyed registry
+    for (size_t i = 0; !unused && i < MAX_THREAD_HEAPS_PER_THREAD; i++) {
+        if (!is_thread_heaps_live(thread_heaps_slots[i].registry_id)) {
+            unused = &thread_heaps_slots[i];
+        }
+    }
+    if (!unused) {
+        RUNTIME_ERROR("A thread can use at most %zu ThreadHeaps", MAX_THREAD_HEAPS_PER_THREAD);
+    }
+
+    size_t index = num_threads.fetch_add(1);
+    if (index >= max_threads) {
+        RUNTIME_ERROR("More than %zu threads allocated from ThreadHeaps", max_threads);
+    }
+
+    unused->registry_id = id;
+    unused->index       = index;
+    return slots[index].heap;
+}
+
+VirtualHeap& ThreadHeaps::get(size_t thread_index) {
+    ASSERT(thread_index < max_threads);
+    return slots[thread_index].heap;
+}
+
+void ThreadHeaps::reset() {
+    size_t count = std::min(thread_count(), max_threads);
+    for (size_t i = 0; i < count; i++) {
+        slots[i].heap.clear();
+    }
+}
+
+ScratchScope::ScratchScope(VirtualHeap& heap)
+    : allocator(heap)
+    , heap(&heap)
+    , heap_marker(heap.get_marker()) {
+}
+
+ScratchScope::ScratchScope(LinearAllocator& allocator)
+    : allocator(allocator)
+    , linear(&allocator)
+    , linear_marker(allocator.begin_scope()) {
+}
+
+ScratchScope::~ScratchScope() {
+    if (heap) {
+        heap->rewind(heap_marker);
+    } else {
+        linear->end_scope(linear_marker);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// TLSF /////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Block layout, see http://www.gii.upv.es/tlsf/
+//
+// Only the size word is always valid. prev_phys lives in the last word of
+// the previous block's payload and is only valid when that block is free.
+// The free list links live in the payload and are only valid when this block
+// is free. A used block therefore costs one word of overhead.
+struct TLSFAllocator::Block {
+    Block* prev_phys;
+    // Payload size. The low bits are flags since sizes are ALIGN_SIZE aligned
+    size_t size;
+    Block* next_free;
+    Block* prev_free;
+
+    static const size_t FREE_BIT      = 1 << 0;
+    static const size_t PREV_FREE_BIT = 1 << 1;
+
+    // Overhead of a used block, and offset from the block to its payload
+    static const size_t OVERHEAD       = sizeof(size_t);
+    static const size_t PAYLOAD_OFFSET = sizeof(Block*) + sizeof(size_t);
+    // A free block must be able to hold its links and the next block's
+    // prev_phys
+    static const size_t MIN_SIZE = sizeof(Block*) * 3;
+    static const size_t MAX_SIZE = (size_t) 1 << FL_INDEX_MAX;
+
+    inline size_t get_size() const {
+        return size & ~(FREE_BIT | PREV_FREE_BIT);
+    }
+    inline void set_size(size_t new_size) {
+        size = new_size | (size & (FREE_BIT | PREV_FREE_BIT));
+    }
+    inline bool is_free() const {
+        return size & FREE_BIT;
+    }
+    inline bool is_prev_free() const {
+        return size & PREV_FREE_BIT;
+    }
+    inline void set_prev_free(bool prev_free) {
+        size = prev_free ? size | PREV_FREE_BIT : size & ~PREV_FREE_BIT;
+    }
+    inline bool is_last() const {
+        return get_size() == 0;
+    }
+
+    inline uint8_t* payload() {
+        return (uint8_t*) this + PAYLOAD_OFFSET;
+    }
+    inline static Block* from_payload(void* ptr) {
+        return (Block*) ((uint8_t*) ptr - PAYLOAD_OFFSET);
+    }
+
+    // The next block's header overlaps the last word of this block's payload
+    inline Block* next() {
+        return (Block*) (payload() + get_size() - OVERHEAD);
+    }
+    inline Block* link_next() {
+        Block* next_block     = next();
+        next_block->prev_phys = this;
+        return next_block;
+    }
+
+    inline void mark_as_free() {
+        link_next()->set_prev_free(true);
+        size |= FREE_BIT;
+    }
+    inline void mark_as_used() {
+        next()->set_prev_free(false);
+        size &= ~FREE_BIT;
+    }
+
+    inline bool can_split(size_t new_size) const {
+        return get_size() >= sizeof(Block) + new_size;
+    }
+
+    // Split into a block of new_size and a free remainder, which is returned
+    inline Block* split(size_t new_size) {
+        Block* remaining   = (Block*) (payload() + new_size - OVERHEAD);
+        remaining->size    = get_size() - (new_size + OVERHEAD);
+        set_size(new_size);
+        remaining->mark_as_free();
+        return remaining;
+    }
+
+    // Absorb the physically next block into this one
+    inline void absorb(Block* next_block) {
+        set_size(get_size() + next_block->get_size() + OVERHEAD);
+        link_next();
+    }
+};
+
+// Passed by reference to std::max, so they need a definition
+const size_t TLSFAllocator::Block::MIN_SIZE;
+const size_t TLSFAllocator::MIN_CHUNK_SIZE;
+
+static inline size_t align_up(size_t size, size_t align) {
+    return (size + (align - 1)) & ~(align - 1);
+}
+
+// First and second level indices for the list a block of this size goes in
+static inline void mapping_insert(size_t size, size_t& fl, size_t& sl, size_t sl_count_log2,
+                                  size_t fl_index_shift, size_t small_block_size) {
+    if (size < small_block_size) {
+        // Small blocks share the first list, linearly subdivided
+        fl = 0;
+        sl = size / (small_block_size >> sl_count_log2);
+    } else {
+        fl = Utils::bit_scan_reverse(size);
+        sl = (size >> (fl - sl_count_log2)) ^ ((size_t) 1 << sl_count_log2);
+        fl -= (fl_index_shift - 1);
+    }
+}
+
+TLSFAllocator::TLSFAllocator(size_t reserve_size, uint32_t flags)
+    : heap(reserve_size, flags) {
+    heap.set_name("TLSFAllocator pool");
 }
 
+void TLSFAllocator::insert_free_block(Block* block, size_t fl, size_t sl) {
+    Block* current   = blocks[fl][sl];
+    block->next_free = current;
+    block->prev_free = nullptr;
+    if (current) {
+        current->prev_free = block;
+    }
+
+    blocks[fl][sl] = block;
+    fl_bitmap |= (uint64_t) 1 << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+void TLSFAllocator::remove_free_block(Block* block, size_t fl, size_t sl) {
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+        return;
+    }
+
+    // Block is the head of its list
+    blocks[fl][sl] = block->next_free;
+    if (!blocks[fl][sl]) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (!sl_bitmap[fl]) {
+            fl_bitmap &= ~((uint64_t) 1 << fl);
+        }
+    }
+}
+
+void TLSFAllocator::insert_block(Block* block) {
+    size_t fl, sl;
+    mapping_insert(block->get_size(), fl, sl, SL_INDEX_COUNT_LOG2, FL_INDEX_SHIFT,
+                   SMALL_BLOCK_SIZE);
+    insert_free_block(block, fl, sl);
+}
+
+void TLSFAllocator::remove_block(Block* block) {
+    size_t fl, sl;
+    mapping_insert(block->get_size(), fl, sl, SL_INDEX_COUNT_LOG2, FL_INDEX_SHIFT,
+                   SMALL_BLOCK_SIZE);
+    remove_free_block(block, fl, sl);
+}
+
+TLSFAllocator::Block* TLSFAllocator::merge_prev(Block* block) {
+    if (block->is_prev_free()) {
+        Block* prev = block->prev_phys;
+        ASSERT(prev->is_free());
+        remove_block(prev);
+        prev->absorb(block);
+        block = prev;
+    }
+    return block;
+}
+
+TLSFAllocator::Block* TLSFAllocator::merge_next(Block* block) {
+    Block* next = block->next();
+    if (next->is_free()) {
+        ASSERT(!next->is_last());
+        remove_block(next);
+        block->absorb(next);
+    }
+    return block;
+}
+
+void TLSFAllocator::trim_free(Block* block, size_t size) {
+    // Give the tail of a free block back to the free lists
+    ASSERT(block->is_free());
+    if (block->can_split(size)) {
+        Block* remaining = block->split(size);
+        block->link_next();
+        remaining->set_prev_free(true);
+        insert_block(remaining);
+    }
+}
+
+void TLSFAllocator::trim_used(Block* block, size_t size) {
+    // Give the tail of a used block back to the free lists, merging it with
+    // the next block if that's free too
+    ASSERT(!block->is_free());
+    if (block->can_split(size)) {
+        Block* remaining = block->split(size);
+        remaining->set_prev_free(false);
+        remaining = merge_next(remaining);
+        insert_block(remaining);
+    }
+}
+
+TLSFAllocator::Block* TLSFAllocator::trim_free_leading(Block* block, size_t size) {
+    // Split off the first size bytes of a free block as a separate free block
+    // and return the rest
+    Block* remaining = block;
+    if (block->can_split(size)) {
+        remaining = block->split(size - Block::OVERHEAD);
+        remaining->set_prev_free(true);
+        block->link_next();
+        insert_block(block);
+    }
+    return remaining;
+}
+
+TLSFAllocator::Block* TLSFAllocator::locate_free(size_t size) {
+    if (!size) {
+        return nullptr;
+    }
+
+    // Round the size up to the next list boundary so that any block in the
+    // list found is large enough
+    size_t rounded_size = size;
+    if (size >= SMALL_BLOCK_SIZE) {
+        rounded_size += ((size_t) 1 << (Utils::bit_scan_reverse(size) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+
+    size_t fl, sl;
+    mapping_insert(rounded_size, fl, sl, SL_INDEX_COUNT_LOG2, FL_INDEX_SHIFT, SMALL_BLOCK_SIZE);
+    if (fl >= FL_INDEX_COUNT) {
+        return nullptr;
+    }
+
+    // Search the second level for a list at or above this size, then fall
+    // back to the next non-empty first level
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint64_t fl_map = fl_bitmap & (~(uint64_t) 0 << (fl + 1));
+        if (!fl_map) {
+            return nullptr;
+        }
+
+        fl     = Utils::bit_scan_forward(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = Utils::bit_scan_forward(sl_map);
+
+    Block* block = blocks[fl][sl];
+    ASSERT(block && block->get_size() >= size);
+    remove_free_block(block, fl, sl);
+    return block;
+}
+
+void* TLSFAllocator::prepare_used(Block* block, size_t size) {
+    if (!block) {
+        return nullptr;
+    }
+
+    trim_free(block, size);
+    block->mark_as_used();
+    return block->payload();
+}
+
+bool TLSFAllocator::grow(size_t size) {
+    // Commit a new chunk large enough for a free block of size bytes, plus
+    // the header and the new sentinel. locate_free rounds requests up to the
+    // next list boundary, so leave room for that too.
+    size_t block_size = size + (size >> SL_INDEX_COUNT_LOG2) + 4 * sizeof(Block);
+    size_t chunk_size = align_up(std::max(MIN_CHUNK_SIZE, block_size), ALIGN_SIZE);
+    uint8_t* chunk    = (uint8_t*) heap.allocate_data(chunk_size, ALIGN_SIZE);
+    if (!chunk) {
+        return false;
+    }
+
+    Block* block = nullptr;
+    if (sentinel && chunk == pool_end) {
+        // The chunk directly follows the last pool. The old sentinel becomes
+        // the header of a free block spanning the new chunk.
+        block       = sentinel;
+        block->size = (chunk_size - Block::OVERHEAD) | (block->size & Block::PREV_FREE_BIT);
+    } else {
+        // Start a new pool. The header starts one word before the chunk so
+        // that its (never used) prev_phys falls outside of it.
+        block       = (Block*) (chunk - Block::OVERHEAD);
+        block->size = chunk_size - 2 * Block::OVERHEAD;
+    }
+
+    // Terminate the pool with a zero sized used block
+    block->mark_as_free();
+    sentinel       = block->next();
+    sentinel->size = Block::PREV_FREE_BIT;
+    pool_end       = chunk + chunk_size;
+
+#ifdef MEMORY_TRACKING
+    stats.record_commit(chunk_size);
+#endif
+
+    insert_block(merge_prev(block));
+    return true;
+}
+
+void* TLSFAllocator::allocate_data(size_t size, size_t align) {
+    if (!Utils::is_power_of_2(align)) {
+        align = 16;
+    }
+
+    size_t adjusted = align_up(std::max(size, Block::MIN_SIZE), ALIGN_SIZE);
+    if (!size || adjusted >= Block::MAX_SIZE) {
+        return nullptr;
+    }
+
+    // For alignments larger than the block alignment, search for enough
+    // space to align the payload and still leave room to split off the gap
+    // in front of it as a free block
+    const size_t gap_minimum = sizeof(Block);
+    size_t search_size       = align > ALIGN_SIZE
+                             ? align_up(adjusted + align + gap_minimum, ALIGN_SIZE)
+                             : adjusted;
+
+    Block* block = locate_free(search_size);
+    if (!block) {
+        if (!grow(search_size)) {
+            return nullptr;
+        }
+        block = locate_free(search_size);
+    }
+
+    if (block && align > ALIGN_SIZE) {
+        uint8_t* ptr     = block->payload();
+        uint8_t* aligned = (uint8_t*) align_up((size_t) ptr, align);
+        size_t gap       = aligned - ptr;
+
+        // If the gap is too small to be a block, move on to the next aligned
+        // address
+        if (gap && gap < gap_minimum) {
+            size_t offset = std::max(gap_minimum - gap, align);
+            aligned       = (uint8_t*) align_up((size_t) (aligned + offset), align);
+            gap           = aligned - ptr;
+        }
+
+        if (gap) {
+            block = trim_free_leading(block, gap);
+        }
+    }
+
+    void* result = prepare_used(block, adjusted);
+#ifdef MEMORY_TRACKING
+    stats.record_allocation(size, usable_size(result));
+#endif
+    return result;
+}
+
+void* TLSFAllocator::reallocate_data(void* ptr, size_t size, size_t align) {
+    if (!ptr) {
+        return allocate_data(size, align);
+    }
+
+    if (!size) {
+        free(ptr);
+        return nullptr;
+    }
+
+    if (!Utils::is_power_of_2(align)) {
+        align = 16;
+    }
+
+    Block* block = Block::from_payload(ptr);
+    Block* next  = block->next();
+
+    size_t current_size  = block->get_size();
+    size_t combined_size = current_size + next->get_size() + Block::OVERHEAD;
+    size_t adjusted      = align_up(std::max(size, Block::MIN_SIZE), ALIGN_SIZE);
+    if (adjusted >= Block::MAX_SIZE) {
+        return nullptr;
+    }
+
+    bool misaligned = ((size_t) ptr & (align - 1)) != 0;
+    if (misaligned || (adjusted > current_size && (!next->is_free() || adjusted > combined_size))) {
+        // Can't resize in place, move the allocation
+        void* result = allocate_data(size, align);
+        if (result) {
+            memcpy(result, ptr, std::min(current_size, size));
+            free(ptr);
+        }
+        return result;
+    }
+
+    // Grow into the next block if needed, then give back what's left over
+    if (adjusted > current_size) {
+        merge_next(block);
+        block->mark_as_used();
+    }
+
+    trim_used(block, adjusted);
+
+#ifdef MEMORY_TRACKING
+    stats.record_free(current_size);
+    stats.record_allocation(size, block->get_size());
+#endif
+    return ptr;
+}
+
+void TLSFAllocator::free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    Block* block = Block::from_payload(ptr);
+    ASSERT_MSG(!block->is_free(), "Double free of %p", ptr);
+
+#ifdef MEMORY_TRACKING
+    stats.record_free(block->get_size());
+#endif
+
+    block->mark_as_free();
+    block = merge_prev(block);
+    block = merge_next(block);
+    insert_block(block);
+}
+
+size_t TLSFAllocator::usable_size(void* ptr) {
+    return ptr ? Block::from_payload(ptr)->get_size() : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Instrumentation //////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef MEMORY_TRACKING
+
+// Registry of every live AllocatorStats
+static std::mutex stats_registry_mutex;
+static AllocatorStats* stats_registry = nullptr;
+
+static thread_local const char* current_tag = nullptr;
+
+AllocatorStats::AllocatorStats(const char* name)
+    : name(name) {
+    std::lock_guard< std::mutex > lock(stats_registry_mutex);
+    next = stats_registry;
+    if (next) {
+        next->prev = this;
+    }
+    stats_registry = this;
+}
+
+AllocatorStats::~AllocatorStats() {
+    std::lock_guard< std::mutex > lock(stats_registry_mutex);
+    if (prev) {
+        prev->next = next;
+    } else {
+        stats_registry = next;
+    }
+    if (next) {
+        next->prev = prev;
+    }
+}
+
+void AllocatorStats::record_allocation(size_t requested, size_t consumed) {
+    num_allocations++;
+    bytes_requested += requested;
+    alignment_waste += consumed - std::min(requested, consumed);
+    bytes_in_use += consumed;
+    peak_bytes_in_use = std::max(peak_bytes_in_use, bytes_in_use);
+
+    // Tags are string literals, so the pointer usually matches. Fall back to
+    // comparing the strings in case the same literal wasn't merged across
+    // translation units. When the table is full the last entry collects
+    // everything else.
+    const char* tag = current_tag ? current_tag : "untagged";
+    TagStats* entry = nullptr;
+    for (size_t i = 0; i < num_tags; i++) {
+        if (tags[i].tag == tag || strcmp(tags[i].tag, tag) == 0) {
+            entry = &tags[i];
+            break;
+        }
+    }
+    if (!entry) {
+        if (num_tags < MAX_TAGS - 1) {
+            entry      = &tags[num_tags++];
+            entry->tag = tag;
+        } else {
+            entry      = &tags[MAX_TAGS - 1];
+            entry->tag = "other";
+            num_tags   = MAX_TAGS;
+        }
+    }
+    entry->num_allocations++;
+    entry->bytes_requested += requested;
+}
+
+void AllocatorStats::record_free(size_t consumed) {
+    ASSERT(bytes_in_use >= consumed);
+    bytes_in_use -= consumed;
+}
+
+void AllocatorStats::record_commit(size_t bytes) {
+    bytes_committed += bytes;
+    peak_bytes_committed = std::max(peak_bytes_committed, bytes_committed);
+}
+
+void AllocatorStats::record_decommit(size_t bytes) {
+    bytes_committed -= std::min(bytes, bytes_committed);
+}
+
+TagScope::TagScope(const char* tag)
+    : previous(current_tag) {
+    current_tag = tag;
+}
+
+TagScope::~TagScope() {
+    current_tag = previous;
+}
+
+void tracking_new_frame() {
+    std::lock_guard< std::mutex > lock(stats_registry_mutex);
+    for (AllocatorStats* stats = stats_registry; stats; stats = stats->next) {
+        stats->last_frame_allocations     = stats->num_allocations - stats->frame_start_allocations;
+        stats->last_frame_bytes_requested = stats->bytes_requested - stats->frame_start_bytes_requested;
+        stats->peak_frame_allocations
+            = std::max(stats->peak_frame_allocations, stats->last_frame_allocations);
+        stats->peak_frame_bytes_requested
+            = std::max(stats->peak_frame_bytes_requested, stats->last_frame_bytes_requested);
+
+        stats->frame_start_allocations     = stats->num_allocations;
+        stats->frame_start_bytes_requested = stats->bytes_requested;
+    }
+}
+
+// Names and tags are literals from our own code, but don't let a stray quote
+// break the file
+static void write_json_string(FILE* file, const char* str) {
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+bool dump_stats(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open %s for writing memory stats", path);
+        return false;
+    }
+
+    std::lock_guard< std::mutex > lock(stats_registry_mutex);
+
+    fprintf(file, "{\n  \"allocators\": [");
+    for (AllocatorStats* stats = stats_registry; stats; stats = stats->next) {
+        fprintf(file, stats == stats_registry ? "\n" : ",\n");
+        fprintf(file, "    {\n      \"name\": ");
+        write_json_string(file, stats->name);
+        fprintf(file,
+                ",\n"
+                "      \"allocations\": %zu,\n"
+                "      \"bytes_requested\": %zu,\n"
+                "      \"alignment_waste\": %zu,\n"
+                "      \"bytes_in_use\": %zu,\n"
+                "      \"peak_bytes_in_use\": %zu,\n"
+                "      \"bytes_committed\": %zu,\n"
+                "      \"peak_bytes_committed\": %zu,\n"
+                "      \"last_frame\": { \"allocations\": %zu, \"bytes_requested\": %zu },\n"
+                "      \"peak_frame\": { \"allocations\": %zu, \"bytes_requested\": %zu },\n"
+                "      \"tags\": [",
+                stats->num_allocations, stats->bytes_requested, stats->alignment_waste,
+                stats->bytes_in_use, stats->peak_bytes_in_use, stats->bytes_committed,
+                stats->peak_bytes_committed, stats->last_frame_allocations,
+                stats->last_frame_bytes_requested, stats->peak_frame_allocations,
+                stats->peak_frame_bytes_requested);
+
+        for (size_t i = 0; i < stats->num_tags; i++) {
+            fprintf(file, i == 0 ? "\n        { \"tag\": " : ",\n        { \"tag\": ");
+            write_json_string(file, stats->tags[i].tag);
+            fprintf(file, ", \"allocations\": %zu, \"bytes_requested\": %zu }",
+                    stats->tags[i].num_allocations, stats->tags[i].bytes_requested);
+        }
+        fprintf(file, stats->num_tags ? "\n      ]\n    }" : "]\n    }");
+    }
+    fprintf(file, stats_registry ? "\n  ]\n}\n" : "]\n}\n");
+
+    fclose(file);
+    LOG_INFO("Wrote memory stats to %s", path);
+    return true;
+}
+
+#endif
+
 }    // namespace Memory
\ No newline at end of file
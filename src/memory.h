@@ -2,6 +2,20 @@
 
 #include <memory>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <atomic>
+#include <memory_resource>
+
+#include "utils.h"
+
+// Allocator instrumentation is on in debug builds. Define MEMORY_TRACKING to
+// enable it in other builds; otherwise it compiles out entirely.
+#if defined(APP_DEBUG) && !defined(MEMORY_TRACKING)
+#define MEMORY_TRACKING
+#endif
 
 namespace Memory {
 
@@ -15,20 +29,122 @@ struct Buffer {
     size_t size   = 0;
 };
 
+#ifdef MEMORY_TRACKING
+
+// Allocations made while a tag is active are attributed to it
+struct TagStats {
+    const char* tag        = nullptr;
+    size_t num_allocations = 0;
+    size_t bytes_requested = 0;
+};
+
+// Usage counters for one allocator. Every live AllocatorStats is linked into
+// a global registry, which is what dump_stats walks. Counters are updated by
+// the owning allocator without locking, so they're as thread safe as the
+// allocator itself.
+struct AllocatorStats {
+    static const size_t MAX_TAGS = 32;
+
+    const char* name;
+
+    size_t num_allocations = 0;
+    // Sum of the sizes asked for
+    size_t bytes_requested = 0;
+    // Bytes lost to alignment padding and size rounding
+    size_t alignment_waste = 0;
+    // Bytes currently handed out, including waste
+    size_t bytes_in_use      = 0;
+    size_t peak_bytes_in_use = 0;
+    // Bytes the allocator has obtained from the OS or its backing allocator
+    size_t bytes_committed      = 0;
+    size_t peak_bytes_committed = 0;
+
+    // Counters at the start of the current frame, and how much they moved
+    // during the last and the busiest frame
+    size_t frame_start_allocations     = 0;
+    size_t frame_start_bytes_requested = 0;
+    size_t last_frame_allocations      = 0;
+    size_t last_frame_bytes_requested  = 0;
+    size_t peak_frame_allocations      = 0;
+    size_t peak_frame_bytes_requested  = 0;
+
+    TagStats tags[MAX_TAGS];
+    size_t num_tags = 0;
+
+    AllocatorStats* next = nullptr;
+    AllocatorStats* prev = nullptr;
+
+    AllocatorStats(const char* name);
+    ~AllocatorStats();
+
+    AllocatorStats(const AllocatorStats&) = delete;
+    AllocatorStats& operator=(const AllocatorStats&) = delete;
+
+    // consumed is what the allocation actually took out of the allocator,
+    // IE requested size plus alignment and rounding
+    void record_allocation(size_t requested, size_t consumed);
+    void record_free(size_t consumed);
+    void record_commit(size_t bytes);
+    void record_decommit(size_t bytes);
+};
+
+// Attributes allocations made on this thread to tag until the scope ends.
+// Tags nest; tag must outlive the allocators it's recorded in, so use string
+// literals.
+class TagScope {
+  private:
+    const char* previous;
+
+  public:
+    TagScope(const char* tag);
+    ~TagScope();
+};
+
+// Roll every allocator's per frame counters over. Call once per frame
+void tracking_new_frame();
+// Write the stats of every live allocator to path as JSON
+bool dump_stats(const char* path);
+
+#define MEMORY_TAG_JOIN_(a, b) a##b
+#define MEMORY_TAG_JOIN(a, b) MEMORY_TAG_JOIN_(a, b)
+#define MEMORY_TAG(tag) Memory::TagScope MEMORY_TAG_JOIN(memory_tag_, __LINE__)(tag)
+#define MEMORY_NEW_FRAME() Memory::tracking_new_frame()
+#define MEMORY_DUMP_STATS(path) Memory::dump_stats(path)
+
+#else
+
+#define MEMORY_TAG(tag)
+#define MEMORY_NEW_FRAME()
+#define MEMORY_DUMP_STATS(path)
+
+#endif
+
 struct Arena {
     Arena* next = nullptr;
+    // Links into a LinearAllocator free space list
+    Arena* next_free = nullptr;
+    Arena* prev_free = nullptr;
     Buffer buffer;
     size_t used = 0;
+#ifdef MEMORY_TRACKING
+    // Stats of the allocator the arena belongs to, if any
+    AllocatorStats* stats = nullptr;
+#endif
     void* push(size_t size, size_t align);
     void clear();
     void reset();
     void rewind(void* ptr);
     void* top();
     bool inside(void* ptr);
+    inline size_t remaining() const {
+        return buffer.size - used;
+    }
 };
 
 class IAllocator {
   public:
+    virtual ~IAllocator() = default;
+
     virtual void* allocate_data(size_t size, size_t align) = 0;
     virtual void* reallocate_data(void* ptr, size_t size, size_t align) = 0;
     virtual void free(void* ptr) = 0;
@@ -45,8 +161,9 @@ class IAllocator {
 
     inline const char* copy_string(const char* str) {
         size_t len = strlen(str);
-        const char* buf = allocate<char>(len + 1);
+        char* buf = allocate<char>(len + 1);
         memcpy((void*) buf, (void*) str, len);
+        buf[len] = 0;
         return buf;
     }
 };
@@ -56,13 +173,37 @@ class VirtualHeap : public IAllocator {
     Arena arena;
     size_t num_pages_committed = 0;
     size_t num_pages_reserved  = 0;
+    uint32_t flags             = 0;
+    bool owns_reservation      = true;
+#ifdef MEMORY_TRACKING
+    AllocatorStats stats { "VirtualHeap" };
+#endif
 
     static const size_t GROWTH_FACTOR = 2;
 
   public:
-    VirtualHeap(size_t reserve_size);
+    // flags is a combination of Platform::VirtualMemoryFlags
+    VirtualHeap(size_t reserve_size, uint32_t flags = 0);
+    // Heap over part of an existing reservation. The range must be page
+    // aligned and is not released by the heap
+    VirtualHeap(void* reserved_base, size_t reserved_size, uint32_t flags);
     ~VirtualHeap();
 
+    VirtualHeap(const VirtualHeap&) = delete;
+    VirtualHeap& operator=(const VirtualHeap&) = delete;
+
+    // Bytes of the reservation made accessible so far
+    size_t committed_bytes() const;
+    // Bytes of the reservation actually backed by physical memory
+    size_t resident_bytes();
+
+    // Name the allocator is reported under by the memory stats
+    inline void set_name(const char* name) {
+#ifdef MEMORY_TRACKING
+        stats.name = name;
+#endif
+    }
+
     void* allocate_data(size_t size, size_t align);
     inline void* reallocate_data(void* ptr, size_t size, size_t align) {
         return allocate_data(size, align);
@@ -72,19 +213,58 @@ class VirtualHeap : public IAllocator {
     };
     void clear();
     void release();
+
+    // Current top of the heap. Rewinding to it frees everything allocated
+    // after it was taken
+    inline void* get_marker() {
+        return arena.top();
+    }
+    inline void rewind(void* marker) {
+        arena.rewind(marker);
+    }
 };
 
 class LinearAllocator : public IAllocator {
   private:
     Arena* root_arena = nullptr;
+    Arena* last_arena = nullptr;
+    size_t num_arenas = 0;
+    size_t initial_size;
+
+    // Free space index. Arenas with remaining space are kept in segregated
+    // lists keyed by floor(log2(remaining)), with a bit set in the bitmap for
+    // every non-empty list, so finding an arena that fits never walks the
+    // chain.
+    static const size_t NUM_SIZE_CLASSES = 64;
+    Arena* free_lists[NUM_SIZE_CLASSES] = {};
+    uint64_t free_list_bitmap           = 0;
 
     IAllocator& backing_allocator;
+#ifdef MEMORY_TRACKING
+    AllocatorStats stats { "LinearAllocator" };
+#endif
 
     static const size_t GROWTH_FACTOR = 2;
 
+    // While a scope is open, allocations are pushed linearly starting from
+    // the arena that was last in the chain when the outermost scope began, so
+    // they can be released by rewinding. Those arenas are taken out of the
+    // free space index until the outermost scope ends.
+    Arena* stack_arena = nullptr;
+    size_t scope_depth = 0;
+
     Arena* append_arena(Arena* parent, size_t size);
+    void index_arena(Arena* arena);
+    void unindex_arena(Arena* arena);
+    Arena* find_arena(size_t size_needed);
+    void* push_stack(size_t size, size_t size_needed, size_t align);
 
   public:
+    struct Marker {
+        Arena* arena = nullptr;
+        size_t used  = 0;
+    };
+
     LinearAllocator(size_t size, IAllocator& backing_allocator);
     ~LinearAllocator();
 
@@ -98,6 +278,353 @@ class LinearAllocator : public IAllocator {
 
     void clear();
     void release();
+
+    inline size_t arena_count() const {
+        return num_arenas;
+    }
+
+    // Name the allocator is reported under by the memory stats
+    inline void set_name(const char* name) {
+#ifdef MEMORY_TRACKING
+        stats.name = name;
+#endif
+    }
+
+    // Open a scope. Everything allocated until the matching end_scope is
+    // released by it. Scopes must be ended in reverse order
+    Marker begin_scope();
+    void end_scope(const Marker& marker);
+};
+
+// Per thread scratch heaps carved out of a single reservation. Every thread
+// that allocates through the registry gets its own VirtualHeap slice, so
+// parallel jobs never contend on an allocator. Slices and the heap metadata
+// are page aligned, so no two threads share a cache line either.
+//
+// reset() clears every slice at once. It must only be called while no thread
+// is allocating, eg. once the jobs using the registry have been joined.
+//
+// Nothing in the app allocates on worker threads yet, the pipeline compiler's
+// workers only use the stack, so no registry is created outside the tests.
+class ThreadHeaps {
+  private:
+    struct alignas(64) Slot {
+        VirtualHeap heap;
+        Slot(void* base, size_t size, uint32_t flags)
+            : heap(base, size, flags) {
+        }
+    };
+
+    uint8_t* reservation     = nullptr;
+    size_t reservation_pages = 0;
+    Slot* slots              = nullptr;
+    size_t max_threads;
+    std::atomic< size_t > num_threads;
+    uint32_t id;
+
+  public:
+    // flags is a combination of Platform::VirtualMemoryFlags
+    ThreadHeaps(size_t max_threads, size_t slice_size, uint32_t flags = 0);
+    ~ThreadHeaps();
+
+    ThreadHeaps(const ThreadHeaps&) = delete;
+    ThreadHeaps& operator=(const ThreadHeaps&) = delete;
+
+    // Heap belonging to the calling thread. The first call from a thread
+    // assigns it a slice
+    VirtualHeap& local();
+    VirtualHeap& get(size_t thread_index);
+
+    inline size_t thread_count() const {
+        return num_threads.load(std::memory_order_acquire);
+    }
+
+    void reset();
+};
+
+// Stack-like scratch memory. Records the top of a VirtualHeap or
+// LinearAllocator on construction and rewinds to it on destruction, so
+// everything allocated through the scope (or directly from the underlying
+// allocator) while it's alive is released at once. Scopes nest, so helpers can
+// open their own scope on an allocator their caller is already using.
+class ScratchScope : public IAllocator {
+  private:
+    IAllocator& allocator;
+    VirtualHeap* heap          = nullptr;
+    LinearAllocator* linear    = nullptr;
+    void* heap_marker          = nullptr;
+    LinearAllocator::Marker linear_marker;
+
+  public:
+    ScratchScope(VirtualHeap& heap);
+    ScratchScope(LinearAllocator& allocator);
+    ~ScratchScope();
+
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+    inline void* allocate_data(size_t size, size_t align) {
+        return allocator.allocate_data(size, align);
+    }
+    inline void* reallocate_data(void* ptr, size_t size, size_t align) {
+        return allocator.reallocate_data(ptr, size, align);
+    }
+    inline void free(void* ptr) {
+        // No-op. Memory is released when the scope ends
+    }
+};
+
+// std::pmr::memory_resource over an IAllocator, for std::pmr containers.
+// Deallocation goes through IAllocator::free, so containers backed by an arena
+// leave their old storage behind until the arena is cleared.
+class MemoryResource : public std::pmr::memory_resource {
+  private:
+    IAllocator& allocator;
+
+    inline void* do_allocate(size_t bytes, size_t align) override {
+        void* result = allocator.allocate_data(bytes, align);
+        ASSERT_MSG(result, "Failed to allocate %zu bytes", bytes);
+        return result;
+    }
+    inline void do_deallocate(void* ptr, size_t bytes, size_t align) override {
+        allocator.free(ptr);
+    }
+    inline bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+  public:
+    MemoryResource(IAllocator& allocator)
+        : allocator(allocator) {
+    }
+};
+
+// Standard allocator over an IAllocator, for containers which take an
+// allocator type rather than a memory_resource, such as phmap's.
+template < typename T >
+class Allocator {
+  public:
+    using value_type = T;
+
+    IAllocator* allocator;
+
+    Allocator(IAllocator& allocator) noexcept
+        : allocator(&allocator) {
+    }
+
+    template < typename U >
+    Allocator(const Allocator< U >& other) noexcept
+        : allocator(other.allocator) {
+    }
+
+    inline T* allocate(size_t number) {
+        T* result = allocator->allocate< T >(number);
+        ASSERT_MSG(result, "Failed to allocate %zu objects", number);
+        return result;
+    }
+    inline void deallocate(T* ptr, size_t number) {
+        allocator->free(ptr);
+    }
+
+    template < typename U >
+    inline bool operator==(const Allocator< U >& other) const {
+        return allocator == other.allocator;
+    }
+    template < typename U >
+    inline bool operator!=(const Allocator< U >& other) const {
+        return allocator != other.allocator;
+    }
+};
+
+// Two-Level Segregated Fit general purpose allocator. Free blocks are kept in
+// lists indexed by a coarse power of two size class and a linear subdivision
+// of it, with bitmaps over both levels, so allocation and free are O(1). Free
+// neighbors are coalesced immediately and reallocation grows in place when the
+// next block is free.
+//
+// Memory comes from a VirtualHeap reservation. The heap is only ever grown by
+// this allocator, so new chunks are contiguous with the previous one and get
+// merged into the end of the existing pool.
+class TLSFAllocator : public IAllocator {
+  private:
+    struct Block;
+
+    static const size_t ALIGN_SIZE_LOG2     = 3;
+    static const size_t ALIGN_SIZE          = 1 << ALIGN_SIZE_LOG2;
+    static const size_t SL_INDEX_COUNT_LOG2 = 5;
+    static const size_t SL_INDEX_COUNT      = 1 << SL_INDEX_COUNT_LOG2;
+    static const size_t FL_INDEX_MAX        = 40;
+    static const size_t FL_INDEX_SHIFT      = SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2;
+    static const size_t FL_INDEX_COUNT      = FL_INDEX_MAX - FL_INDEX_SHIFT + 1;
+    static const size_t SMALL_BLOCK_SIZE    = 1 << FL_INDEX_SHIFT;
+
+    static const size_t MIN_CHUNK_SIZE = MB(1);
+
+    VirtualHeap heap;
+
+    // End of the memory handed to the pools so far, and the zero sized
+    // sentinel block that terminates the last pool
+    uint8_t* pool_end = nullptr;
+    Block* sentinel   = nullptr;
+
+#ifdef MEMORY_TRACKING
+    AllocatorStats stats { "TLSFAllocator" };
+#endif
+
+    uint64_t fl_bitmap                    = 0;
+    uint32_t sl_bitmap[FL_INDEX_COUNT]    = {};
+    Block* blocks[FL_INDEX_COUNT][SL_INDEX_COUNT] = {};
+
+    void insert_free_block(Block* block, size_t fl, size_t sl);
+    void remove_free_block(Block* block, size_t fl, size_t sl);
+    void insert_block(Block* block);
+    void remove_block(Block* block);
+    Block* merge_prev(Block* block);
+    Block* merge_next(Block* block);
+    void trim_free(Block* block, size_t size);
+    void trim_used(Block* block, size_t size);
+    Block* trim_free_leading(Block* block, size_t size);
+    Block* locate_free(size_t size);
+    void* prepare_used(Block* block, size_t size);
+    bool grow(size_t size);
+
+  public:
+    // flags is a combination of Platform::VirtualMemoryFlags
+    TLSFAllocator(size_t reserve_size, uint32_t flags = 0);
+
+    void* allocate_data(size_t size, size_t align);
+    void* reallocate_data(void* ptr, size_t size, size_t align);
+    void free(void* ptr);
+
+    // Number of bytes usable in an allocation. May be more than was requested
+    size_t usable_size(void* ptr);
+
+    // Name the allocator is reported under by the memory stats
+    inline void set_name(const char* name) {
+#ifdef MEMORY_TRACKING
+        stats.name = name;
+#endif
+    }
+};
+
+// Fixed size block allocator for objects of type T. Blocks are carved out of
+// a dedicated VirtualHeap reservation one chunk at a time, so growing the pool
+// never moves existing blocks. Since the reservation is contiguous, every block
+// also has a stable index which can be used as a handle.
+template < typename T >
+class Pool {
+  private:
+    // Free blocks store the free list link in place of the object
+    union Block {
+        Block* next_free;
+        alignas(T) uint8_t data[sizeof(T)];
+    };
+
+    VirtualHeap heap;
+    Block* base      = nullptr;
+    Block* free_list = nullptr;
+    size_t num_blocks    = 0;
+    size_t num_allocated = 0;
+    size_t blocks_per_chunk;
+
+    void grow() {
+        Block* chunk
+            = (Block*) heap.allocate_data(blocks_per_chunk * sizeof(Block), alignof(Block));
+        ASSERT_MSG(chunk, "Pool reservation exhausted after %zu blocks", num_blocks);
+
+        if (!base) {
+            base = chunk;
+        }
+        ASSERT_MSG(chunk == base + num_blocks, "Pool chunks must be contiguous");
+
+        // Thread the new blocks onto the free list in address order
+        for (size_t i = 0; i < blocks_per_chunk - 1; i++) {
+            chunk[i].next_free = &chunk[i + 1];
+        }
+        chunk[blocks_per_chunk - 1].next_free = free_list;
+        free_list = chunk;
+
+        num_blocks += blocks_per_chunk;
+    }
+
+  public:
+    Pool(size_t reserve_size, size_t chunk_size = KB(64))
+        : heap(reserve_size)
+        , blocks_per_chunk(std::max< size_t >(chunk_size / sizeof(Block), 1)) {
+        heap.set_name("Pool");
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // Returns uninitialized storage for a T
+    T* allocate() {
+        if (!free_list) {
+            grow();
+        }
+
+        Block* block = free_list;
+        free_list    = block->next_free;
+        num_allocated++;
+        return (T*) block->data;
+    }
+
+    void free(T* ptr) {
+        if (!ptr) {
+            return;
+        }
+
+        ASSERT(owns(ptr));
+        Block* block     = (Block*) ptr;
+        block->next_free = free_list;
+        free_list        = block;
+        num_allocated--;
+    }
+
+    template < typename... Args >
+    T* create(Args&&... args) {
+        return new (allocate()) T(std::forward< Args >(args)...);
+    }
+
+    void destroy(T* ptr) {
+        if (ptr) {
+            ptr->~T();
+            free(ptr);
+        }
+    }
+
+    // Returns every block to the pool. Destructors are not run. Committed
+    // memory is kept for reuse.
+    void clear() {
+        heap.clear();
+        free_list     = nullptr;
+        num_blocks    = 0;
+        num_allocated = 0;
+    }
+
+    inline bool owns(const T* ptr) const {
+        return base && (const Block*) ptr >= base && (const Block*) ptr < base + num_blocks;
+    }
+
+    inline size_t index_of(const T* ptr) const {
+        ASSERT(owns(ptr));
+        return (const Block*) ptr - base;
+    }
+
+    inline T* at(size_t index) {
+        ASSERT(index < num_blocks);
+        return (T*) base[index].data;
+    }
+
+    // Number of blocks carved out so far. Indices are always below this
+    inline size_t capacity() const {
+        return num_blocks;
+    }
+
+    // Number of blocks currently allocated
+    inline size_t size() const {
+        return num_allocated;
+    }
 };
 
 }    // namespace Memory
\ No newline at end of file
@@ -1,12 +1,37 @@
 #include "platform.h"
 #include "utils.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#elif defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#else
+#error Platform not supported
+#endif
+
 namespace Platform {
 
+static inline size_t round_up(size_t size, size_t granularity) {
+    return ((size + granularity - 1) / granularity) * granularity;
+}
+
+// Touch every page in the range so the OS backs it before we need it
+static void touch_pages(void* ptr, size_t size) {
+    size_t page_size = get_page_size();
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        ((volatile uint8_t*) ptr)[offset] = 0;
+    }
+}
+
 // Windows
 
 #ifdef _WIN32
-#include <windows.h>
 
 size_t get_page_size() {
     static size_t page_size = 0;
@@ -19,29 +44,397 @@ size_t get_page_size() {
     }
 
     ASSERT(page_size > 0);
-    
+
     return page_size;
 }
 
-void* virtual_reserve(size_t size, size_t& pages_reserved) {
+size_t get_huge_page_size() {
+    static size_t huge_page_size = 0;
+
+    if (!huge_page_size) {
+        huge_page_size = GetLargePageMinimum();
+        if (!huge_page_size) {
+            huge_page_size = MB(2);
+        }
+    }
+
+    return huge_page_size;
+}
+
+void* virtual_reserve(size_t size, size_t& pages_reserved, uint32_t flags) {
+    // Large pages on Windows must be committed at reserve time and require
+    // SeLockMemoryPrivilege, so huge page flags are ignored here.
     pages_reserved = get_num_pages(size);
-    return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+    return VirtualAlloc(0, pages_reserved * get_page_size(), MEM_RESERVE, PAGE_NOACCESS);
 }
 
-void* virtual_commit(void* ptr, size_t size, size_t& pages_committed) {
+void* virtual_commit(void* ptr, size_t size, size_t& pages_committed, uint32_t flags) {
     pages_committed = get_num_pages(size);
-    return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+    size_t commit_size = pages_committed * get_page_size();
+    void* result = VirtualAlloc(ptr, commit_size, MEM_COMMIT, PAGE_READWRITE);
+
+    if (result && (flags & VIRTUAL_MEMORY_PREFAULT)) {
+        touch_pages(result, commit_size);
+    }
+
+    return result;
 }
 
-void virtual_decommit(void* ptr, size_t size) {
-    VirtualFree(ptr, size, MEM_DECOMMIT);
+bool virtual_decommit(void* ptr, size_t size, uint32_t flags) {
+    return VirtualFree(ptr, size, MEM_DECOMMIT) != 0;
 }
 
-void virtual_release(void* ptr) {
+void virtual_release(void* ptr, size_t size) {
     VirtualFree(ptr, 0, MEM_RELEASE);
 }
-#else
-    #error Platform not supported
+
+size_t virtual_resident_bytes(void* ptr, size_t size) {
+    // Walk the committed regions. This counts committed rather than strictly
+    // resident pages, which is as close as we get without psapi.
+    size_t resident = 0;
+    uint8_t* current = (uint8_t*) ptr;
+    uint8_t* end = current + size;
+    while (current < end) {
+        MEMORY_BASIC_INFORMATION info;
+        if (!VirtualQuery(current, &info, sizeof(info))) {
+            break;
+        }
+
+        uint8_t* region_end = std::min((uint8_t*) info.BaseAddress + info.RegionSize, end);
+        if (info.State == MEM_COMMIT) {
+            resident += region_end - current;
+        }
+        current = region_end;
+    }
+    return resident;
+}
+
+void flush_file(FILE* file) {
+    fflush(file);
+    FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(file)));
+}
+
+bool replace_file(const char* from, const char* to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+struct DirectoryWatcher::Native {
+    HANDLE directory;
+    OVERLAPPED overlapped;
+    alignas(DWORD) uint8_t buffer[KB(16)];
+};
+
+static bool read_directory_changes(DirectoryWatcher::Native* native) {
+    // Saving in place changes the last write time, saving through a
+    // temporary renames over the file
+    return ReadDirectoryChangesW(native->directory, native->buffer, sizeof(native->buffer), FALSE,
+                                 FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME,
+                                 nullptr, &native->overlapped, nullptr);
+}
+
+DirectoryWatcher::DirectoryWatcher(const char* path) {
+    HANDLE directory = CreateFileA(path, FILE_LIST_DIRECTORY,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                   OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                                   nullptr);
+    if (directory == INVALID_HANDLE_VALUE) {
+        LOG_WARNING("Can't watch %s, error %lu", path, GetLastError());
+        return;
+    }
+
+    Native* native            = new Native();
+    native->directory         = directory;
+    native->overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    if (!read_directory_changes(native)) {
+        LOG_WARNING("Can't watch %s, error %lu", path, GetLastError());
+        CloseHandle(native->overlapped.hEvent);
+        CloseHandle(directory);
+        delete native;
+        return;
+    }
+    m_native = native;
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (!m_native) {
+        return;
+    }
+    CancelIo(m_native->directory);
+    CloseHandle(m_native->overlapped.hEvent);
+    CloseHandle(m_native->directory);
+    delete m_native;
+}
+
+void DirectoryWatcher::poll(const std::function< void(const char*) >& on_change) {
+    if (!m_native) {
+        return;
+    }
+
+    DWORD size;
+    while (GetOverlappedResult(m_native->directory, &m_native->overlapped, &size, FALSE)) {
+        // A size of 0 means the buffer overflowed and the changes were lost
+        uint8_t* current = m_native->buffer;
+        while (size > 0) {
+            const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*) current;
+            if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_MODIFIED
+                || info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                char name[MAX_PATH];
+                int length = WideCharToMultiByte(CP_UTF8, 0, info->FileName,
+                                                 info->FileNameLength / sizeof(WCHAR), name,
+                                                 sizeof(name) - 1, nullptr, nullptr);
+                if (length > 0) {
+                    name[length] = 0;
+                    on_change(name);
+                }
+            }
+            if (info->NextEntryOffset == 0) {
+                break;
+            }
+            current += info->NextEntryOffset;
+        }
+
+        ResetEvent(m_native->overlapped.hEvent);
+        if (!read_directory_changes(m_native)) {
+            LOG_WARNING("Stopped watching, error %lu", GetLastError());
+            CloseHandle(m_native->overlapped.hEvent);
+            CloseHandle(m_native->directory);
+            delete m_native;
+            m_native = nullptr;
+            return;
+        }
+    }
+}
+
+// Linux
+
+#elif defined(__linux__)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+size_t get_page_size() {
+    static size_t page_size = 0;
+
+    if (!page_size) {
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    ASSERT(page_size > 0);
+
+    return page_size;
+}
+
+size_t get_huge_page_size() {
+    static size_t huge_page_size = 0;
+
+    if (!huge_page_size) {
+        // Default huge page size is reported in /proc/meminfo as
+        // "Hugepagesize:    2048 kB"
+        FILE* meminfo = fopen("/proc/meminfo", "r");
+        if (meminfo) {
+            char line[256];
+            while (fgets(line, sizeof(line), meminfo)) {
+                unsigned long size_kb = 0;
+                if (sscanf(line, "Hugepagesize: %lu kB", &size_kb) == 1) {
+                    huge_page_size = KB(size_kb);
+                    break;
+                }
+            }
+            fclose(meminfo);
+        }
+
+        if (!huge_page_size) {
+            huge_page_size = MB(2);
+        }
+    }
+
+    return huge_page_size;
+}
+
+static size_t get_commit_granularity(uint32_t flags) {
+    return (flags & VIRTUAL_MEMORY_EXPLICIT_HUGE_PAGES) ? get_huge_page_size() : get_page_size();
+}
+
+void* virtual_reserve(size_t size, size_t& pages_reserved, uint32_t flags) {
+    // Reserve address space only. MAP_NORESERVE keeps the kernel from
+    // accounting the whole range against overcommit, and PROT_NONE makes any
+    // access outside of a committed range fault.
+    const int base_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    size_t reserve_size = get_num_pages(size) * get_page_size();
+    void* result = MAP_FAILED;
+
+    if (flags & VIRTUAL_MEMORY_EXPLICIT_HUGE_PAGES) {
+        // hugetlbfs pages can't be overcommitted. Without MAP_NORESERVE the
+        // mmap fails up front when the pool is too small, instead of raising
+        // SIGBUS on first touch.
+        reserve_size = round_up(reserve_size, get_huge_page_size());
+        result       = mmap(nullptr, reserve_size, PROT_NONE,
+                      (base_flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+        ASSERT_WARN(result != MAP_FAILED,
+                    "Failed to reserve %zu bytes of explicit huge pages, falling back to regular "
+                    "pages",
+                    reserve_size);
+    }
+
+    if (result == MAP_FAILED && (flags & VIRTUAL_MEMORY_TRANSPARENT_HUGE_PAGES)) {
+        // Over-reserve so the base can be aligned to a huge page boundary,
+        // then give the slop on either side back.
+        size_t huge_page_size = get_huge_page_size();
+        reserve_size = round_up(reserve_size, huge_page_size);
+
+        uint8_t* unaligned
+            = (uint8_t*) mmap(nullptr, reserve_size + huge_page_size, PROT_NONE, base_flags, -1, 0);
+        if (unaligned != MAP_FAILED) {
+            uint8_t* aligned = (uint8_t*) round_up((size_t) unaligned, huge_page_size);
+            size_t head      = aligned - unaligned;
+            size_t tail      = huge_page_size - head;
+            if (head) {
+                munmap(unaligned, head);
+            }
+            if (tail) {
+                munmap(aligned + reserve_size, tail);
+            }
+
+            madvise(aligned, reserve_size, MADV_HUGEPAGE);
+            result = aligned;
+        }
+    }
+
+    if (result == MAP_FAILED) {
+        result = mmap(nullptr, reserve_size, PROT_NONE, base_flags, -1, 0);
+    }
+
+    if (result == MAP_FAILED) {
+        pages_reserved = 0;
+        return nullptr;
+    }
+
+    pages_reserved = reserve_size / get_page_size();
+    return result;
+}
+
+void* virtual_commit(void* ptr, size_t size, size_t& pages_committed, uint32_t flags) {
+    size_t commit_size = round_up(get_num_pages(size) * get_page_size(), get_commit_granularity(flags));
+
+    if (mprotect(ptr, commit_size, PROT_READ | PROT_WRITE) != 0) {
+        pages_committed = 0;
+        return nullptr;
+    }
+
+    if (flags & VIRTUAL_MEMORY_PREFAULT) {
+        // MADV_POPULATE_WRITE faults the whole range in one syscall on 5.14+
+        if (madvise(ptr, commit_size, MADV_POPULATE_WRITE) != 0) {
+            touch_pages(ptr, commit_size);
+        }
+    }
+
+    pages_committed = commit_size / get_page_size();
+    return ptr;
+}
+
+bool virtual_decommit(void* ptr, size_t size, uint32_t flags) {
+    if (!size) {
+        return true;
+    }
+
+    // Drop the physical pages and make the range inaccessible again. The
+    // address range stays reserved. Huge page mappings reject lengths that
+    // aren't whole huge pages, so round like virtual_commit does
+    size = round_up(size, get_commit_granularity(flags));
+    return madvise(ptr, size, MADV_DONTNEED) == 0 && mprotect(ptr, size, PROT_NONE) == 0;
+}
+
+void virtual_release(void* ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, size);
+    }
+}
+
+size_t virtual_resident_bytes(void* ptr, size_t size) {
+    size_t page_size = get_page_size();
+    size_t num_pages = round_up(size, page_size) / page_size;
+    size_t resident  = 0;
+
+    // Query in batches so we don't need a heap allocation for large ranges
+    unsigned char residency[4096];
+    for (size_t page = 0; page < num_pages; page += ARRAY_LENGTH(residency)) {
+        size_t batch = std::min(num_pages - page, ARRAY_LENGTH(residency));
+        if (mincore((uint8_t*) ptr + page * page_size, batch * page_size, residency) != 0) {
+            break;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            resident += (residency[i] & 1) * page_size;
+        }
+    }
+
+    return resident;
+}
+
+void flush_file(FILE* file) {
+    fflush(file);
+    fsync(fileno(file));
+}
+
+bool replace_file(const char* from, const char* to) {
+    return rename(from, to) == 0;
+}
+
+struct DirectoryWatcher::Native {
+    int fd;
+};
+
+DirectoryWatcher::DirectoryWatcher(const char* path) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LOG_WARNING("Can't watch %s, inotify_init1 failed: %s", path, strerror(errno));
+        return;
+    }
+
+    // Saving in place closes the file after writing, saving through a
+    // temporary moves it over the file
+    if (inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LOG_WARNING("Can't watch %s: %s", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    m_native     = new Native();
+    m_native->fd = fd;
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (!m_native) {
+        return;
+    }
+    close(m_native->fd);
+    delete m_native;
+}
+
+void DirectoryWatcher::poll(const std::function< void(const char*) >& on_change) {
+    if (!m_native) {
+        return;
+    }
+
+    // Non-blocking, so reads stop with EAGAIN once the queue is drained
+    alignas(struct inotify_event) char buffer[KB(4)];
+    for (;;) {
+        ssize_t size = read(m_native->fd, buffer, sizeof(buffer));
+        if (size <= 0) {
+            return;
+        }
+
+        for (char* current = buffer; current < buffer + size;) {
+            const struct inotify_event* event = (const struct inotify_event*) current;
+            // An overflowed queue has lost events, so there's nothing to report
+            if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                on_change(event->name);
+            }
+            current += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
 #endif
 
-}    // namespace Platform
\ No newline at end of file
+}    // namespace Platform
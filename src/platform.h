@@ -2,14 +2,71 @@
 
 #include "memory.h"
 
+#include <functional>
+#include <stdio.h>
+
 namespace Platform {
+
+// Options for reserved/committed virtual memory. These are hints; if the OS
+// can't honor one (no hugetlbfs pages configured, unsupported platform, etc.)
+// the call falls back to regular pages.
+enum VirtualMemoryFlags : uint32_t {
+    VIRTUAL_MEMORY_DEFAULT = 0,
+    // Ask the kernel to back the reservation with transparent huge pages
+    VIRTUAL_MEMORY_TRANSPARENT_HUGE_PAGES = 1 << 0,
+    // Back the reservation with explicit (hugetlbfs) huge pages. Commits are
+    // rounded up to the huge page size.
+    VIRTUAL_MEMORY_EXPLICIT_HUGE_PAGES = 1 << 1,
+    // Fault in committed pages up front instead of on first touch
+    VIRTUAL_MEMORY_PREFAULT = 1 << 2,
+};
+
 size_t get_page_size();
+size_t get_huge_page_size();
 inline size_t get_num_pages(size_t bytes) {
     return (bytes / get_page_size()) + 1;
 };
 
-void* virtual_reserve(size_t size, size_t& pages_reserved);
-void* virtual_commit(void* ptr, size_t size, size_t& pages_committed);
-void virtual_decommit(void* ptr, size_t size);
-void virtual_release(void* ptr);
-}    // namespace Platform
\ No newline at end of file
+void* virtual_reserve(size_t size, size_t& pages_reserved, uint32_t flags = VIRTUAL_MEMORY_DEFAULT);
+void* virtual_commit(void* ptr, size_t size, size_t& pages_committed,
+                     uint32_t flags = VIRTUAL_MEMORY_DEFAULT);
+// flags must match the ones the range was committed with. Returns false if
+// the pages couldn't be given back
+bool virtual_decommit(void* ptr, size_t size, uint32_t flags = VIRTUAL_MEMORY_DEFAULT);
+void virtual_release(void* ptr, size_t size);
+
+// Number of bytes in [ptr, ptr + size) currently backed by physical memory
+size_t virtual_resident_bytes(void* ptr, size_t size);
+
+// Flush a written file's data through to the disk
+void flush_file(FILE* file);
+
+// Move from over to in one step, so anyone opening to sees either the old or
+// the new file and never a partial write
+bool replace_file(const char* from, const char* to);
+
+// Reports files written or moved into a directory, not its subdirectories.
+// Uses inotify on Linux and ReadDirectoryChangesW on Windows. A watcher that
+// couldn't be set up logs why and never reports anything
+class DirectoryWatcher {
+  public:
+    explicit DirectoryWatcher(const char* path);
+    ~DirectoryWatcher();
+
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+    inline bool is_watching() const {
+        return m_native != nullptr;
+    }
+
+    // Calls on_change with the name, relative to the directory, of every file
+    // changed since the last poll. Never blocks. A file saved in several
+    // writes may be reported more than once
+    void poll(const std::function< void(const char*) >& on_change);
+
+  private:
+    struct Native;
+    Native* m_native = nullptr;
+};
+}    // namespace Platform
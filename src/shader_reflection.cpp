@@ -0,0 +1,845 @@
+#include "shader_reflection.h"
+#include "vulkan_utils.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <rapidjson/document.h>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Reflection JSON //////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void validate_type(rapidjson::GenericObject< false, rapidjson::Value >& types,
+                          const char* type_name) {
+    ASSERT(types.HasMember(type_name));
+    ASSERT(types[type_name].IsObject());
+
+    auto type = types[type_name].GetObject();
+    ASSERT(type.HasMember("name"));
+    ASSERT(type["name"].IsString());
+    ASSERT(type.HasMember("members"));
+    ASSERT(type["members"].IsArray());
+
+    auto members = type["members"].GetArray();
+    for (size_t i = 0; i < members.Size(); i++) {
+        auto& member = members[i];
+        ASSERT(member.HasMember("name"));
+        ASSERT(member["name"].IsString());
+        ASSERT(member.HasMember("type"));
+        ASSERT(member["type"].IsString());
+        ASSERT(member.HasMember("offset"));
+        ASSERT(member["offset"].IsInt());
+    }
+}
+
+static TypeInfo get_type_info(const char* type_name,
+                              rapidjson::GenericObject< false, rapidjson::Value >* types
+                              = nullptr) {
+    switch (Strings::hash(type_name)) {
+        case SID("float"): return get_type_info(Type::FLOAT);
+        case SID("vec2"): return get_type_info(Type::VEC2);
+        case SID("vec3"): return get_type_info(Type::VEC3);
+        case SID("vec4"): return get_type_info(Type::VEC4);
+        case SID("mat2"): return get_type_info(Type::MAT2);
+        case SID("mat3"): return get_type_info(Type::MAT3);
+        case SID("mat4"): return get_type_info(Type::MAT4);
+        default:
+            if (types) {
+                auto& types_obj = *types;
+                validate_type(types_obj, type_name);
+                auto type    = types_obj[type_name].GetObject();
+                auto members = type["members"].GetArray();
+
+                TypeInfo type_info = {};
+                for (size_t i = 0; i < members.Size(); i++) {
+                    auto& member              = members[i];
+                    TypeInfo member_type_info = get_type_info(member["type"].GetString(), types);
+
+                    type_info.data_size += member["offset"].GetInt() + member_type_info.data_size;
+                    type_info.location_span += member_type_info.location_span;
+                }
+                return type_info;
+            } else {
+                RUNTIME_ERROR("Unknown type %s", type_name);
+            }
+    }
+}
+
+static VkDescriptorType get_descriptor_type(const char* node_name, const char* type) {
+    VkDescriptorType result = VK_DESCRIPTOR_TYPE_MAX_ENUM;
+    Strings::StringId node_id = Strings::hash(node_name);
+    if (node_id == SID("ubos")) {
+        result = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    } else if (node_id == SID("textures")) {
+        if (Strings::hash(type) == SID("sampler2D")) {
+            result = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        }
+    }
+
+    ASSERT_MSG(result != VK_DESCRIPTOR_TYPE_MAX_ENUM, "Unsupported node %s, type %s", node_name,
+               type);
+    return result;
+}
+
+// Byte size of a block member in a reflected struct, following the offsets
+// and strides spirv-cross reports
+static uint32_t get_block_size(rapidjson::GenericObject< false, rapidjson::Value > block,
+                               rapidjson::GenericObject< false, rapidjson::Value >& types);
+
+static uint32_t get_member_size(rapidjson::Value& member,
+                                rapidjson::GenericObject< false, rapidjson::Value >& types) {
+    const char* type_name = member["type"].GetString();
+
+    uint32_t size = 0;
+    if (types.HasMember(type_name)) {
+        validate_type(types, type_name);
+        size = get_block_size(types[type_name].GetObject(), types);
+    } else {
+        TypeInfo type_info = get_type_info(type_name);
+        size               = (uint32_t) type_info.data_size;
+        if (member.HasMember("matrix_stride")) {
+            size = member["matrix_stride"].GetInt() * (uint32_t) type_info.location_span;
+        }
+    }
+
+    if (member.HasMember("array")) {
+        auto array = member["array"].GetArray();
+        for (size_t i = 0; i < array.Size(); i++) {
+            uint32_t stride = member.HasMember("array_stride") ? member["array_stride"].GetInt() : size;
+            size            = stride * array[i].GetInt();
+        }
+    }
+
+    return size;
+}
+
+static uint32_t get_block_size(rapidjson::GenericObject< false, rapidjson::Value > block,
+                               rapidjson::GenericObject< false, rapidjson::Value >& types) {
+    uint32_t end = 0;
+    auto members = block["members"].GetArray();
+    for (size_t i = 0; i < members.Size(); i++) {
+        uint32_t offset = members[i].HasMember("offset") ? members[i]["offset"].GetInt() : 0;
+        end             = std::max(end, offset + get_member_size(members[i], types));
+    }
+    return end;
+}
+
+static uint32_t get_min_member_offset(rapidjson::GenericObject< false, rapidjson::Value > block) {
+    uint32_t offset = std::numeric_limits< uint32_t >::max();
+    auto members    = block["members"].GetArray();
+    for (size_t i = 0; i < members.Size(); i++) {
+        offset = std::min(offset, members[i].HasMember("offset") ? (uint32_t) members[i]["offset"].GetInt() : 0u);
+    }
+    return members.Size() > 0 ? offset : 0;
+}
+
+void parse_reflection_json(const Memory::Buffer& reflection_json,
+                           ShaderModuleCreateInfo& out_reflection_data) {
+    rapidjson::Document document;
+    document.Parse((const char*) reflection_json.data, reflection_json.size);
+
+    ASSERT(document.IsObject());
+    auto root = document.GetObject();
+
+    ASSERT(root.HasMember("entryPoints"));
+    ASSERT(root["entryPoints"].IsArray());
+    auto entry_points = root["entryPoints"].GetArray();
+
+    ASSERT_MSG(entry_points.Size() <= 2, "Multiple entry points is currently not supported.");
+    ASSERT_MSG(entry_points.Size() > 0, "No entry point supplied.");
+
+    ASSERT(entry_points[0].IsObject());
+    auto entry_point = entry_points[0].GetObject();
+
+    ASSERT(entry_point.HasMember("name"));
+    ASSERT(entry_point["name"].IsString());
+    out_reflection_data.entry_point = Strings::lookup(Strings::intern(entry_point["name"].GetString()));
+
+    ASSERT(entry_point.HasMember("mode"));
+    ASSERT(entry_point["mode"].IsString());
+    Strings::StringId mode = Strings::hash(entry_point["mode"].GetString());
+
+    if (mode == SID("vert")) {
+        out_reflection_data.stage = VK_SHADER_STAGE_VERTEX_BIT;
+        if (root.HasMember("inputs")) {
+            ASSERT(root["inputs"].IsArray());
+            auto inputs = root["inputs"].GetArray();
+
+            ASSERT(inputs.Size() <= VULKAN_MAX_VERTEX_INPUTS);
+            for (size_t i = 0; i < inputs.Size(); i++) {
+                ASSERT(inputs[i].IsObject());
+                auto input = inputs[i].GetObject();
+
+                ASSERT(input.HasMember("type"));
+                ASSERT(input["type"].IsString());
+                ASSERT(input.HasMember("location"));
+                ASSERT(input["location"].IsInt());
+                ASSERT(input.HasMember("name"));
+                ASSERT(input["name"].IsString());
+
+                size_t location    = input["location"].GetInt();
+                TypeInfo type_info = get_type_info(input["type"].GetString());
+                if (location >= VULKAN_MAX_VERTEX_INPUTS
+                    || type_info.location_span > VULKAN_MAX_VERTEX_INPUTS - location) {
+                    RUNTIME_ERROR("Vertex input %s at location %zu is out of range",
+                                  input["name"].GetString(), location);
+                }
+
+                // Matrices fill one location per column
+                for (size_t column = 0; column < type_info.location_span; column++) {
+                    ShaderResourceCreateInfo::VertexInput& input_attrib
+                        = out_reflection_data.resource_info.vertex_inputs[location + column];
+                    input_attrib.format = type_info.format;
+                    input_attrib.name   = Strings::intern(input["name"].GetString());
+                }
+            }
+        }
+    } else if (mode == SID("frag")) {
+        out_reflection_data.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    } else if (mode == SID("geom")) {
+        out_reflection_data.stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+    } else if (mode == SID("tesc")) {
+        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+    } else if (mode == SID("tese")) {
+        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+    }
+
+    const auto add_descriptor_set_bindings = [&out_reflection_data, &root](const char* node_name) {
+        if (root.HasMember(node_name)) {
+            ASSERT(root[node_name].IsArray());
+            auto array = root[node_name].GetArray();
+
+            for (size_t i = 0; i < array.Size(); i++) {
+                ASSERT(array[i].IsObject());
+                auto binding_obj = array[i].GetObject();
+
+                ASSERT(binding_obj.HasMember("type"));
+                ASSERT(binding_obj["type"].IsString());
+                ASSERT(binding_obj.HasMember("set"));
+                ASSERT(binding_obj["set"].IsInt());
+                ASSERT(binding_obj.HasMember("binding"));
+                ASSERT(binding_obj["binding"].IsInt());
+                ASSERT(binding_obj.HasMember("name"));
+                ASSERT(binding_obj["name"].IsString());
+
+                size_t set_number     = binding_obj["set"].GetInt();
+                size_t binding_number = binding_obj["binding"].GetInt();
+
+                if (set_number >= VULKAN_MAX_DESCRIPTOR_SETS
+                    || binding_number >= VULKAN_MAX_DESCRIPTOR_BINDINGS) {
+                    RUNTIME_ERROR("Descriptor set %zu binding %zu is out of range", set_number,
+                                  binding_number);
+                }
+
+                DescriptorBinding& binding_info
+                    = out_reflection_data.resource_info
+                          .descriptor_bindings[set_number][binding_number];
+
+                binding_info.descriptor_count = 1;
+                if (binding_obj.HasMember("array")) {
+                    ASSERT(binding_obj["array"].IsArray());
+                    auto array_member = binding_obj["array"].GetArray();
+                    ASSERT_MSG(array_member.Size() == 1, "Only single dimension arrays supported");
+                    ASSERT(array_member[0].IsInt());
+
+                    binding_info.descriptor_count = array_member[0].GetInt();
+                }
+
+                binding_info.stage_flags = out_reflection_data.stage;
+                binding_info.descriptor_type
+                    = get_descriptor_type(node_name, binding_obj["type"].GetString());
+                binding_info.name = Strings::intern(binding_obj["name"].GetString());
+            }
+        }
+    };
+
+    add_descriptor_set_bindings("textures");
+    add_descriptor_set_bindings("ubos");
+
+    // TODO: other descriptor types
+
+    if (root.HasMember("push_constants")) {
+        ASSERT(root["push_constants"].IsArray());
+        auto array = root["push_constants"].GetArray();
+        ASSERT_MSG(array.Size() <= VULKAN_MAX_PUSH_CONSTANT_RANGES,
+                   "Only one push constant block supported");
+
+        ASSERT(root.HasMember("types"));
+        ASSERT(root["types"].IsObject());
+        auto types = root["types"].GetObject();
+
+        for (size_t i = 0; i < array.Size(); i++) {
+            ASSERT(array[i].IsObject());
+            auto push_constant = array[i].GetObject();
+
+            ASSERT(push_constant.HasMember("type"));
+            ASSERT(push_constant["type"].IsString());
+            const char* type_name = push_constant["type"].GetString();
+            validate_type(types, type_name);
+
+            auto block       = types[type_name].GetObject();
+            uint32_t offset  = get_min_member_offset(block);
+            uint32_t size    = get_block_size(block, types) - offset;
+            out_reflection_data.resource_info.push_constant_range
+                = { (VkShaderStageFlags) out_reflection_data.stage, offset, size };
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Reflection blob //////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool is_reflection_blob(const Memory::Buffer& reflection) {
+    uint32_t magic = 0;
+    if (reflection.size >= sizeof(ReflectionBlobHeader)) {
+        memcpy(&magic, reflection.data, sizeof(magic));
+    }
+    return magic == REFLECTION_BLOB_MAGIC;
+}
+
+void read_reflection_blob(const Memory::Buffer& blob, ShaderModuleCreateInfo& out_reflection_data) {
+    ReflectionBlobHeader header;
+    memcpy(&header, blob.data, sizeof(header));
+
+    if (header.version != REFLECTION_BLOB_VERSION) {
+        RUNTIME_ERROR("Reflection blob version %u, expected %u. Rebuild the shaders", header.version,
+                      REFLECTION_BLOB_VERSION);
+    }
+
+    size_t expected_size = sizeof(header) + header.num_vertex_inputs * sizeof(ReflectionBlobVertexInput)
+                           + header.num_descriptor_bindings * sizeof(ReflectionBlobBinding)
+                           + header.strings_size;
+    if (blob.size != expected_size) {
+        RUNTIME_ERROR("Reflection blob is %zu bytes, expected %zu", blob.size, expected_size);
+    }
+
+    // File buffers are 16 byte aligned, so the records can be read in place
+    const ReflectionBlobVertexInput* vertex_inputs
+        = (const ReflectionBlobVertexInput*) (blob.data + sizeof(header));
+    const ReflectionBlobBinding* bindings
+        = (const ReflectionBlobBinding*) (vertex_inputs + header.num_vertex_inputs);
+    const char* strings = (const char*) (bindings + header.num_descriptor_bindings);
+
+    const auto intern = [&header, strings](const ReflectionBlobString& str) {
+        if (str.offset > header.strings_size || str.length >= header.strings_size - str.offset) {
+            RUNTIME_ERROR("Reflection blob string at %u is out of range", str.offset);
+        }
+        return Strings::intern(strings + str.offset, str.length);
+    };
+
+    out_reflection_data.stage       = (VkShaderStageFlagBits) header.stage;
+    out_reflection_data.entry_point = Strings::lookup(intern(header.entry_point));
+
+    ShaderResourceCreateInfo& resource_info = out_reflection_data.resource_info;
+    for (uint32_t i = 0; i < header.num_vertex_inputs; i++) {
+        const ReflectionBlobVertexInput& input = vertex_inputs[i];
+        if (input.location >= VULKAN_MAX_VERTEX_INPUTS || input.location_span == 0
+            || input.location_span > VULKAN_MAX_VERTEX_INPUTS - input.location) {
+            RUNTIME_ERROR("Reflection blob vertex input location %u is out of range", input.location);
+        }
+
+        // Matrices fill one location per column
+        Strings::StringId name = intern(input.name);
+        for (uint32_t column = 0; column < input.location_span; column++) {
+            resource_info.vertex_inputs[input.location + column].name   = name;
+            resource_info.vertex_inputs[input.location + column].format = (VkFormat) input.format;
+        }
+    }
+
+    for (uint32_t i = 0; i < header.num_descriptor_bindings; i++) {
+        const ReflectionBlobBinding& binding = bindings[i];
+        if (binding.set >= VULKAN_MAX_DESCRIPTOR_SETS || binding.binding >= VULKAN_MAX_DESCRIPTOR_BINDINGS) {
+            RUNTIME_ERROR("Reflection blob descriptor set %u binding %u is out of range", binding.set,
+                          binding.binding);
+        }
+
+        DescriptorBinding& binding_info = resource_info.descriptor_bindings[binding.set][binding.binding];
+        binding_info.name             = intern(binding.name);
+        binding_info.descriptor_type  = (VkDescriptorType) binding.descriptor_type;
+        binding_info.descriptor_count = binding.descriptor_count;
+        binding_info.stage_flags      = header.stage;
+    }
+
+    if (header.push_constant_size > 0) {
+        resource_info.push_constant_range
+            = { header.stage, header.push_constant_offset, header.push_constant_size };
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// SPIR-V ///////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Only the parts of the SPIR-V spec reflection needs
+namespace SpirV {
+
+static const uint32_t MAGIC        = 0x07230203;
+static const uint32_t HEADER_WORDS = 5;
+
+enum Op {
+    OP_NAME               = 5,
+    OP_ENTRY_POINT        = 15,
+    OP_TYPE_BOOL          = 20,
+    OP_TYPE_INT           = 21,
+    OP_TYPE_FLOAT         = 22,
+    OP_TYPE_VECTOR        = 23,
+    OP_TYPE_MATRIX        = 24,
+    OP_TYPE_IMAGE         = 25,
+    OP_TYPE_SAMPLER       = 26,
+    OP_TYPE_SAMPLED_IMAGE = 27,
+    OP_TYPE_ARRAY         = 28,
+    OP_TYPE_RUNTIME_ARRAY = 29,
+    OP_TYPE_STRUCT        = 30,
+    OP_TYPE_POINTER       = 32,
+    OP_CONSTANT           = 43,
+    OP_SPEC_CONSTANT      = 50,
+    OP_FUNCTION           = 54,
+    OP_VARIABLE           = 59,
+    OP_DECORATE           = 71,
+    OP_MEMBER_DECORATE    = 72,
+};
+
+enum Decoration {
+    DECORATION_BLOCK          = 2,
+    DECORATION_BUFFER_BLOCK   = 3,
+    DECORATION_ARRAY_STRIDE   = 6,
+    DECORATION_MATRIX_STRIDE  = 7,
+    DECORATION_BUILT_IN       = 11,
+    DECORATION_LOCATION       = 30,
+    DECORATION_BINDING        = 33,
+    DECORATION_DESCRIPTOR_SET = 34,
+    DECORATION_OFFSET         = 35,
+};
+
+enum StorageClass {
+    STORAGE_CLASS_UNIFORM_CONSTANT = 0,
+    STORAGE_CLASS_INPUT            = 1,
+    STORAGE_CLASS_UNIFORM          = 2,
+    STORAGE_CLASS_PUSH_CONSTANT    = 9,
+    STORAGE_CLASS_STORAGE_BUFFER   = 12,
+};
+
+enum ExecutionModel {
+    EXECUTION_MODEL_VERTEX                  = 0,
+    EXECUTION_MODEL_TESSELLATION_CONTROL    = 1,
+    EXECUTION_MODEL_TESSELLATION_EVALUATION = 2,
+    EXECUTION_MODEL_GEOMETRY                = 3,
+    EXECUTION_MODEL_FRAGMENT                = 4,
+    EXECUTION_MODEL_GL_COMPUTE              = 5,
+};
+
+enum Dim {
+    DIM_BUFFER       = 5,
+    DIM_SUBPASS_DATA = 6,
+};
+
+}    // namespace SpirV
+
+// Everything the reflector keeps about one result id
+struct SpirVId {
+    enum Flags : uint32_t {
+        HAS_LOCATION       = 1 << 0,
+        HAS_DESCRIPTOR_SET = 1 << 1,
+        HAS_BINDING        = 1 << 2,
+        BLOCK              = 1 << 3,
+        BUFFER_BLOCK       = 1 << 4,
+        BUILT_IN           = 1 << 5,
+    };
+
+    // Instruction declaring the id, for types, constants and variables
+    const uint32_t* instruction;
+    const char* name;
+    uint32_t flags;
+    uint32_t location;
+    uint32_t descriptor_set;
+    uint32_t binding;
+    uint32_t array_stride;
+};
+
+struct SpirVMemberDecoration {
+    uint32_t struct_id;
+    uint32_t member;
+    uint32_t decoration;
+    uint32_t value;
+};
+
+struct SpirVModule {
+    const uint32_t* words;
+    size_t num_words;
+    SpirVId* ids;
+    uint32_t id_bound;
+    SpirVMemberDecoration* member_decorations;
+    size_t num_member_decorations;
+
+    inline SpirVId& id(uint32_t index) {
+        if (index >= id_bound) {
+            RUNTIME_ERROR("SPIR-V id %u out of range", index);
+        }
+        return ids[index];
+    }
+
+    // Declaring instruction of a type or constant, checked against op
+    inline const uint32_t* declaration(uint32_t index) {
+        const uint32_t* instruction = id(index).instruction;
+        if (!instruction) {
+            RUNTIME_ERROR("SPIR-V id %u used before it's declared", index);
+        }
+        return instruction;
+    }
+
+    inline uint32_t member_decoration(uint32_t struct_id, uint32_t member, uint32_t decoration,
+                                      uint32_t default_value = 0) {
+        for (size_t i = 0; i < num_member_decorations; i++) {
+            const SpirVMemberDecoration& member_decoration = member_decorations[i];
+            if (member_decoration.struct_id == struct_id && member_decoration.member == member
+                && member_decoration.decoration == decoration) {
+                return member_decoration.value;
+            }
+        }
+        return default_value;
+    }
+};
+
+static inline uint32_t spirv_opcode(const uint32_t* instruction) {
+    return instruction[0] & 0xFFFF;
+}
+
+static inline uint32_t spirv_word_count(const uint32_t* instruction) {
+    return instruction[0] >> 16;
+}
+
+static Strings::StringId intern_spirv_name(const char* name) {
+    return name ? Strings::intern(name) : Strings::INVALID_STRING_ID;
+}
+
+static uint32_t get_spirv_constant(SpirVModule& module, uint32_t constant_id) {
+    const uint32_t* constant = module.declaration(constant_id);
+    if (spirv_opcode(constant) != SpirV::OP_CONSTANT && spirv_opcode(constant) != SpirV::OP_SPEC_CONSTANT) {
+        RUNTIME_ERROR("SPIR-V id %u is not a constant", constant_id);
+    }
+    return constant[3];
+}
+
+// Byte size of a type laid out in a block. matrix_stride comes from the
+// member decorations of the enclosing struct
+static uint32_t get_spirv_type_size(SpirVModule& module, uint32_t type_id, uint32_t matrix_stride = 0) {
+    const uint32_t* type = module.declaration(type_id);
+    switch (spirv_opcode(type)) {
+        case SpirV::OP_TYPE_BOOL: return 4;
+        case SpirV::OP_TYPE_INT:
+        case SpirV::OP_TYPE_FLOAT: return type[2] / 8;
+        case SpirV::OP_TYPE_VECTOR: return type[3] * get_spirv_type_size(module, type[2]);
+        case SpirV::OP_TYPE_MATRIX:
+            return type[3] * (matrix_stride ? matrix_stride : get_spirv_type_size(module, type[2]));
+        case SpirV::OP_TYPE_ARRAY: {
+            uint32_t stride = module.id(type_id).array_stride;
+            if (!stride) {
+                stride = get_spirv_type_size(module, type[2], matrix_stride);
+            }
+            return stride * get_spirv_constant(module, type[3]);
+        }
+        case SpirV::OP_TYPE_STRUCT: {
+            uint32_t end = 0;
+            for (uint32_t member = 0; member + 2 < spirv_word_count(type); member++) {
+                uint32_t offset = module.member_decoration(type_id, member, SpirV::DECORATION_OFFSET);
+                uint32_t member_matrix_stride
+                    = module.member_decoration(type_id, member, SpirV::DECORATION_MATRIX_STRIDE);
+                end = std::max(end, offset
+                                        + get_spirv_type_size(module, type[2 + member],
+                                                              member_matrix_stride));
+            }
+            return end;
+        }
+        default: RUNTIME_ERROR("Unsupported SPIR-V type %u in block", spirv_opcode(type));
+    }
+}
+
+static VkFormat get_spirv_vertex_format(SpirVModule& module, uint32_t type_id) {
+    const uint32_t* type = module.declaration(type_id);
+
+    // Matrix columns all share the column's format
+    if (spirv_opcode(type) == SpirV::OP_TYPE_MATRIX) {
+        type = module.declaration(type[2]);
+    }
+
+    uint32_t num_components = 1;
+    if (spirv_opcode(type) == SpirV::OP_TYPE_VECTOR) {
+        num_components = type[3];
+        type           = module.declaration(type[2]);
+    }
+
+    static const VkFormat float_formats[]
+        = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT,
+            VK_FORMAT_R32G32B32A32_SFLOAT };
+    static const VkFormat sint_formats[]
+        = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT,
+            VK_FORMAT_R32G32B32A32_SINT };
+    static const VkFormat uint_formats[]
+        = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT,
+            VK_FORMAT_R32G32B32A32_UINT };
+
+    if (num_components < 1 || num_components > 4 || type[2] != 32) {
+        RUNTIME_ERROR("Unsupported vertex input type");
+    }
+
+    switch (spirv_opcode(type)) {
+        case SpirV::OP_TYPE_FLOAT: return float_formats[num_components - 1];
+        case SpirV::OP_TYPE_INT:
+            return type[3] ? sint_formats[num_components - 1] : uint_formats[num_components - 1];
+        default: RUNTIME_ERROR("Unsupported vertex input type");
+    }
+}
+
+static VkDescriptorType get_spirv_descriptor_type(SpirVModule& module, uint32_t type_id,
+                                                  uint32_t storage_class) {
+    const uint32_t* type = module.declaration(type_id);
+    switch (spirv_opcode(type)) {
+        case SpirV::OP_TYPE_STRUCT:
+            if (storage_class == SpirV::STORAGE_CLASS_STORAGE_BUFFER
+                || (module.id(type_id).flags & SpirVId::BUFFER_BLOCK)) {
+                return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            }
+            return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        case SpirV::OP_TYPE_SAMPLED_IMAGE: return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        case SpirV::OP_TYPE_SAMPLER: return VK_DESCRIPTOR_TYPE_SAMPLER;
+        case SpirV::OP_TYPE_IMAGE: {
+            // Sampled is 1 for images used with a sampler, 2 for storage images
+            uint32_t dim = type[3], sampled = type[7];
+            if (dim == SpirV::DIM_BUFFER) {
+                return sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                                    : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            } else if (dim == SpirV::DIM_SUBPASS_DATA) {
+                return VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+            }
+            return sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+        }
+        default: RUNTIME_ERROR("Unsupported SPIR-V descriptor type %u", spirv_opcode(type));
+    }
+}
+
+static void reflect_spirv_variable(SpirVModule& module, const uint32_t* variable,
+                                   ShaderModuleCreateInfo& out_reflection_data) {
+    const SpirVId& id      = module.id(variable[2]);
+    uint32_t storage_class = variable[3];
+
+    const uint32_t* pointer = module.declaration(variable[1]);
+    if (spirv_opcode(pointer) != SpirV::OP_TYPE_POINTER) {
+        RUNTIME_ERROR("SPIR-V variable %u is not a pointer", variable[2]);
+    }
+    uint32_t type_id = pointer[3];
+
+    ShaderResourceCreateInfo& resource_info = out_reflection_data.resource_info;
+    switch (storage_class) {
+        case SpirV::STORAGE_CLASS_INPUT: {
+            bool is_vertex_input = out_reflection_data.stage == VK_SHADER_STAGE_VERTEX_BIT;
+            if (!is_vertex_input || !(id.flags & SpirVId::HAS_LOCATION) || (id.flags & SpirVId::BUILT_IN)) {
+                return;
+            }
+
+            // Matrices fill one location per column
+            const uint32_t* type   = module.declaration(type_id);
+            uint32_t location_span = spirv_opcode(type) == SpirV::OP_TYPE_MATRIX ? type[3] : 1;
+            if (id.location >= VULKAN_MAX_VERTEX_INPUTS
+                || location_span > VULKAN_MAX_VERTEX_INPUTS - id.location) {
+                RUNTIME_ERROR("Vertex input %u at location %u needs %u locations, only %u supported",
+                              variable[2], id.location, location_span, VULKAN_MAX_VERTEX_INPUTS);
+            }
+
+            Strings::StringId name = intern_spirv_name(id.name);
+            VkFormat format        = get_spirv_vertex_format(module, type_id);
+            for (uint32_t column = 0; column < location_span; column++) {
+                ShaderResourceCreateInfo::VertexInput& input
+                    = resource_info.vertex_inputs[id.location + column];
+                input.name   = name;
+                input.format = format;
+            }
+            return;
+        }
+        case SpirV::STORAGE_CLASS_UNIFORM_CONSTANT:
+        case SpirV::STORAGE_CLASS_UNIFORM:
+        case SpirV::STORAGE_CLASS_STORAGE_BUFFER: {
+            if (!(id.flags & SpirVId::HAS_DESCRIPTOR_SET) || !(id.flags & SpirVId::HAS_BINDING)) {
+                return;
+            }
+            if (id.descriptor_set >= VULKAN_MAX_DESCRIPTOR_SETS
+                || id.binding >= VULKAN_MAX_DESCRIPTOR_BINDINGS) {
+                RUNTIME_ERROR("Descriptor set %u binding %u is out of range (max %u sets, %u bindings)",
+                              id.descriptor_set, id.binding, VULKAN_MAX_DESCRIPTOR_SETS,
+                              VULKAN_MAX_DESCRIPTOR_BINDINGS);
+            }
+
+            uint32_t descriptor_count = 1;
+            const uint32_t* type      = module.declaration(type_id);
+            if (spirv_opcode(type) == SpirV::OP_TYPE_ARRAY) {
+                descriptor_count = get_spirv_constant(module, type[3]);
+                type_id          = type[2];
+            } else if (spirv_opcode(type) == SpirV::OP_TYPE_RUNTIME_ARRAY) {
+                RUNTIME_ERROR("Unsized descriptor arrays are not supported");
+            }
+
+            DescriptorBinding& binding
+                = resource_info.descriptor_bindings[id.descriptor_set][id.binding];
+            binding.descriptor_type  = get_spirv_descriptor_type(module, type_id, storage_class);
+            binding.descriptor_count = descriptor_count;
+            binding.stage_flags      = out_reflection_data.stage;
+
+            // Buffers go by their block name, like spirv-cross reports them
+            bool is_buffer = spirv_opcode(module.declaration(type_id)) == SpirV::OP_TYPE_STRUCT;
+            binding.name   = intern_spirv_name(is_buffer ? module.id(type_id).name : id.name);
+            return;
+        }
+        case SpirV::STORAGE_CLASS_PUSH_CONSTANT: {
+            const uint32_t* block = module.declaration(type_id);
+            uint32_t num_members  = spirv_word_count(block) - 2;
+            if (num_members == 0) {
+                return;
+            }
+
+            uint32_t offset = std::numeric_limits< uint32_t >::max();
+            for (uint32_t member = 0; member < num_members; member++) {
+                offset = std::min(offset, module.member_decoration(type_id, member,
+                                                                   SpirV::DECORATION_OFFSET));
+            }
+
+            uint32_t size = get_spirv_type_size(module, type_id) - offset;
+            resource_info.push_constant_range
+                = { (VkShaderStageFlags) out_reflection_data.stage, offset, size };
+            return;
+        }
+        default: return;
+    }
+}
+
+bool is_spirv(const Memory::Buffer& buffer) {
+    uint32_t magic = 0;
+    if (buffer.size >= SpirV::HEADER_WORDS * sizeof(uint32_t) && (buffer.size & 3) == 0) {
+        memcpy(&magic, buffer.data, sizeof(magic));
+    }
+    return magic == SpirV::MAGIC;
+}
+
+void reflect_spirv(const Memory::Buffer& spirv, Memory::IAllocator& scratch,
+                   ShaderModuleCreateInfo& out_reflection_data) {
+    SpirVModule module   = {};
+    module.words         = (const uint32_t*) spirv.data;
+    module.num_words     = spirv.size / sizeof(uint32_t);
+
+    if (module.num_words < SpirV::HEADER_WORDS || module.words[0] != SpirV::MAGIC) {
+        RUNTIME_ERROR("Not a SPIR-V module");
+    }
+
+    // Every OpMemberDecorate is at least 4 words, which bounds how many there are
+    module.id_bound           = module.words[3];
+    module.ids                = scratch.allocate< SpirVId >(module.id_bound);
+    module.member_decorations = scratch.allocate< SpirVMemberDecoration >(module.num_words / 4);
+    memset(module.ids, 0, module.id_bound * sizeof(SpirVId));
+
+    bool found_entry_point = false;
+
+    const uint32_t* instruction = module.words + SpirV::HEADER_WORDS;
+    const uint32_t* end         = module.words + module.num_words;
+    for (; instruction < end; instruction += spirv_word_count(instruction)) {
+        uint32_t word_count = spirv_word_count(instruction);
+        if (word_count == 0 || instruction + word_count > end) {
+            RUNTIME_ERROR("Malformed SPIR-V instruction at word %zu",
+                          (size_t) (instruction - module.words));
+        }
+
+        uint32_t opcode = spirv_opcode(instruction);
+        switch (opcode) {
+            case SpirV::OP_ENTRY_POINT: {
+                if (found_entry_point) {
+                    RUNTIME_ERROR("Multiple entry points is currently not supported.");
+                }
+                found_entry_point = true;
+
+                switch (instruction[1]) {
+                    case SpirV::EXECUTION_MODEL_VERTEX:
+                        out_reflection_data.stage = VK_SHADER_STAGE_VERTEX_BIT;
+                        break;
+                    case SpirV::EXECUTION_MODEL_TESSELLATION_CONTROL:
+                        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+                        break;
+                    case SpirV::EXECUTION_MODEL_TESSELLATION_EVALUATION:
+                        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+                        break;
+                    case SpirV::EXECUTION_MODEL_GEOMETRY:
+                        out_reflection_data.stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+                        break;
+                    case SpirV::EXECUTION_MODEL_FRAGMENT:
+                        out_reflection_data.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+                        break;
+                    case SpirV::EXECUTION_MODEL_GL_COMPUTE:
+                        out_reflection_data.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+                        break;
+                    default: RUNTIME_ERROR("Unsupported execution model %u", instruction[1]);
+                }
+                out_reflection_data.entry_point
+                    = Strings::lookup(Strings::intern((const char*) &instruction[3]));
+                break;
+            }
+            case SpirV::OP_NAME: module.id(instruction[1]).name = (const char*) &instruction[2]; break;
+            case SpirV::OP_DECORATE: {
+                SpirVId& id    = module.id(instruction[1]);
+                uint32_t value = word_count > 3 ? instruction[3] : 0;
+                switch (instruction[2]) {
+                    case SpirV::DECORATION_BLOCK: id.flags |= SpirVId::BLOCK; break;
+                    case SpirV::DECORATION_BUFFER_BLOCK: id.flags |= SpirVId::BUFFER_BLOCK; break;
+                    case SpirV::DECORATION_BUILT_IN: id.flags |= SpirVId::BUILT_IN; break;
+                    case SpirV::DECORATION_ARRAY_STRIDE: id.array_stride = value; break;
+                    case SpirV::DECORATION_LOCATION:
+                        id.flags |= SpirVId::HAS_LOCATION;
+                        id.location = value;
+                        break;
+                    case SpirV::DECORATION_DESCRIPTOR_SET:
+                        id.flags |= SpirVId::HAS_DESCRIPTOR_SET;
+                        id.descriptor_set = value;
+                        break;
+                    case SpirV::DECORATION_BINDING:
+                        id.flags |= SpirVId::HAS_BINDING;
+                        id.binding = value;
+                        break;
+                }
+                break;
+            }
+            case SpirV::OP_MEMBER_DECORATE:
+                module.member_decorations[module.num_member_decorations++]
+                    = { instruction[1], instruction[2], instruction[3],
+                        word_count > 4 ? instruction[4] : 0 };
+                break;
+            case SpirV::OP_TYPE_BOOL:
+            case SpirV::OP_TYPE_INT:
+            case SpirV::OP_TYPE_FLOAT:
+            case SpirV::OP_TYPE_VECTOR:
+            case SpirV::OP_TYPE_MATRIX:
+            case SpirV::OP_TYPE_IMAGE:
+            case SpirV::OP_TYPE_SAMPLER:
+            case SpirV::OP_TYPE_SAMPLED_IMAGE:
+            case SpirV::OP_TYPE_ARRAY:
+            case SpirV::OP_TYPE_RUNTIME_ARRAY:
+            case SpirV::OP_TYPE_STRUCT:
+            case SpirV::OP_TYPE_POINTER: module.id(instruction[1]).instruction = instruction; break;
+            case SpirV::OP_CONSTANT:
+            case SpirV::OP_SPEC_CONSTANT: module.id(instruction[2]).instruction = instruction; break;
+            case SpirV::OP_VARIABLE:
+                module.id(instruction[2]).instruction = instruction;
+                reflect_spirv_variable(module, instruction, out_reflection_data);
+                break;
+        }
+
+        // Global declarations all come before the first function
+        if (opcode == SpirV::OP_FUNCTION) {
+            break;
+        }
+    }
+
+    if (!found_entry_point) {
+        RUNTIME_ERROR("No entry point supplied.");
+    }
+}
+}    // namespace Vulkan
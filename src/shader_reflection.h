@@ -0,0 +1,78 @@
+#pragma once
+
+#include "memory.h"
+#include "vulkan_types.h"
+
+#include <cstdint>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Reflection blob //////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Shader reflection baked at build time by cmake/spirv_reflection.py. Every
+// field is a little endian uint32_t, laid out as:
+//
+//   ReflectionBlobHeader
+//   ReflectionBlobVertexInput[num_vertex_inputs], sorted by location
+//   ReflectionBlobBinding[num_descriptor_bindings], sorted by set then binding
+//   strings_size bytes of null terminated names
+//
+// Names are referenced by offset and length into the strings. The script and
+// these structs must change together; bump the version when they do.
+
+static const uint32_t REFLECTION_BLOB_MAGIC   = 0x4C464552;    // "REFL"
+static const uint32_t REFLECTION_BLOB_VERSION = 2;
+
+struct ReflectionBlobString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct ReflectionBlobHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stage;    // VkShaderStageFlagBits
+    ReflectionBlobString entry_point;
+    uint32_t num_vertex_inputs;
+    uint32_t num_descriptor_bindings;
+    uint32_t push_constant_offset;
+    uint32_t push_constant_size;    // 0 without push constants
+    uint32_t strings_size;
+};
+
+struct ReflectionBlobVertexInput {
+    uint32_t location;
+    uint32_t format;           // VkFormat, of a column for matrices
+    uint32_t location_span;    // Number of columns for matrices, otherwise 1
+    ReflectionBlobString name;
+};
+
+struct ReflectionBlobBinding {
+    uint32_t set;
+    uint32_t binding;
+    uint32_t descriptor_type;    // VkDescriptorType
+    uint32_t descriptor_count;
+    ReflectionBlobString name;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Reflection ///////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reflect straight from the SPIR-V words. Per-id tables are taken from scratch
+// and not freed, so call it inside a scratch scope
+void reflect_spirv(const Memory::Buffer& spirv, Memory::IAllocator& scratch,
+                   ShaderModuleCreateInfo& out_reflection_data);
+// Whether the buffer starts with a SPIR-V header, eg. to reject a file caught
+// mid-write
+bool is_spirv(const Memory::Buffer& buffer);
+
+bool is_reflection_blob(const Memory::Buffer& buffer);
+void read_reflection_blob(const Memory::Buffer& buffer, ShaderModuleCreateInfo& out_reflection_data);
+
+// spirv-cross --reflect output
+void parse_reflection_json(const Memory::Buffer& buffer, ShaderModuleCreateInfo& out_reflection_data);
+
+}    // namespace Vulkan
@@ -0,0 +1,118 @@
+#include "string_id.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <mutex>
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// String table /////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace Strings {
+
+// Open addressed with linear probing. Strings and tables both live in one
+// heap; tables are never freed, but since they double each time the old ones
+// add up to less than the current one.
+struct Entry {
+    StringId id;
+    const char* str;
+};
+
+struct StringTable {
+    static const size_t INITIAL_CAPACITY = 1024;
+
+    Memory::VirtualHeap heap;
+    Entry* entries  = nullptr;
+    size_t capacity = 0;
+    size_t count    = 0;
+    std::mutex mutex;
+
+    StringTable()
+        : heap(GB(1)) {
+        heap.set_name("String table");
+        allocate_entries(INITIAL_CAPACITY);
+    }
+
+    void allocate_entries(size_t new_capacity) {
+        entries  = heap.allocate< Entry >(new_capacity);
+        capacity = new_capacity;
+        memset(entries, 0, new_capacity * sizeof(Entry));
+    }
+
+    // Slot holding id, or the empty slot it would go in
+    Entry* find(StringId id) {
+        size_t mask = capacity - 1;
+        for (size_t i = id & mask;; i = (i + 1) & mask) {
+            if (entries[i].id == id || !entries[i].str) {
+                return &entries[i];
+            }
+        }
+    }
+
+    void grow() {
+        Entry* old_entries  = entries;
+        size_t old_capacity = capacity;
+
+        allocate_entries(capacity * 2);
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_entries[i].str) {
+                *find(old_entries[i].id) = old_entries[i];
+            }
+        }
+    }
+};
+
+static StringTable& get_table() {
+    static StringTable table;
+    return table;
+}
+
+StringId intern(const char* str) {
+    return intern(str, strlen(str));
+}
+
+StringId intern(const char* str, size_t length) {
+    StringId id = hash(str, length);
+    if (id == INVALID_STRING_ID) {
+        RUNTIME_ERROR("String \"%.*s\" hashes to the invalid id", (int) length, str);
+    }
+
+    StringTable& table = get_table();
+    std::lock_guard< std::mutex > lock(table.mutex);
+
+    Entry* entry = table.find(id);
+    if (entry->str) {
+        // Two names sharing an id would resolve to each other's resources
+        if (strncmp(entry->str, str, length) != 0 || entry->str[length] != 0) {
+            RUNTIME_ERROR("String id collision between \"%s\" and \"%.*s\"", entry->str,
+                          (int) length, str);
+        }
+        return id;
+    }
+
+    // Keep the load factor under 3/4
+    if ((table.count + 1) * 4 > table.capacity * 3) {
+        table.grow();
+        entry = table.find(id);
+    }
+
+    char* copy = table.heap.allocate< char >(length + 1);
+    memcpy(copy, str, length);
+    copy[length] = 0;
+
+    entry->id  = id;
+    entry->str = copy;
+    table.count++;
+
+    return id;
+}
+
+const char* lookup(StringId id) {
+    StringTable& table = get_table();
+    std::lock_guard< std::mutex > lock(table.mutex);
+
+    Entry* entry = table.find(id);
+    return entry->str;
+}
+
+}    // namespace Strings
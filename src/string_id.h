@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+namespace Strings {
+
+// 32 bit FNV-1a hash of a string. Names are compared by this id alone, so two
+// different names interned with the same id is an error (caught by intern).
+typedef uint32_t StringId;
+
+static const StringId INVALID_STRING_ID = 0;
+
+static const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+static const uint32_t FNV_PRIME        = 16777619u;
+
+constexpr StringId hash(const char* str) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (; *str; str++) {
+        hash = (hash ^ (uint8_t) *str) * FNV_PRIME;
+    }
+    return hash;
+}
+
+constexpr StringId hash(const char* str, size_t length) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t) str[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Add a string to the global string table and return its id. The table keeps
+// its own copy, so str can be temporary
+StringId intern(const char* str);
+StringId intern(const char* str, size_t length);
+
+// The interned string for id, or null if nothing was interned with it. The
+// pointer stays valid for the lifetime of the program
+const char* lookup(StringId id);
+
+}    // namespace Strings
+
+// Id of a string literal, computed at compile time
+#define SID(str) (std::integral_constant< Strings::StringId, Strings::hash(str) >::value)
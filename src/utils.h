@@ -1,8 +1,13 @@
 #pragma once
 #include <cstdio>
+#include <cstdint>
 #include <iostream>
 #include <functional>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace Utils
 {
 
@@ -12,6 +17,28 @@ inline bool is_power_of_2(const size_t n) {
     return n != 0 && (n & (n - 1)) == 0;
 }
 
+// Index of the lowest set bit. n must not be 0
+inline size_t bit_scan_forward(const uint64_t n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, n);
+    return index;
+#else
+    return __builtin_ctzll(n);
+#endif
+}
+
+// Index of the highest set bit, IE floor(log2(n)). n must not be 0
+inline size_t bit_scan_reverse(const uint64_t n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, n);
+    return index;
+#else
+    return 63 - __builtin_clzll(n);
+#endif
+}
+
 #define LOG(logtype, format, ...) \
     do \
     { \
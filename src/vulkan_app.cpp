@@ -117,7 +117,8 @@ static VkInstance create_instance(const char* name, DeviceConfig& device_config)
     app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     app_info.pEngineName        = "None";
     app_info.engineVersion      = 1;
-    app_info.apiVersion         = VK_MAKE_VERSION(1, 0, VK_HEADER_VERSION);
+    // 1.1 for descriptor update templates
+    app_info.apiVersion         = VK_MAKE_VERSION(1, 1, 0);
 
     // Create instance info
     VkInstanceCreateInfo create_info = {};
@@ -195,6 +196,15 @@ static void find_queue_indices(PhysicalDevice& device, VkSurfaceKHR surface) {
     }
 }
 
+static bool supports_extension(const PhysicalDevice& gpu, const char* extension) {
+    auto compare = [&extension](const VkExtensionProperties& extension_prop) {
+        return strcmp(extension_prop.extensionName, extension) == 0;
+    };
+
+    return std::find_if(gpu.vk_extension_props.begin(), gpu.vk_extension_props.end(), compare)
+           != gpu.vk_extension_props.end();
+}
+
 static const size_t pick_physical_device(VkInstance instance, const DeviceConfig& device_config,
                                          VkSurfaceKHR                   surface,
                                          std::vector< PhysicalDevice >& out_gpus) {
@@ -297,13 +307,7 @@ static const size_t pick_physical_device(VkInstance instance, const DeviceConfig
             // Check extensions supported by device
             std::string unsupported_extensions = "";
             for (const char* extension : device_config.device_extensions) {
-                auto compare = [&extension](const VkExtensionProperties& extension_prop) {
-                    return strcmp(extension_prop.extensionName, extension) == 0;
-                };
-
-                if (std::find_if(gpu.vk_extension_props.begin(), gpu.vk_extension_props.end(),
-                                 compare)
-                    == gpu.vk_extension_props.end()) {
+                if (!supports_extension(gpu, extension)) {
                     unsupported_extensions += extension;
                     unsupported_extensions += ", ";
                 }
@@ -316,6 +320,12 @@ static const size_t pick_physical_device(VkInstance instance, const DeviceConfig
             }
         }
 
+        if (gpu.vk_physical_device_props.apiVersion < VK_MAKE_VERSION(1, 1, 0)) {
+            LOG_DEBUG("Skipping %s since it does not support Vulkan 1.1.",
+                      gpu.vk_physical_device_props.deviceName);
+            continue;
+        }
+
         if (gpu.vk_surface_formats.size() == 0) {
             LOG_DEBUG("Skipping %s since it does not have any suface formats.",
                       gpu.vk_physical_device_props.deviceName);
@@ -384,6 +394,31 @@ static VkSurfaceKHR create_surface(VkInstance instance, GLFWwindow* window) {
     return surface;
 }
 
+// Push descriptors are used when the extension was enabled, optional or not
+static void load_push_descriptors(App& app, const DeviceConfig& device_config) {
+    const std::vector< const char* >& extensions = device_config.device_extensions;
+    auto compare = [](const char* extension) {
+        return strcmp(extension, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0;
+    };
+    if (std::find_if(extensions.begin(), extensions.end(), compare) == extensions.end()) {
+        return;
+    }
+
+    app.cmd_push_descriptor_set_with_template = (PFN_vkCmdPushDescriptorSetWithTemplateKHR)
+        vkGetDeviceProcAddr(app.device, "vkCmdPushDescriptorSetWithTemplateKHR");
+
+    VkPhysicalDevicePushDescriptorPropertiesKHR push_descriptor_props = {};
+    push_descriptor_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PUSH_DESCRIPTOR_PROPERTIES_KHR;
+
+    VkPhysicalDeviceProperties2 props = {};
+    props.sType                       = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext                       = &push_descriptor_props;
+    vkGetPhysicalDeviceProperties2(app.available_gpus[app.gpu_index].vk_physical_device, &props);
+    app.max_push_descriptors = push_descriptor_props.maxPushDescriptors;
+
+    LOG_DEBUG("Push descriptors enabled, up to %u per set", app.max_push_descriptors);
+}
+
 /*
     phys_device          - physical device to build logical device from
     device_config        - extensions to enable for logical device
@@ -670,7 +705,14 @@ App::App(int width, int height, const char* name,
     gpu_index
         = pick_physical_device(vk_instance, device_config, vk_surface, available_gpus);
     PhysicalDevice& gpu = available_gpus[gpu_index];
-    device          = create_logical_device(gpu, device_config);
+
+    for (const char* extension : device_config.optional_device_extensions) {
+        if (supports_extension(gpu, extension)) {
+            device_config.device_extensions.push_back(extension);
+        }
+    }
+    device = create_logical_device(gpu, device_config);
+    load_push_descriptors(*this, device_config);
 
     vkGetDeviceQueue(device, gpu.graphics_family_index, 0, &graphics_queue);
     vkGetDeviceQueue(device, gpu.present_family_index, 0, &present_queue);
@@ -689,6 +731,18 @@ void App::wait_for_device() {
     vkDeviceWaitIdle(device);
 }
 
+unsigned int App::begin_frame() {
+    current_frame = (current_frame + 1) % max_rendering_frames;
+    frame_number++;
+
+    // Wait for the last queue that used these frame resources to finish rendering. After this
+    // anything the frame used (command buffer, per frame memory) is safe to reuse
+    vkWaitForFences(device, 1, &frame_resources[current_frame].draw_complete_fence, VK_TRUE,
+                    UINT64_MAX);
+
+    return current_frame;
+}
+
 App::~App() {
     vkQueueWaitIdle(graphics_queue);
     vkQueueWaitIdle(present_queue);
@@ -15,6 +15,8 @@ struct DeviceConfig {
     std::vector< const char* > validation_layers;
     std::vector< const char* > instance_extensions;
     std::vector< const char* > device_extensions;
+    // Enabled when the picked device supports them
+    std::vector< const char* > optional_device_extensions;
     VkPhysicalDeviceFeatures device_features = {};
     unsigned int max_frames_in_flight        = 0;
     unsigned int max_rendering_frames        = 0;
@@ -50,6 +52,9 @@ struct FrameResources {
 struct App {
     App(int width, int height, const char* name, const DeviceConfig& in_device_config = {});
     void wait_for_device();
+    // Advance current_frame to the next frame resource slot and wait until
+    // the GPU has finished the last frame submitted with it. Returns the slot.
+    unsigned int begin_frame();
     ~App();
 
     GLFWwindow* window;
@@ -67,6 +72,11 @@ struct App {
     VkQueue graphics_queue;
     VkQueue present_queue;
 
+    // VK_KHR_push_descriptor, null when it wasn't enabled. Push descriptor
+    // sets may have up to max_push_descriptors descriptors
+    PFN_vkCmdPushDescriptorSetWithTemplateKHR cmd_push_descriptor_set_with_template = nullptr;
+    uint32_t max_push_descriptors = 0;
+
     // Swapchain resources for each frame
     // size = max_frames_in_flight
     unsigned int max_frames_in_flight;
@@ -99,6 +109,10 @@ struct App {
     // size = max_rendering_frames
     unsigned int max_rendering_frames;
     unsigned int current_frame = 0;
+    // Frames begun so far. begin_frame waits on the fence of the frame
+    // max_rendering_frames before it, so once it returns every frame up to
+    // frame_number - max_rendering_frames has finished on the GPU
+    uint64_t frame_number = 0;
     VkCommandPool command_pool;
     std::vector< FrameResources > frame_resources;
 
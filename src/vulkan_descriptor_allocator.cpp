@@ -0,0 +1,195 @@
+#include "vulkan_descriptor_allocator.h"
+#include "vulkan_utils.h"
+#include "utils.h"
+
+#include <algorithm>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Descriptor allocator /////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Pools start with room for MIN_POOL_SETS sets and double up to MAX_POOL_SETS
+static const uint32_t MIN_POOL_SETS = 64;
+static const uint32_t MAX_POOL_SETS = 4096;
+// Chains' totals are halved past this many sets, so new pools follow the
+// layouts used lately rather than over the chain's whole life
+static const uint64_t MAX_CHAIN_HISTORY = 2 * MAX_POOL_SETS;
+
+DescriptorAllocator::DescriptorAllocator(VkDevice device, uint32_t num_frames)
+    : m_device(device)
+    , m_frame_chains(num_frames) {
+}
+
+DescriptorAllocator::~DescriptorAllocator() {
+    for (PoolChain& chain : m_frame_chains) {
+        for (VkDescriptorPool pool : chain.pools) {
+            vkDestroyDescriptorPool(m_device, pool, nullptr);
+        }
+    }
+    for (VkDescriptorPool pool : m_persistent_chain.pools) {
+        vkDestroyDescriptorPool(m_device, pool, nullptr);
+    }
+}
+
+void DescriptorAllocator::begin_frame(uint32_t frame) {
+    PoolChain& chain = m_frame_chains[frame];
+
+    // Pools past current were never touched this time round
+    for (size_t i = 0; i < chain.pools.size() && i <= chain.current; i++) {
+        VK_CHECK(vkResetDescriptorPool(m_device, chain.pools[i], 0));
+    }
+    chain.current = 0;
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(uint32_t frame, VkDescriptorSetLayout layout,
+                                              const DescriptorSetLayoutKey& key) {
+    return allocate(m_frame_chains[frame], layout, key);
+}
+
+VkDescriptorSet DescriptorAllocator::allocate_persistent(VkDescriptorSetLayout layout,
+                                                         const DescriptorSetLayoutKey& key) {
+    return allocate(m_persistent_chain, layout, key);
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(PoolChain& chain, VkDescriptorSetLayout layout,
+                                              const DescriptorSetLayoutKey& key) {
+    // Counted first, so a new pool has room for this set too
+    chain.num_sets++;
+    for (uint32_t i = 0; i < key.num_bindings; i++) {
+        uint32_t type = key.bindings[i].descriptor_type;
+        if (type >= VULKAN_NUM_DESCRIPTOR_TYPES) {
+            RUNTIME_ERROR("Descriptor type %u can't be pooled", type);
+        }
+        chain.num_descriptors[type] += key.bindings[i].descriptor_count;
+    }
+    if (chain.num_sets > MAX_CHAIN_HISTORY) {
+        chain.num_sets /= 2;
+        for (uint64_t& num_descriptors : chain.num_descriptors) {
+            num_descriptors /= 2;
+        }
+    }
+
+    VkDescriptorSetAllocateInfo allocate_info = {};
+    allocate_info.sType                       = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocate_info.descriptorSetCount          = 1;
+    allocate_info.pSetLayouts                 = &layout;
+
+    for (;;) {
+        bool new_pool = chain.current == chain.pools.size();
+        if (new_pool) {
+            chain.pools.push_back(create_pool(chain, key));
+        }
+
+        VkDescriptorSet set;
+        allocate_info.descriptorPool = chain.pools[chain.current];
+        VkResult result              = vkAllocateDescriptorSets(m_device, &allocate_info, &set);
+        if (result == VK_SUCCESS) {
+            return set;
+        }
+
+        // Full, or short of one of this layout's types. Later sets carry on
+        // from the next pool rather than trying this one again
+        if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) {
+            VK_CHECK(result);
+        }
+        // New pools have room for the set, so another one won't help
+        if (new_pool) {
+            RUNTIME_ERROR("Descriptor set doesn't fit a new pool (VkResult %d)", (int) result);
+        }
+        chain.current++;
+    }
+}
+
+VkDescriptorPool DescriptorAllocator::create_pool(const PoolChain& chain,
+                                                  const DescriptorSetLayoutKey& key) {
+    uint32_t max_sets = MIN_POOL_SETS << std::min< size_t >(chain.pools.size(), 6);
+    max_sets          = std::min(max_sets, MAX_POOL_SETS);
+
+    // The set the pool is made for has to fit, however rarely its types
+    // have been used
+    uint64_t needed[VULKAN_NUM_DESCRIPTOR_TYPES] = {};
+    for (uint32_t i = 0; i < key.num_bindings; i++) {
+        needed[key.bindings[i].descriptor_type] += key.bindings[i].descriptor_count;
+    }
+
+    // Each type gets the share of the pool it's had of the chain's recent sets
+    VkDescriptorPoolSize pool_sizes[VULKAN_NUM_DESCRIPTOR_TYPES];
+    uint32_t num_pool_sizes = 0;
+    for (uint32_t type = 0; type < VULKAN_NUM_DESCRIPTOR_TYPES; type++) {
+        uint64_t count = (chain.num_descriptors[type] * max_sets + chain.num_sets - 1) / chain.num_sets;
+        count          = std::max(count, needed[type]);
+        if (count == 0) {
+            continue;
+        }
+
+        VkDescriptorPoolSize& pool_size = pool_sizes[num_pool_sizes++];
+        pool_size.type                  = (VkDescriptorType) type;
+        pool_size.descriptorCount       = (uint32_t) std::min< uint64_t >(count, UINT32_MAX);
+    }
+
+    VkDescriptorPoolCreateInfo create_info = {};
+    create_info.sType                      = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    create_info.maxSets                    = max_sets;
+    create_info.poolSizeCount              = num_pool_sizes;
+    create_info.pPoolSizes                 = pool_sizes;
+
+    VkDescriptorPool pool;
+    VK_CHECK(vkCreateDescriptorPool(m_device, &create_info, nullptr, &pool));
+    return pool;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Descriptor update templates //////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+VkDescriptorUpdateTemplate create_descriptor_update_template(
+    VkDevice device, VkDescriptorSetLayout layout, const DescriptorSetLayoutKey& key,
+    VkPipelineLayout pipeline_layout, uint32_t set) {
+    // Templates need at least one entry, and an empty set has nothing to write
+    if (key.num_bindings == 0) {
+        return VK_NULL_HANDLE;
+    }
+
+    // One entry per binding. DescriptorInfo has the stride of every descriptor
+    // type's info, so a binding's elements are read straight from the array
+    VkDescriptorUpdateTemplateEntry entries[VULKAN_MAX_DESCRIPTOR_BINDINGS];
+    size_t offset = 0;
+
+    // Packed bindings are in binding order, so walking the mask pairs them up
+    uint32_t mask = key.binding_mask;
+    for (uint32_t i = 0; i < key.num_bindings; i++) {
+        const DescriptorSetLayoutKey::PackedBinding& packed = key.bindings[i];
+
+        entries[i].dstBinding      = (uint32_t) Utils::bit_scan_forward(mask);
+        entries[i].dstArrayElement = 0;
+        entries[i].descriptorCount = packed.descriptor_count;
+        entries[i].descriptorType  = (VkDescriptorType) packed.descriptor_type;
+        entries[i].offset          = offset;
+        entries[i].stride          = sizeof(DescriptorInfo);
+
+        offset += packed.descriptor_count * sizeof(DescriptorInfo);
+        mask &= mask - 1;
+    }
+
+    VkDescriptorUpdateTemplateCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+    create_info.descriptorUpdateEntryCount = key.num_bindings;
+    create_info.pDescriptorUpdateEntries   = entries;
+    create_info.templateType               = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+    create_info.descriptorSetLayout        = layout;
+    if (key.is_push_descriptor()) {
+        ASSERT(pipeline_layout != VK_NULL_HANDLE);
+        create_info.templateType      = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_PUSH_DESCRIPTORS_KHR;
+        create_info.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        create_info.pipelineLayout    = pipeline_layout;
+        create_info.set               = set;
+    }
+
+    VkDescriptorUpdateTemplate update_template;
+    VK_CHECK(vkCreateDescriptorUpdateTemplate(device, &create_info, nullptr, &update_template));
+    return update_template;
+}
+
+}    // namespace Vulkan
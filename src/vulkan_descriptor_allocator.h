@@ -0,0 +1,82 @@
+#pragma once
+
+#include "vulkan_types.h"
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Descriptor allocator /////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Allocates descriptor sets from chains of pools. Every frame slot has a chain
+// that's reset in bulk with vkResetDescriptorPool once the GPU is done with the
+// slot, so per frame sets are never freed one by one. Persistent sets have a
+// chain of their own, which is only ever dropped as a whole.
+//
+// When a pool runs out the chain moves on to its next one, creating a pool
+// twice the size of the last if there isn't one. New pools are split between
+// descriptor types in proportion to what the chain's layouts have asked for,
+// so they follow the reflected bindings in use. Chains keep their pools when
+// they're reset, so once a frame's worth of sets fits, no more are created.
+class DescriptorAllocator {
+  public:
+    DescriptorAllocator(VkDevice device, uint32_t num_frames);
+    ~DescriptorAllocator();
+
+    DescriptorAllocator(const DescriptorAllocator&) = delete;
+    DescriptorAllocator& operator=(const DescriptorAllocator&) = delete;
+
+    // Reset the frame slot's pools. Call once the GPU has finished with the
+    // frame that last used the slot
+    void begin_frame(uint32_t frame);
+
+    // Valid until begin_frame(frame) is next called
+    VkDescriptorSet allocate(uint32_t frame, VkDescriptorSetLayout layout,
+                             const DescriptorSetLayoutKey& key);
+    // Valid until the persistent pools are retired
+    VkDescriptorSet allocate_persistent(VkDescriptorSetLayout layout, const DescriptorSetLayoutKey& key);
+
+    // Hands over the persistent pools, eg. to destroy once the frames using
+    // their sets have finished, and starts again without any
+    template < typename F >
+    void retire_persistent_pools(F&& retire) {
+        for (VkDescriptorPool pool : m_persistent_chain.pools) {
+            retire(pool);
+        }
+        m_persistent_chain = PoolChain();
+    }
+
+  private:
+    struct PoolChain {
+        std::vector< VkDescriptorPool > pools;
+        // Pool sets are allocated from. The ones before it are full
+        size_t current = 0;
+        // Totals over the sets allocated from the chain lately, to size new
+        // pools. Halved as they grow, see MAX_CHAIN_HISTORY
+        uint64_t num_sets                                     = 0;
+        uint64_t num_descriptors[VULKAN_NUM_DESCRIPTOR_TYPES] = {};
+    };
+
+    VkDevice m_device;
+    std::vector< PoolChain > m_frame_chains;
+    PoolChain m_persistent_chain;
+
+    VkDescriptorSet allocate(PoolChain& chain, VkDescriptorSetLayout layout,
+                             const DescriptorSetLayoutKey& key);
+    // Sized from the chain's history, with room for at least one set with the key
+    VkDescriptorPool create_pool(const PoolChain& chain, const DescriptorSetLayoutKey& key);
+};
+
+// Template writing every descriptor of a set with the layout from an array of
+// DescriptorInfo, see count_descriptors. Push descriptor layouts get templates
+// for pushing the set to the graphics pipeline layout, which they're tied to.
+// VK_NULL_HANDLE for layouts without bindings
+VkDescriptorUpdateTemplate create_descriptor_update_template(
+    VkDevice device, VkDescriptorSetLayout layout, const DescriptorSetLayoutKey& key,
+    VkPipelineLayout pipeline_layout = VK_NULL_HANDLE, uint32_t set = 0);
+
+}    // namespace Vulkan
@@ -0,0 +1,268 @@
+#include "vulkan_pipeline_compiler.h"
+#include "vulkan_utils.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipeline compiler ////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+PipelineCompiler::PipelineCompiler(VkDevice device, VkPipelineCache seed_cache, size_t num_threads)
+    : m_device(device) {
+    ASSERT(num_threads > 0);
+
+    // Start every worker from what the main cache already knows, eg. a cache
+    // loaded from disk
+    std::vector< uint8_t > seed_data;
+    if (seed_cache != VK_NULL_HANDLE) {
+        size_t seed_size = 0;
+        VK_CHECK(vkGetPipelineCacheData(m_device, seed_cache, &seed_size, nullptr));
+        seed_data.resize(seed_size);
+        VK_CHECK(vkGetPipelineCacheData(m_device, seed_cache, &seed_size, seed_data.data()));
+        seed_data.resize(seed_size);
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {};
+    cache_info.sType                     = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cache_info.initialDataSize           = seed_data.size();
+    cache_info.pInitialData              = seed_data.empty() ? nullptr : seed_data.data();
+
+    m_thread_caches.resize(num_threads);
+    for (VkPipelineCache& cache : m_thread_caches) {
+        VK_CHECK(vkCreatePipelineCache(m_device, &cache_info, nullptr, &cache));
+    }
+
+    m_threads.reserve(num_threads);
+    for (size_t i = 0; i < num_threads; i++) {
+        m_threads.emplace_back(&PipelineCompiler::worker, this, i);
+    }
+}
+
+PipelineCompiler::~PipelineCompiler() {
+    {
+        std::lock_guard< std::mutex > lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_available.notify_all();
+
+    // Workers drain the queue before they exit
+    for (std::thread& thread : m_threads) {
+        thread.join();
+    }
+
+    for (VkPipelineCache cache : m_thread_caches) {
+        vkDestroyPipelineCache(m_device, cache, nullptr);
+    }
+}
+
+void PipelineCompiler::submit(Request* request) {
+    request->pipeline = VK_NULL_HANDLE;
+    request->result   = VK_NOT_READY;
+    request->done.store(false, std::memory_order_relaxed);
+
+    {
+        std::lock_guard< std::mutex > lock(m_mutex);
+        m_pending.push_back(request);
+        m_in_flight++;
+    }
+    m_work_available.notify_one();
+}
+
+void PipelineCompiler::wait(Request* request) {
+    std::unique_lock< std::mutex > lock(m_mutex);
+
+    auto it = std::find(m_pending.begin(), m_pending.end(), request);
+    if (it != m_pending.end()) {
+        m_pending.erase(it);
+        lock.unlock();
+
+        // Caches are internally synchronized, so borrowing a worker's is safe
+        compile_batch(m_thread_caches[0], &request, 1);
+        return;
+    }
+
+    m_work_done.wait(lock, [&]() { return is_done(request); });
+}
+
+void PipelineCompiler::wait_idle() {
+    std::unique_lock< std::mutex > lock(m_mutex);
+    m_work_done.wait(lock, [&]() { return m_in_flight == 0; });
+}
+
+void PipelineCompiler::merge_caches(VkPipelineCache dst_cache) {
+    VK_CHECK(vkMergePipelineCaches(m_device, dst_cache, (uint32_t) m_thread_caches.size(),
+                                   m_thread_caches.data()));
+}
+
+void PipelineCompiler::worker(size_t thread_index) {
+    VkPipelineCache cache = m_thread_caches[thread_index];
+
+    for (;;) {
+        Request* batch[MAX_BATCH_SIZE];
+        size_t batch_size = 0;
+        {
+            std::unique_lock< std::mutex > lock(m_mutex);
+            m_work_available.wait(lock, [&]() { return m_stopping || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+
+            // Take an even share of what's queued, so a burst of requests
+            // keeps every worker busy instead of landing in one batch
+            size_t num_threads = m_threads.size();
+            size_t share       = (m_pending.size() + num_threads - 1) / num_threads;
+            batch_size         = std::min(std::max< size_t >(share, 1), MAX_BATCH_SIZE);
+            for (size_t i = 0; i < batch_size; i++) {
+                batch[i] = m_pending.front();
+                m_pending.pop_front();
+            }
+
+            if (!m_pending.empty()) {
+                m_work_available.notify_one();
+            }
+        }
+
+        compile_batch(cache, batch, batch_size);
+    }
+}
+
+void PipelineCompiler::compile_batch(VkPipelineCache cache, Request** requests, size_t num_requests) {
+    VkGraphicsPipelineCreateInfo create_infos[MAX_BATCH_SIZE];
+    VkPipeline pipelines[MAX_BATCH_SIZE];
+    ASSERT(num_requests <= MAX_BATCH_SIZE);
+
+    for (size_t i = 0; i < num_requests; i++) {
+        create_infos[i] = requests[i]->create_info;
+        pipelines[i]    = VK_NULL_HANDLE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    VkResult result = vkCreateGraphicsPipelines(m_device, cache, (uint32_t) num_requests,
+                                                create_infos, nullptr, pipelines);
+
+    uint64_t compile_ns = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+
+    // On failure the pipelines that did build are still returned, the rest
+    // are null
+    for (size_t i = 0; i < num_requests; i++) {
+        Request* request    = requests[i];
+        request->pipeline   = pipelines[i];
+        request->result     = pipelines[i] != VK_NULL_HANDLE ? VK_SUCCESS : result;
+        request->compile_ns = compile_ns / num_requests;
+    }
+
+    {
+        std::lock_guard< std::mutex > lock(m_mutex);
+        for (size_t i = 0; i < num_requests; i++) {
+            requests[i]->done.store(true, std::memory_order_release);
+        }
+        m_in_flight -= num_requests;
+    }
+    m_work_done.notify_all();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Create info copies ///////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+template < typename T >
+static const T* copy_array(Memory::IAllocator& allocator, const T* data, size_t count) {
+    if (!data || count == 0) {
+        return nullptr;
+    }
+    T* copy = allocator.allocate< T >(count);
+    memcpy((void*) copy, (const void*) data, count * sizeof(T));
+    return copy;
+}
+
+// Copies a state struct, clearing ok if it has extension structs
+template < typename T >
+static T* copy_state(Memory::IAllocator& allocator, const T* state, bool& ok) {
+    if (!state) {
+        return nullptr;
+    }
+    ok &= state->pNext == nullptr;
+    return (T*) copy_array(allocator, state, 1);
+}
+
+bool copy_graphics_pipeline_create_info(const VkGraphicsPipelineCreateInfo& create_info,
+                                        Memory::IAllocator& allocator,
+                                        VkGraphicsPipelineCreateInfo& out_copy) {
+    bool ok  = create_info.pNext == nullptr;
+    out_copy = create_info;
+
+    VkPipelineShaderStageCreateInfo* stages = (VkPipelineShaderStageCreateInfo*) copy_array(
+        allocator, create_info.pStages, create_info.stageCount);
+    for (uint32_t i = 0; i < create_info.stageCount; i++) {
+        VkPipelineShaderStageCreateInfo& stage = stages[i];
+        ok &= stage.pNext == nullptr;
+        stage.pName = allocator.copy_string(stage.pName);
+
+        if (stage.pSpecializationInfo) {
+            VkSpecializationInfo* specialization
+                = (VkSpecializationInfo*) copy_array(allocator, stage.pSpecializationInfo, 1);
+            specialization->pMapEntries = copy_array(allocator, specialization->pMapEntries,
+                                                     specialization->mapEntryCount);
+            specialization->pData = copy_array(allocator, (const uint8_t*) specialization->pData,
+                                               specialization->dataSize);
+            stage.pSpecializationInfo = specialization;
+        }
+    }
+    out_copy.pStages = stages;
+
+    if (VkPipelineVertexInputStateCreateInfo* vertex_input
+        = copy_state(allocator, create_info.pVertexInputState, ok)) {
+        vertex_input->pVertexBindingDescriptions
+            = copy_array(allocator, vertex_input->pVertexBindingDescriptions,
+                         vertex_input->vertexBindingDescriptionCount);
+        vertex_input->pVertexAttributeDescriptions
+            = copy_array(allocator, vertex_input->pVertexAttributeDescriptions,
+                         vertex_input->vertexAttributeDescriptionCount);
+        out_copy.pVertexInputState = vertex_input;
+    }
+
+    out_copy.pInputAssemblyState = copy_state(allocator, create_info.pInputAssemblyState, ok);
+    out_copy.pTessellationState  = copy_state(allocator, create_info.pTessellationState, ok);
+    out_copy.pRasterizationState = copy_state(allocator, create_info.pRasterizationState, ok);
+    out_copy.pDepthStencilState  = copy_state(allocator, create_info.pDepthStencilState, ok);
+
+    if (VkPipelineViewportStateCreateInfo* viewport
+        = copy_state(allocator, create_info.pViewportState, ok)) {
+        // Null when the viewports or scissors are dynamic
+        viewport->pViewports = copy_array(allocator, viewport->pViewports, viewport->viewportCount);
+        viewport->pScissors  = copy_array(allocator, viewport->pScissors, viewport->scissorCount);
+        out_copy.pViewportState = viewport;
+    }
+
+    if (VkPipelineMultisampleStateCreateInfo* multisample
+        = copy_state(allocator, create_info.pMultisampleState, ok)) {
+        uint32_t num_mask_words = ((uint32_t) multisample->rasterizationSamples + 31) / 32;
+        multisample->pSampleMask = copy_array(allocator, multisample->pSampleMask, num_mask_words);
+        out_copy.pMultisampleState = multisample;
+    }
+
+    if (VkPipelineColorBlendStateCreateInfo* color_blend
+        = copy_state(allocator, create_info.pColorBlendState, ok)) {
+        color_blend->pAttachments
+            = copy_array(allocator, color_blend->pAttachments, color_blend->attachmentCount);
+        out_copy.pColorBlendState = color_blend;
+    }
+
+    if (VkPipelineDynamicStateCreateInfo* dynamic
+        = copy_state(allocator, create_info.pDynamicState, ok)) {
+        dynamic->pDynamicStates
+            = copy_array(allocator, dynamic->pDynamicStates, dynamic->dynamicStateCount);
+        out_copy.pDynamicState = dynamic;
+    }
+
+    return ok;
+}
+
+}    // namespace Vulkan
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "memory.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+namespace Vulkan {
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipeline compiler ////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Compiles graphics pipelines on a pool of worker threads. Workers take
+// pending requests in batches and build each batch with a single
+// vkCreateGraphicsPipelines call. Every worker has its own VkPipelineCache,
+// seeded from the cache passed in, so workers never contend on a cache;
+// merge_caches() folds what they've learned back into it.
+//
+// The compiler never allocates on behalf of a request. Its create info, and
+// everything that points to, must stay alive until the request is done.
+class PipelineCompiler {
+  public:
+    struct Request {
+        VkGraphicsPipelineCreateInfo create_info;
+
+        // Written by the worker before done is set
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkResult result     = VK_NOT_READY;
+        // This request's share of the batch's compile time
+        uint64_t compile_ns = 0;
+
+        std::atomic< bool > done { false };
+    };
+
+    // Batches are capped so a large submission is spread over all workers
+    static constexpr size_t MAX_BATCH_SIZE = 16;
+
+    PipelineCompiler(VkDevice device, VkPipelineCache seed_cache, size_t num_threads);
+    ~PipelineCompiler();
+
+    PipelineCompiler(const PipelineCompiler&) = delete;
+    PipelineCompiler& operator=(const PipelineCompiler&) = delete;
+
+    void submit(Request* request);
+
+    inline bool is_done(const Request* request) const {
+        return request->done.load(std::memory_order_acquire);
+    }
+
+    // Block until the request is done. A request nobody has picked up yet is
+    // compiled on the calling thread rather than waiting for a worker
+    void wait(Request* request);
+    // Block until every submitted request is done
+    void wait_idle();
+
+    // Merge the worker caches into dst_cache. Workers may keep compiling
+    // while this runs
+    void merge_caches(VkPipelineCache dst_cache);
+
+    inline size_t thread_count() const {
+        return m_threads.size();
+    }
+
+  private:
+    VkDevice m_device;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_available;
+    std::condition_variable m_work_done;
+    std::deque< Request* > m_pending;
+    size_t m_in_flight = 0;
+    bool m_stopping    = false;
+
+    std::vector< std::thread > m_threads;
+    std::vector< VkPipelineCache > m_thread_caches;
+
+    void worker(size_t thread_index);
+    void compile_batch(VkPipelineCache cache, Request** requests, size_t num_requests);
+};
+
+// Deep copy of a create info, so it can outlive the caller's stack. Returns
+// false for create infos with extension structs, which can't be copied
+bool copy_graphics_pipeline_create_info(const VkGraphicsPipelineCreateInfo& create_info,
+                                        Memory::IAllocator& allocator,
+                                        VkGraphicsPipelineCreateInfo& out_copy);
+
+}    // namespace Vulkan
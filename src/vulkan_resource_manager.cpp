@@ -2,16 +2,18 @@
 #include "vulkan_utils.h"
 
 #include "utils.h"
+#include "file_system.h"
 
 #include "vulkan_resource_manager.h"
+#include "vulkan_descriptor_allocator.h"
+#include "shader_reflection.h"
 
 #include <array>
 #include <algorithm>
+#include <chrono>
+#include <thread>
 #include <unordered_map>
 
-#include <rapidjson/document.h>
-#include <rapidjson/schema.h>
-
 #include <glm/glm.hpp>
 
 #include <static/static_resources.h>
@@ -27,401 +29,1522 @@ namespace Vulkan {
 // reuse vulkan objects as necessary.
 
 static VkVertexInputRate get_vertex_input_rate(const char* str) {
-    unsigned long hash = Hash::djb2_hash(str);
-    switch (hash) {
-        case Hash::djb2_hash("vertex"): return VK_VERTEX_INPUT_RATE_VERTEX;
-        case Hash::djb2_hash("instance"): return VK_VERTEX_INPUT_RATE_INSTANCE;
+    switch (Strings::hash(str)) {
+        case SID("vertex"): return VK_VERTEX_INPUT_RATE_VERTEX;
+        case SID("instance"): return VK_VERTEX_INPUT_RATE_INSTANCE;
         default: RUNTIME_ERROR("Unknown input rate %s", str);
     }
 }
 
-static void validate_type(rapidjson::GenericObject< false, rapidjson::Value >& types,
-                          const char* type_name) {
-    ASSERT(types.HasMember(type_name));
-    ASSERT(types[type_name].IsObject());
-
-    auto type = types[type_name].GetObject();
-    ASSERT(type.HasMember("name"));
-    ASSERT(type["name"].IsString());
-    ASSERT(type.HasMember("members"));
-    ASSERT(type["members"].IsArray());
-
-    auto members = type["members"].GetArray();
-    for (size_t i = 0; i < members.Size(); i++) {
-        auto& member = members[i];
-        ASSERT(member.HasMember("name"));
-        ASSERT(member["name"].IsString());
-        ASSERT(member.HasMember("type"));
-        ASSERT(member["type"].IsString());
-        ASSERT(member.HasMember("offset"));
-        ASSERT(member["offset"].IsInt());
-    }
-}
-
-static TypeInfo get_type_info(const char* type_name,
-                              rapidjson::GenericObject< false, rapidjson::Value >* types
-                              = nullptr) {
-    unsigned long hash = Hash::djb2_hash(type_name);
-    switch (hash) {
-        case Hash::djb2_hash("float"): return get_type_info(Type::FLOAT);
-        case Hash::djb2_hash("vec2"): return get_type_info(Type::VEC2);
-        case Hash::djb2_hash("vec3"): return get_type_info(Type::VEC3);
-        case Hash::djb2_hash("vec4"): return get_type_info(Type::VEC4);
-        case Hash::djb2_hash("mat2"): return get_type_info(Type::MAT2);
-        case Hash::djb2_hash("mat3"): return get_type_info(Type::MAT3);
-        case Hash::djb2_hash("mat4"): return get_type_info(Type::MAT4);
-        default:
-            if (types) {
-                auto& types_obj = *types;
-                validate_type(types_obj, type_name);
-                auto type    = types_obj[type_name].GetObject();
-                auto members = type["members"].GetArray();
-
-                TypeInfo type_info = {};
-                for (size_t i = 0; i < members.Size(); i++) {
-                    auto& member              = members[i];
-                    TypeInfo member_type_info = get_type_info(member["type"].GetString(), types);
-
-                    type_info.data_size += member["offset"].GetInt() + member_type_info.data_size;
-                    type_info.location_span += member_type_info.location_span;
-                }
-                return type_info;
-            } else {
-                RUNTIME_ERROR("Unknown type %s", type_name);
-            }
+ShaderModule ResourceManager::find_shader_module(Strings::StringId name) {
+    auto module_it = m_name_to_shader_module.find(name);
+    if (module_it == m_name_to_shader_module.end()) {
+        return ShaderModule::create_invalid();
     }
+
+    // The module may have been released since the name was added
+    if (!m_shader_modules.contains(module_it->second)) {
+        m_name_to_shader_module.erase(module_it);
+        return ShaderModule::create_invalid();
+    }
+    return module_it->second;
 }
 
-static VkDescriptorType get_descriptor_type(const char* node_name, const char* type) {
-    VkDescriptorType result = VK_DESCRIPTOR_TYPE_MAX_ENUM;
-    unsigned long node_hash = Hash::djb2_hash(node_name);
-    if (node_hash == Hash::djb2_hash("ubos")) {
-        result = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    } else if (node_hash == Hash::djb2_hash("textures")) {
-        unsigned long type_hash = Hash::djb2_hash(type);
-        if (type_hash == Hash::djb2_hash("sampler2D")) {
-            result = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        }
+const ShaderModuleCreateInfo& ResourceManager::get_shader_module_info(const ShaderModule& shader_module) {
+    ShaderModuleEntry* entry = m_shader_modules.get(shader_module);
+    if (!entry) {
+        RUNTIME_ERROR("Invalid or stale shader module handle %u:%u", shader_module.index,
+                      shader_module.generation);
     }
+    return entry->info;
+}
 
-    ASSERT_MSG(result != VK_DESCRIPTOR_TYPE_MAX_ENUM, "Unsupported node %s, type %s", node_name,
-               type);
-    return result;
+VkShaderModule ResourceManager::get_shader_module(const ShaderModule& shader_module) {
+    ShaderModuleEntry* entry = m_shader_modules.get(shader_module);
+    if (!entry) {
+        RUNTIME_ERROR("Invalid or stale shader module handle %u:%u", shader_module.index,
+                      shader_module.generation);
+    }
+    return entry->module;
 }
 
-ShaderModule ResourceManager::find_shader_module(const char* name) {
-    auto module_it = m_name_to_shader_module.find(name);
-    if (module_it != m_name_to_shader_module.end()) {
-        return module_it->second;
+bool ResourceManager::get_shader_module_serial(VkShaderModule module, uint64_t& serial) {
+    auto it = m_vk_to_shader_module.find(module);
+    if (it == m_vk_to_shader_module.end()) {
+        return false;
     }
-    return ShaderModule::create_invalid();
+    serial = m_shader_modules.get(it->second)->serial;
+    return true;
 }
 
-const ShaderModuleCreateInfo& ResourceManager::get_shader_module_info(const ShaderModule& shader_module) {
-    ASSERT_MSG(shader_module.is_valid() && shader_module.index < m_shader_modules.size(), "Invalid shader module handle %lu", shader_module.index);
-    return m_shader_modules[shader_module.index].first;
+void ResourceManager::release_shader_module(const ShaderModule& shader_module) {
+    ShaderModuleEntry* entry = m_shader_modules.get(shader_module);
+    if (!entry) {
+        return;
+    }
+
+    // Pipelines still compiling may use the module
+    wait_for_pipelines();
+
+    destroy_deferred(entry->module);
+
+    // A reloaded module may share its code key with another module
+    auto code_it = m_code_to_shader_module.find(entry->code);
+    if (code_it != m_code_to_shader_module.end() && code_it->second == shader_module) {
+        m_code_to_shader_module.erase(code_it);
+    }
+    m_allocator.free((void*) entry->code.pCode);
+    m_vk_to_shader_module.erase(entry->module);
+    m_shader_modules.release(shader_module);
 }
 
-VkShaderModule ResourceManager::get_shader_module(const ShaderModule& shader_module) {
-    ASSERT_MSG(shader_module.is_valid() && shader_module.index < m_shader_modules.size(), "Invalid shader module handle %lu", shader_module.index);
-    return m_shader_modules[shader_module.index].second;
+void ResourceManager::deserialize_reflection_data(const Memory::Buffer& reflection,
+                                                  ShaderModuleCreateInfo& out_reflection_data) {
+    if (reflection.size == 0) {
+        RUNTIME_ERROR("No reflection data supplied");
+    } else if (is_reflection_blob(reflection)) {
+        read_reflection_blob(reflection, out_reflection_data);
+    } else {
+        parse_reflection_json(reflection, out_reflection_data);
+    }
 }
 
-void ResourceManager::deserialize_reflection_data(const Memory::Buffer& reflection_json,
-                                           ShaderModuleCreateInfo& out_reflection_data) {
-    rapidjson::Document document;
-    document.Parse((const char*) reflection_json.data, reflection_json.size);
+static BufferLayout* get_default_mesh_layout() {
+    static BufferLayout::Attribute per_vertex_attributes[]
+        = { { "position", Type::VEC3 }, { "normal", Type::VEC3 }, { "uv", Type::VEC2 } };
 
-    ASSERT(document.IsObject());
-    auto root = document.GetObject();
+    static BufferLayout::Attribute per_instance_attributes[] = { { "mvm", Type::MAT4 } };
 
-    ASSERT(root.HasMember("entryPoints"));
-    ASSERT(root["entryPoints"].IsArray());
-    auto entry_points = root["entryPoints"].GetArray();
+    static BufferLayout::Binding bindings[]
+        = { { 0, per_vertex_attributes, ARRAY_LENGTH(per_vertex_attributes) },
+            { 1, per_instance_attributes, ARRAY_LENGTH(per_instance_attributes),
+              VK_VERTEX_INPUT_RATE_INSTANCE } };
 
-    ASSERT_MSG(entry_points.Size() <= 2, "Multiple entry points is currently not supported.");
-    ASSERT_MSG(entry_points.Size() > 0, "No entry point supplied.");
+    static BufferLayout layout = { bindings, ARRAY_LENGTH(bindings) };
 
-    ASSERT(entry_points[0].IsObject());
-    auto entry_point = entry_points[0].GetObject();
+    return &layout;
+}
 
-    ASSERT(entry_point.HasMember("name"));
-    ASSERT(entry_point["name"].IsString());
-    out_reflection_data.entry_point = m_string_allocator.copy_string(entry_point["name"].GetString());
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipeline state ///////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
 
-    ASSERT(entry_point.HasMember("mode"));
-    ASSERT(entry_point["mode"].IsString());
-    auto mode = entry_point["mode"].GetString();
+// Flattens the parts of a VkGraphicsPipelineCreateInfo that affect the
+// compiled pipeline into words. Anything the pipeline ignores is skipped, so
+// two create infos differing only in ignored state write the same words.
 
-    if (strcmp("vert", mode) == 0) {
-        out_reflection_data.stage = VK_SHADER_STAGE_VERTEX_BIT;
-        if (root.HasMember("inputs")) {
-            ASSERT(root["inputs"].IsArray());
-            auto inputs = root["inputs"].GetArray();
+static const size_t MAX_PIPELINE_STATE_WORDS = 2048;
 
-            ASSERT(inputs.Size() <= VULKAN_MAX_VERTEX_INPUTS);
-            for (size_t i = 0; i < inputs.Size(); i++) {
-                ASSERT(inputs[i].IsObject());
-                auto input = inputs[i].GetObject();
+struct PipelineStateWriter {
+    uint32_t words[MAX_PIPELINE_STATE_WORDS];
+    uint32_t num_words = 0;
+    // Set when the state didn't fit, the words are then incomplete
+    bool overflowed = false;
 
-                ASSERT(input.HasMember("type"));
-                ASSERT(input["type"].IsString());
-                ASSERT(input.HasMember("location"));
-                ASSERT(input["location"].IsInt());
-                ASSERT(input.HasMember("name"));
-                ASSERT(input["name"].IsString());
+    inline void write(uint32_t word) {
+        if (num_words == MAX_PIPELINE_STATE_WORDS) {
+            overflowed = true;
+            return;
+        }
+        words[num_words++] = word;
+    }
 
-                size_t location = input["location"].GetInt();
-                ASSERT(location < VULKAN_MAX_VERTEX_INPUTS);
+    inline void write(float value) {
+        uint32_t word;
+        memcpy(&word, &value, sizeof(word));
+        write(word);
+    }
 
-                ShaderResourceCreateInfo::VertexInput& input_attrib
-                    = out_reflection_data.resource_info.vertex_inputs[location];
-                input_attrib.format = get_type_info(input["type"].GetString()).format;
-                input_attrib.name   = m_allocator.copy_string(input["name"].GetString());
+    inline void write_handle(const void* handle) {
+        uint64_t value = (uint64_t) (uintptr_t) handle;
+        write((uint32_t) value);
+        write((uint32_t) (value >> 32));
+    }
+
+    inline void write_bytes(const void* data, size_t size) {
+        write((uint32_t) size);
+        for (size_t i = 0; i < size; i += sizeof(uint32_t)) {
+            uint32_t word = 0;
+            memcpy(&word, (const uint8_t*) data + i, std::min(size - i, sizeof(uint32_t)));
+            write(word);
+        }
+    }
+};
+
+static bool is_dynamic(uint32_t dynamic_mask, VkDynamicState state) {
+    return dynamic_mask & (1u << state);
+}
+
+static void write_stencil_op_state(PipelineStateWriter& writer, const VkStencilOpState& state,
+                                   uint32_t dynamic_mask) {
+    writer.write((uint32_t) state.failOp);
+    writer.write((uint32_t) state.passOp);
+    writer.write((uint32_t) state.depthFailOp);
+    writer.write((uint32_t) state.compareOp);
+    writer.write(is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK) ? 0 : state.compareMask);
+    writer.write(is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_WRITE_MASK) ? 0 : state.writeMask);
+    writer.write(is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_STENCIL_REFERENCE) ? 0 : state.reference);
+}
+
+static bool uses_blend_constants(VkBlendFactor factor) {
+    return factor >= VK_BLEND_FACTOR_CONSTANT_COLOR && factor <= VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_ALPHA;
+}
+
+// Returns false for create infos the key can't describe, which are then built
+// without caching.
+//
+// Shader modules are written as the serial module_serial(module, serial)
+// finds for them rather than their handle, since drivers reuse the handles
+// of destroyed modules. Modules it doesn't know make the state uncacheable
+template < typename F >
+static bool write_pipeline_state(const VkGraphicsPipelineCreateInfo& create_info,
+                                 PipelineStateWriter& writer, F&& module_serial) {
+    // Extension structs aren't understood here
+    const void* next_chains[] = {
+        create_info.pNext,
+        create_info.pVertexInputState ? create_info.pVertexInputState->pNext : nullptr,
+        create_info.pRasterizationState ? create_info.pRasterizationState->pNext : nullptr,
+        create_info.pMultisampleState ? create_info.pMultisampleState->pNext : nullptr,
+        create_info.pColorBlendState ? create_info.pColorBlendState->pNext : nullptr,
+    };
+    for (const void* next : next_chains) {
+        if (next) {
+            return false;
+        }
+    }
+
+    // Only the core dynamic states change which fields are ignored
+    uint32_t dynamic_mask = 0;
+    VkDynamicState dynamic_states[32];
+    uint32_t num_dynamic_states = 0;
+    if (create_info.pDynamicState) {
+        const VkPipelineDynamicStateCreateInfo& dynamic = *create_info.pDynamicState;
+        if (dynamic.dynamicStateCount > ARRAY_LENGTH(dynamic_states)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < dynamic.dynamicStateCount; i++) {
+            VkDynamicState state = dynamic.pDynamicStates[i];
+            if (state < 32) {
+                dynamic_mask |= 1u << state;
             }
+            dynamic_states[num_dynamic_states++] = state;
+        }
+        std::sort(dynamic_states, dynamic_states + num_dynamic_states);
+        num_dynamic_states = (uint32_t) (std::unique(dynamic_states, dynamic_states + num_dynamic_states)
+                                         - dynamic_states);
+    }
+
+    // Derivative pipelines build the same thing as their base, so the base
+    // handle and index are left out
+    writer.write((uint32_t) create_info.flags);
+    writer.write_handle(create_info.layout);
+    writer.write_handle(create_info.renderPass);
+    writer.write(create_info.subpass);
+
+    writer.write(num_dynamic_states);
+    for (uint32_t i = 0; i < num_dynamic_states; i++) {
+        writer.write((uint32_t) dynamic_states[i]);
+    }
+
+    // Shader stages, in stage order
+    VkPipelineShaderStageCreateInfo stages[8];
+    if (create_info.stageCount > ARRAY_LENGTH(stages)) {
+        return false;
+    }
+    std::copy(create_info.pStages, create_info.pStages + create_info.stageCount, stages);
+    std::sort(stages, stages + create_info.stageCount,
+              [](const auto& l, const auto& r) { return l.stage < r.stage; });
+
+    bool has_tessellation = false;
+    writer.write(create_info.stageCount);
+    for (uint32_t i = 0; i < create_info.stageCount; i++) {
+        const VkPipelineShaderStageCreateInfo& stage = stages[i];
+        if (stage.pNext) {
+            return false;
+        }
+
+        uint64_t serial;
+        if (!module_serial(stage.module, serial)) {
+            return false;
         }
-    } else if (strcmp("frag", mode) == 0) {
-        out_reflection_data.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    } else if (strcmp("geom", mode) == 0) {
-        out_reflection_data.stage = VK_SHADER_STAGE_GEOMETRY_BIT;
-    } else if (strcmp("tesc", mode) == 0) {
-        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
-    } else if (strcmp("tese", mode) == 0) {
-        out_reflection_data.stage = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
-    }
-
-    auto& string_allocator                 = this->m_string_allocator;
-    const auto add_descriptor_set_bindings = [&out_reflection_data, &root,
-                                              &string_allocator](const char* node_name) {
-        if (root.HasMember(node_name)) {
-            ASSERT(root[node_name].IsArray());
-            auto array = root[node_name].GetArray();
-
-            for (size_t i = 0; i < array.Size(); i++) {
-                ASSERT(array[i].IsObject());
-                auto binding_obj = array[i].GetObject();
-
-                ASSERT(binding_obj.HasMember("type"));
-                ASSERT(binding_obj["type"].IsString());
-                ASSERT(binding_obj.HasMember("set"));
-                ASSERT(binding_obj["set"].IsInt());
-                ASSERT(binding_obj.HasMember("binding"));
-                ASSERT(binding_obj["binding"].IsInt());
-                ASSERT(binding_obj.HasMember("name"));
-                ASSERT(binding_obj["name"].IsString());
-
-                size_t set_number     = binding_obj["set"].GetInt();
-                size_t binding_number = binding_obj["binding"].GetInt();
-
-                ASSERT(set_number < VULKAN_MAX_DESCRIPTOR_SETS);
-                ASSERT(binding_number < VULKAN_MAX_DESCRIPTOR_BINDINGS);
-
-                DescriptorBinding& binding_info
-                    = out_reflection_data.resource_info
-                          .descriptor_bindings[set_number][binding_number];
-
-                if (binding_obj.HasMember("array")) {
-                    ASSERT(binding_obj["array"].IsArray());
-                    auto array_member = binding_obj["array"].GetArray();
-                    ASSERT_MSG(array_member.Size() == 0, "Only single dimension arrays supported");
-                    ASSERT(array_member[0].IsInt());
-
-                    binding_info.descriptor_count = array_member[0].GetInt();
-                }
 
-                binding_info.stage_flags = out_reflection_data.stage;
-                binding_info.descriptor_type
-                    = get_descriptor_type(node_name, binding_obj["type"].GetString());
-                binding_info.name = string_allocator.copy_string(binding_obj["name"].GetString());
+        has_tessellation |= stage.stage == VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+        writer.write((uint32_t) stage.flags);
+        writer.write((uint32_t) stage.stage);
+        writer.write((uint32_t) serial);
+        writer.write((uint32_t) (serial >> 32));
+        writer.write_bytes(stage.pName, strlen(stage.pName));
+
+        const VkSpecializationInfo* specialization = stage.pSpecializationInfo;
+        writer.write(specialization ? specialization->mapEntryCount : 0);
+        if (specialization) {
+            for (uint32_t j = 0; j < specialization->mapEntryCount; j++) {
+                const VkSpecializationMapEntry& entry = specialization->pMapEntries[j];
+                writer.write(entry.constantID);
+                writer.write(entry.offset);
+                writer.write((uint32_t) entry.size);
             }
+            writer.write_bytes(specialization->pData, specialization->dataSize);
         }
-    };
+    }
+
+    // Vertex input, bindings and attributes sorted by binding and location
+    const VkPipelineVertexInputStateCreateInfo* vertex_input = create_info.pVertexInputState;
+    uint32_t num_bindings   = vertex_input ? vertex_input->vertexBindingDescriptionCount : 0;
+    uint32_t num_attributes = vertex_input ? vertex_input->vertexAttributeDescriptionCount : 0;
+
+    VkVertexInputBindingDescription bindings[32];
+    VkVertexInputAttributeDescription attributes[32];
+    if (num_bindings > ARRAY_LENGTH(bindings) || num_attributes > ARRAY_LENGTH(attributes)) {
+        return false;
+    }
+    if (vertex_input) {
+        std::copy(vertex_input->pVertexBindingDescriptions,
+                  vertex_input->pVertexBindingDescriptions + num_bindings, bindings);
+        std::copy(vertex_input->pVertexAttributeDescriptions,
+                  vertex_input->pVertexAttributeDescriptions + num_attributes, attributes);
+    }
+    std::sort(bindings, bindings + num_bindings,
+              [](const auto& l, const auto& r) { return l.binding < r.binding; });
+    std::sort(attributes, attributes + num_attributes,
+              [](const auto& l, const auto& r) { return l.location < r.location; });
+
+    writer.write(num_bindings);
+    for (uint32_t i = 0; i < num_bindings; i++) {
+        writer.write(bindings[i].binding);
+        writer.write(bindings[i].stride);
+        writer.write((uint32_t) bindings[i].inputRate);
+    }
+    writer.write(num_attributes);
+    for (uint32_t i = 0; i < num_attributes; i++) {
+        writer.write(attributes[i].location);
+        writer.write(attributes[i].binding);
+        writer.write((uint32_t) attributes[i].format);
+        writer.write(attributes[i].offset);
+    }
+
+    if (const VkPipelineInputAssemblyStateCreateInfo* input_assembly = create_info.pInputAssemblyState) {
+        writer.write((uint32_t) input_assembly->topology);
+        writer.write(input_assembly->primitiveRestartEnable);
+    }
 
-    add_descriptor_set_bindings("textures");
-    add_descriptor_set_bindings("ubos");
+    // Tessellation state is ignored without tessellation shaders
+    if (has_tessellation && create_info.pTessellationState) {
+        writer.write(create_info.pTessellationState->patchControlPoints);
+    }
 
-    // TODO: other descriptor types
+    const VkPipelineRasterizationStateCreateInfo& raster = *create_info.pRasterizationState;
+    writer.write((uint32_t) raster.flags);
+    writer.write(raster.depthClampEnable);
+    writer.write(raster.rasterizerDiscardEnable);
+    writer.write((uint32_t) raster.polygonMode);
+    writer.write((uint32_t) raster.cullMode);
+    writer.write((uint32_t) raster.frontFace);
+    writer.write(raster.depthBiasEnable);
+    if (raster.depthBiasEnable && !is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_DEPTH_BIAS)) {
+        writer.write(raster.depthBiasConstantFactor);
+        writer.write(raster.depthBiasClamp);
+        writer.write(raster.depthBiasSlopeFactor);
+    }
+    if (!is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_LINE_WIDTH)) {
+        writer.write(raster.lineWidth);
+    }
 
-    // TODO: Extract push constants
-    /*
-    if (root.HasMember("push_constants")) {
-        ASSERT(root.HasMember("types"));
-        ASSERT(root["types"].IsObject());
-        auto& types = root["types"].GetObject();
+    // The rest is ignored when rasterization is disabled
+    if (raster.rasterizerDiscardEnable) {
+        return !writer.overflowed;
+    }
 
-        ASSERT(root["push_constants"].IsArray());
-        auto& array = root["push_constants"].GetArray();
+    if (const VkPipelineViewportStateCreateInfo* viewport = create_info.pViewportState) {
+        writer.write(viewport->viewportCount);
+        if (!is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_VIEWPORT) && viewport->pViewports) {
+            for (uint32_t i = 0; i < viewport->viewportCount; i++) {
+                const VkViewport& v = viewport->pViewports[i];
+                writer.write(v.x);
+                writer.write(v.y);
+                writer.write(v.width);
+                writer.write(v.height);
+                writer.write(v.minDepth);
+                writer.write(v.maxDepth);
+            }
+        }
+        writer.write(viewport->scissorCount);
+        if (!is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_SCISSOR) && viewport->pScissors) {
+            for (uint32_t i = 0; i < viewport->scissorCount; i++) {
+                const VkRect2D& scissor = viewport->pScissors[i];
+                writer.write((uint32_t) scissor.offset.x);
+                writer.write((uint32_t) scissor.offset.y);
+                writer.write(scissor.extent.width);
+                writer.write(scissor.extent.height);
+            }
+        }
+    }
 
-        size_t current_offset = 0;
+    if (const VkPipelineMultisampleStateCreateInfo* multisample = create_info.pMultisampleState) {
+        writer.write((uint32_t) multisample->rasterizationSamples);
+        writer.write(multisample->sampleShadingEnable);
+        if (multisample->sampleShadingEnable) {
+            writer.write(multisample->minSampleShading);
+        }
+        writer.write(multisample->pSampleMask ? 1u : 0u);
+        if (multisample->pSampleMask) {
+            uint32_t num_mask_words = ((uint32_t) multisample->rasterizationSamples + 31) / 32;
+            for (uint32_t i = 0; i < num_mask_words; i++) {
+                writer.write(multisample->pSampleMask[i]);
+            }
+        }
+        writer.write(multisample->alphaToCoverageEnable);
+        writer.write(multisample->alphaToOneEnable);
+    }
 
-        for (size_t i = 0; i < array.Size(); i++) {
-            ASSERT(array[i].IsObject());
-            auto& push_constant = array[i].GetObject();
+    writer.write(create_info.pDepthStencilState ? 1u : 0u);
+    if (const VkPipelineDepthStencilStateCreateInfo* depth_stencil = create_info.pDepthStencilState) {
+        writer.write(depth_stencil->depthTestEnable);
+        if (depth_stencil->depthTestEnable) {
+            writer.write(depth_stencil->depthWriteEnable);
+            writer.write((uint32_t) depth_stencil->depthCompareOp);
+        }
+        writer.write(depth_stencil->depthBoundsTestEnable);
+        if (depth_stencil->depthBoundsTestEnable
+            && !is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_DEPTH_BOUNDS)) {
+            writer.write(depth_stencil->minDepthBounds);
+            writer.write(depth_stencil->maxDepthBounds);
+        }
+        writer.write(depth_stencil->stencilTestEnable);
+        if (depth_stencil->stencilTestEnable) {
+            write_stencil_op_state(writer, depth_stencil->front, dynamic_mask);
+            write_stencil_op_state(writer, depth_stencil->back, dynamic_mask);
+        }
+    }
 
-            ASSERT(push_constant.HasMember("type"));
-            ASSERT(push_constant["type"].IsString());
-            ASSERT(push_constant.HasMember("name"));
-            ASSERT(push_constant["name"].IsString());
+    writer.write(create_info.pColorBlendState ? 1u : 0u);
+    if (const VkPipelineColorBlendStateCreateInfo* color_blend = create_info.pColorBlendState) {
+        writer.write(color_blend->logicOpEnable);
+        if (color_blend->logicOpEnable) {
+            writer.write((uint32_t) color_blend->logicOp);
+        }
 
-            const char* type_name = push_constant["name"].GetString();
-            TypeInfo type_info = get_type_info(type_name, &types);
+        bool constants_used = false;
+        writer.write(color_blend->attachmentCount);
+        for (uint32_t i = 0; i < color_blend->attachmentCount; i++) {
+            const VkPipelineColorBlendAttachmentState& attachment = color_blend->pAttachments[i];
+            writer.write(attachment.blendEnable);
+            if (attachment.blendEnable) {
+                writer.write((uint32_t) attachment.srcColorBlendFactor);
+                writer.write((uint32_t) attachment.dstColorBlendFactor);
+                writer.write((uint32_t) attachment.colorBlendOp);
+                writer.write((uint32_t) attachment.srcAlphaBlendFactor);
+                writer.write((uint32_t) attachment.dstAlphaBlendFactor);
+                writer.write((uint32_t) attachment.alphaBlendOp);
+
+                constants_used |= uses_blend_constants(attachment.srcColorBlendFactor)
+                                  || uses_blend_constants(attachment.dstColorBlendFactor)
+                                  || uses_blend_constants(attachment.srcAlphaBlendFactor)
+                                  || uses_blend_constants(attachment.dstAlphaBlendFactor);
+            }
+            writer.write((uint32_t) attachment.colorWriteMask);
+        }
 
-            out_reflection_data.push_constant_ranges.push_back(new_range);
+        if (constants_used && !is_dynamic(dynamic_mask, VK_DYNAMIC_STATE_BLEND_CONSTANTS)) {
+            for (float constant : color_blend->blendConstants) {
+                writer.write(constant);
+            }
         }
     }
-    */
+
+    return !writer.overflowed;
 }
 
-static BufferLayout* get_default_mesh_layout() {
-    static BufferLayout::Attribute per_vertex_attributes[]
-        = { { "position", Type::VEC3 }, { "normal", Type::VEC3 }, { "uv", Type::VEC2 } };
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipeline cache file //////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
 
-    static BufferLayout::Attribute per_instance_attributes[] = { { "mvm", Type::MAT4 } };
+// The driver's cache blob, behind a header identifying the device and driver
+// that wrote it. Drivers are meant to reject blobs from other devices, but
+// not all of them do so gracefully, and the Vulkan header has no driver
+// version, so anything that doesn't match exactly is dropped before the
+// driver sees it.
+
+static const uint32_t PIPELINE_CACHE_FILE_MAGIC   = 0x46435056;    // "VPCF"
+static const uint32_t PIPELINE_CACHE_FILE_VERSION = 1;
+
+// Caches over this size aren't written. The driver's blob can't be trimmed,
+// and a cache this large costs more to load than it saves
+static const size_t PIPELINE_CACHE_MAX_SIZE = MB(64);
+
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint32_t cold_compiles;
+    uint64_t cold_compile_ns;
+    uint64_t data_size;
+    uint64_t data_hash;
+};
+
+// Start of VkPipelineCacheHeaderVersionOne, at the front of the driver's blob
+struct VulkanPipelineCacheHeader {
+    uint32_t header_size;
+    uint32_t header_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+};
+
+static bool validate_pipeline_cache_file(const Memory::Buffer& file,
+                                         const VkPhysicalDeviceProperties& props,
+                                         PipelineCacheFileHeader& out_header) {
+    if (file.size < sizeof(PipelineCacheFileHeader)) {
+        LOG_WARNING("Pipeline cache file truncated");
+        return false;
+    }
 
-    static BufferLayout::Binding bindings[]
-        = { { 0, per_vertex_attributes, ARRAY_LENGTH(per_vertex_attributes) },
-            { 1, per_instance_attributes, ARRAY_LENGTH(per_instance_attributes),
-              VK_VERTEX_INPUT_RATE_INSTANCE } };
+    PipelineCacheFileHeader& header = out_header;
+    memcpy(&header, file.data, sizeof(header));
 
-    static BufferLayout layout = { bindings, ARRAY_LENGTH(bindings) };
+    if (header.magic != PIPELINE_CACHE_FILE_MAGIC || header.version != PIPELINE_CACHE_FILE_VERSION) {
+        LOG_WARNING("Pipeline cache file has an unknown format");
+        return false;
+    }
 
-    return &layout;
+    if (header.vendor_id != props.vendorID || header.device_id != props.deviceID
+        || header.driver_version != props.driverVersion
+        || memcmp(header.pipeline_cache_uuid, props.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        LOG_INFO("Pipeline cache file is from a different device or driver, ignoring it");
+        return false;
+    }
+
+    const uint8_t* data = file.data + sizeof(header);
+    if (header.data_size != file.size - sizeof(header) || header.data_size > PIPELINE_CACHE_MAX_SIZE
+        || header.data_hash != Hash::hash64(data, header.data_size)) {
+        LOG_WARNING("Pipeline cache file is corrupt");
+        return false;
+    }
+
+    VulkanPipelineCacheHeader vk_header;
+    if (header.data_size < sizeof(vk_header)) {
+        LOG_WARNING("Pipeline cache file is corrupt");
+        return false;
+    }
+    memcpy(&vk_header, data, sizeof(vk_header));
+
+    if (vk_header.header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        || vk_header.header_size < sizeof(vk_header) || vk_header.vendor_id != props.vendorID
+        || vk_header.device_id != props.deviceID
+        || memcmp(vk_header.pipeline_cache_uuid, props.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        LOG_WARNING("Pipeline cache data doesn't match its file header");
+        return false;
+    }
+
+    return true;
+}
+
+void ResourceManager::create_pipeline_cache() {
+    const VkPhysicalDeviceProperties& props
+        = m_app.available_gpus[m_app.gpu_index].vk_physical_device_props;
+
+    VkPipelineCacheCreateInfo create_info = {};
+    create_info.sType                     = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+    if (m_pipeline_cache_path) {
+        // The file buffer is scratch, so the cache is created inside the callback
+        FileSystem::load_native_file(m_pipeline_cache_path, [&](const Memory::Buffer& file) {
+            PipelineCacheFileHeader header;
+            if (!validate_pipeline_cache_file(file, props, header)) {
+                return;
+            }
+
+            create_info.initialDataSize = header.data_size;
+            create_info.pInitialData    = file.data + sizeof(header);
+            if (vkCreatePipelineCache(m_app.device, &create_info, nullptr, &m_pipeline_cache)
+                != VK_SUCCESS) {
+                LOG_WARNING("Driver rejected pipeline cache %s", m_pipeline_cache_path);
+                return;
+            }
+
+            m_pipeline_cache_loaded    = true;
+            m_cold_pipeline_compiles   = header.cold_compiles;
+            m_cold_pipeline_compile_ns = header.cold_compile_ns;
+            LOG_INFO("Loaded %llu byte pipeline cache from %s",
+                     (unsigned long long) header.data_size, m_pipeline_cache_path);
+        });
+    }
+
+    if (!m_pipeline_cache_loaded) {
+        create_info.initialDataSize = 0;
+        create_info.pInitialData    = nullptr;
+        VK_CHECK(vkCreatePipelineCache(m_app.device, &create_info, nullptr, &m_pipeline_cache));
+    }
+}
+
+void ResourceManager::save_pipeline_cache() {
+    uint64_t compiles = m_pipeline_stats.misses + m_pipeline_stats.uncached;
+    if (m_pipeline_cache_loaded && m_cold_pipeline_compiles > 0 && compiles > 0) {
+        // Compare per pipeline, since a run doesn't necessarily build the same set
+        LOG_INFO("Compiled %llu pipelines in %.2f ms with the pipeline cache file, "
+                 "saving %.2f ms over a cold cache",
+                 (unsigned long long) compiles, m_pipeline_stats.compile_ns / 1e6,
+                 ((double) m_cold_pipeline_compile_ns / m_cold_pipeline_compiles * compiles
+                  - m_pipeline_stats.compile_ns)
+                     / 1e6);
+    } else {
+        LOG_INFO("Compiled %llu pipelines in %.2f ms", (unsigned long long) compiles,
+                 m_pipeline_stats.compile_ns / 1e6);
+    }
+
+    if (!m_pipeline_cache_path) {
+        return;
+    }
+
+    size_t data_size = 0;
+    VK_CHECK(vkGetPipelineCacheData(m_app.device, m_pipeline_cache, &data_size, nullptr));
+    if (data_size > PIPELINE_CACHE_MAX_SIZE) {
+        LOG_WARNING("Pipeline cache is %zu bytes, over the %zu byte limit. Not saving it",
+                    data_size, PIPELINE_CACHE_MAX_SIZE);
+        return;
+    }
+
+    uint8_t* file = m_allocator.allocate< uint8_t >(sizeof(PipelineCacheFileHeader) + data_size);
+    uint8_t* data = file + sizeof(PipelineCacheFileHeader);
+    VK_CHECK(vkGetPipelineCacheData(m_app.device, m_pipeline_cache, &data_size, data));
+
+    const VkPhysicalDeviceProperties& props
+        = m_app.available_gpus[m_app.gpu_index].vk_physical_device_props;
+
+    PipelineCacheFileHeader header = {};
+    header.magic          = PIPELINE_CACHE_FILE_MAGIC;
+    header.version        = PIPELINE_CACHE_FILE_VERSION;
+    header.vendor_id      = props.vendorID;
+    header.device_id      = props.deviceID;
+    header.driver_version = props.driverVersion;
+    memcpy(header.pipeline_cache_uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_size = data_size;
+    header.data_hash = Hash::hash64(data, data_size);
+
+    // Keep the numbers from the cold run for as long as the cache file lives
+    if (m_pipeline_cache_loaded) {
+        header.cold_compiles   = (uint32_t) m_cold_pipeline_compiles;
+        header.cold_compile_ns = m_cold_pipeline_compile_ns;
+    } else {
+        header.cold_compiles   = (uint32_t) compiles;
+        header.cold_compile_ns = m_pipeline_stats.compile_ns;
+    }
+    memcpy(file, &header, sizeof(header));
+
+    if (FileSystem::write_native_file(m_pipeline_cache_path, file,
+                                      sizeof(PipelineCacheFileHeader) + data_size)) {
+        LOG_INFO("Saved %zu byte pipeline cache to %s", data_size, m_pipeline_cache_path);
+    }
+
+    m_allocator.free(file);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Deferred destruction /////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Released objects are queued with the frame they were released in, which is
+// the last frame that can have recorded them. They're destroyed once that
+// frame's draw_complete_fence has been waited on by App::begin_frame.
+
+void ResourceManager::defer_destroy(VkObjectType type, uint64_t handle) {
+    if (handle == 0) {
+        return;
+    }
+    m_deletion_queue.push_back({ type, handle, m_app.frame_number });
+}
+
+void ResourceManager::destroy_object(VkObjectType type, uint64_t handle) {
+    switch (type) {
+        case VK_OBJECT_TYPE_PIPELINE:
+            vkDestroyPipeline(m_app.device, (VkPipeline) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_PIPELINE_LAYOUT:
+            vkDestroyPipelineLayout(m_app.device, (VkPipelineLayout) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT:
+            vkDestroyDescriptorSetLayout(m_app.device, (VkDescriptorSetLayout) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_SHADER_MODULE:
+            vkDestroyShaderModule(m_app.device, (VkShaderModule) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_RENDER_PASS:
+            vkDestroyRenderPass(m_app.device, (VkRenderPass) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_FRAMEBUFFER:
+            vkDestroyFramebuffer(m_app.device, (VkFramebuffer) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_DESCRIPTOR_POOL:
+            vkDestroyDescriptorPool(m_app.device, (VkDescriptorPool) handle, nullptr);
+            break;
+        case VK_OBJECT_TYPE_DESCRIPTOR_UPDATE_TEMPLATE:
+            vkDestroyDescriptorUpdateTemplate(m_app.device, (VkDescriptorUpdateTemplate) handle,
+                                              nullptr);
+            break;
+        default: RUNTIME_ERROR("Can't destroy Vulkan object type %d", (int) type);
+    }
+}
+
+void ResourceManager::destroy_expired_objects(uint64_t last_finished_frame) {
+    // Queued in frame order, so the expired objects are a prefix
+    size_t num_expired = 0;
+    while (num_expired < m_deletion_queue.size()
+           && m_deletion_queue[num_expired].frame <= last_finished_frame) {
+        const DeferredDestroy& object = m_deletion_queue[num_expired++];
+        destroy_object(object.type, object.handle);
+    }
+    m_deletion_queue.erase(m_deletion_queue.begin(), m_deletion_queue.begin() + num_expired);
 }
 
-ResourceManager::ResourceManager(Vulkan::App& app, Memory::IAllocator& allocator)
+void ResourceManager::begin_frame() {
+    if (m_app.frame_number >= m_app.max_rendering_frames) {
+        destroy_expired_objects(m_app.frame_number - m_app.max_rendering_frames);
+    }
+
+    // App::begin_frame has waited for the slot's last frame
+    m_descriptor_allocator.begin_frame(m_app.current_frame);
+}
+
+ResourceManager::ResourceManager(Vulkan::App& app, Memory::IAllocator& allocator,
+                                 const char* pipeline_cache_path)
     : m_app(app)
     , m_allocator(allocator)
-    , m_string_allocator(KB(10), allocator) {
-    VkPipelineCacheCreateInfo pipeline_cache_create_info = {};
-    pipeline_cache_create_info.sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    pipeline_cache_create_info.initialDataSize = 0;
-    VK_CHECK(vkCreatePipelineCache(m_app.device, &pipeline_cache_create_info, nullptr,
-                                   &this->m_pipeline_cache));
+    , m_resource(allocator)
+    , m_cache_allocator(KB(64), allocator)
+    , m_cache_resource(m_cache_allocator)
+    , m_reflection_scratch(MB(16))
+    , m_descriptor_set_layout_cache(m_cache_allocator)
+    , m_descriptor_set_layouts(m_cache_allocator)
+    , m_descriptor_set_cache(m_cache_allocator)
+    , m_pipeline_layout_cache(m_cache_allocator)
+    , m_pipeline_layouts(m_cache_allocator)
+    , m_pipeline_state_cache(m_cache_allocator)
+    , m_pipeline_cache_path(pipeline_cache_path)
+    , m_async_pipeline_cache(m_cache_allocator)
+    , m_name_to_shader_module(m_cache_allocator)
+    , m_code_to_shader_module(m_cache_allocator)
+    , m_vk_to_shader_module(m_cache_allocator)
+    , m_derived_layouts(&m_cache_resource)
+    , m_shader_modules(MB(64))
+    , m_async_pipelines(MB(64))
+    , m_pipelines(&m_cache_resource)
+    , m_descriptor_allocator(app.device, app.max_rendering_frames)
+    , m_deletion_queue(&m_resource) {
+    m_cache_allocator.set_name("ResourceManager caches");
+    m_reflection_scratch.set_name("ResourceManager reflection scratch");
+
+    create_pipeline_cache();
+
+    // Leave a core for the main thread
+    size_t num_threads = std::clamp< size_t >(std::thread::hardware_concurrency(), 2, 5) - 1;
+    m_pipeline_compiler.reset(new PipelineCompiler(m_app.device, m_pipeline_cache, num_threads));
 }
 
 ResourceManager::~ResourceManager() {
     clear();
+
+    // Nothing is left to wait for frames with, so everything queued goes now
+    m_app.wait_for_device();
+    destroy_expired_objects(std::numeric_limits< uint64_t >::max());
+
+    save_pipeline_cache();
+    m_pipeline_compiler.reset();
     vkDestroyPipelineCache(m_app.device, m_pipeline_cache, nullptr);
-    m_string_allocator.release();
+    m_cache_allocator.release();
 }
 
 void ResourceManager::clear() {
-    for (const auto& shader_module : m_shader_modules) {
-        vkDestroyShaderModule(m_app.device, shader_module.second, nullptr);
+    // Pipelines still compiling are collected so they're destroyed with the rest
+    wait_for_pipelines();
+
+    // Frames in flight may still use any of these, so they're queued rather
+    // than destroyed and the device never has to idle
+    m_shader_modules.for_each([&](const ShaderModule&, ShaderModuleEntry& entry) {
+        destroy_deferred(entry.module);
+        m_allocator.free((void*) entry.code.pCode);
+    });
+
+    for (const auto& descriptor_set_layout : m_descriptor_set_layouts) {
+        destroy_deferred(descriptor_set_layout.first);
+        destroy_deferred(descriptor_set_layout.second.update_template);
     }
 
-    for (const auto& descriptor_set_layout : m_descriptor_set_layout_cache) {
-        vkDestroyDescriptorSetLayout(m_app.device, descriptor_set_layout.second, nullptr);
-    }
+    // Cached sets go with their pools
+    m_descriptor_allocator.retire_persistent_pools(
+        [&](VkDescriptorPool descriptor_pool) { destroy_deferred(descriptor_pool); });
 
-    for (const auto& pipeline_layout : m_pipeline_layout_cache) {
-        vkDestroyPipelineLayout(m_app.device, pipeline_layout.second, nullptr);
+    for (const auto& pipeline_layout : m_pipeline_layouts) {
+        destroy_deferred(pipeline_layout.first);
+        destroy_deferred(pipeline_layout.second.push_template);
     }
 
+    // Cached pipelines are in m_pipelines too
     for (const auto& pipeline : m_pipelines) {
-        vkDestroyPipeline(m_app.device, pipeline, nullptr);
+        destroy_deferred(pipeline);
     }
 
-    m_string_allocator.clear();
+    m_async_pipelines.for_each([&](const AsyncPipeline&, AsyncPipelineEntry& entry) {
+        if (entry.owns_pipeline) {
+            destroy_deferred(entry.pipeline);
+        }
+        m_allocator.free((void*) entry.key.words);
+    });
+
+    LOG_DEBUG("Pipeline cache: %llu hits, %llu misses, %llu uncached",
+              (unsigned long long) m_pipeline_stats.hits,
+              (unsigned long long) m_pipeline_stats.misses,
+              (unsigned long long) m_pipeline_stats.uncached);
+
+    // Swap in empty containers so nothing refers to the cache allocator's
+    // storage any more, then release all of it at once
+    m_descriptor_set_layout_cache = decltype(m_descriptor_set_layout_cache)(m_cache_allocator);
+    m_descriptor_set_layouts      = decltype(m_descriptor_set_layouts)(m_cache_allocator);
+    m_descriptor_set_cache        = decltype(m_descriptor_set_cache)(m_cache_allocator);
+    m_pipeline_layout_cache       = decltype(m_pipeline_layout_cache)(m_cache_allocator);
+    m_pipeline_layouts            = decltype(m_pipeline_layouts)(m_cache_allocator);
+    m_pipeline_state_cache        = decltype(m_pipeline_state_cache)(m_cache_allocator);
+    m_async_pipeline_cache        = decltype(m_async_pipeline_cache)(m_cache_allocator);
+    m_name_to_shader_module       = decltype(m_name_to_shader_module)(m_cache_allocator);
+    m_code_to_shader_module       = decltype(m_code_to_shader_module)(m_cache_allocator);
+    m_vk_to_shader_module         = decltype(m_vk_to_shader_module)(m_cache_allocator);
+    m_derived_layouts             = decltype(m_derived_layouts)(&m_cache_resource);
+    m_pipelines                   = decltype(m_pipelines)(&m_cache_resource);
+    m_shader_modules.clear();
+    m_async_pipelines.clear();
+
+    m_cache_allocator.clear();
 }
 
-ShaderModule ResourceManager::request_shader_module(const char* name, const Memory::Buffer& spirv_source,
-                                            const ShaderModuleCreateInfo& create_info) {
+static VkShaderModuleCreateInfo get_shader_module_create_info(const Memory::Buffer& spirv_source) {
     VkShaderModuleCreateInfo vk_create_info = {};
     vk_create_info.sType                    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     vk_create_info.codeSize                 = spirv_source.size;
     vk_create_info.pCode                    = (uint32_t*) spirv_source.data;
+    return vk_create_info;
+}
+
+ShaderModule ResourceManager::find_shader_module(const VkShaderModuleCreateInfo& create_info) {
+    auto module_it = m_code_to_shader_module.find(create_info);
+    if (module_it != m_code_to_shader_module.end()) {
+        return module_it->second;
+    }
+    return ShaderModule::create_invalid();
+}
+
+ShaderModule ResourceManager::request_shader_module(const char* name, const Memory::Buffer& spirv_source,
+                                            const ShaderModuleCreateInfo& create_info) {
+    VkShaderModuleCreateInfo vk_create_info = get_shader_module_create_info(spirv_source);
+
+    // Identical SPIR-V under another name shares the module
+    ShaderModule id = find_shader_module(vk_create_info);
+    if (id.is_valid()) {
+        m_name_to_shader_module[Strings::intern(name)] = id;
+        return id;
+    }
 
     VkShaderModule vk_module;
     VK_CHECK(vkCreateShaderModule(m_app.device, &vk_create_info, nullptr, &vk_module));
 
-    m_shader_modules.push_back(
-        std::pair< ShaderModuleCreateInfo, VkShaderModule >(create_info, vk_module));
+    // The source buffer is usually temporary, so the key gets its own copy
+    ASSERT_MSG((spirv_source.size & 3) == 0, "SPIR-V for %s is not a whole number of words", name);
+    uint32_t* code = m_allocator.allocate< uint32_t >(spirv_source.size / sizeof(uint32_t));
+    memcpy(code, spirv_source.data, spirv_source.size);
+    vk_create_info.pCode = code;
 
-    ShaderModule id = { m_shader_modules.size() - 1 };
+    id = m_shader_modules.create(ShaderModuleEntry{ create_info, vk_module, ++m_last_shader_module_serial,
+                                                    vk_create_info,
+                                                    std::pmr::vector< AsyncPipeline >(&m_cache_resource) });
 
-    m_name_to_shader_module[name] = id;
+    m_code_to_shader_module[vk_create_info]        = id;
+    m_vk_to_shader_module[vk_module]               = id;
+    m_name_to_shader_module[Strings::intern(name)] = id;
     return id;
 }
 
 ShaderModule ResourceManager::request_shader_module(const ShaderSource& shader_source) {
+    MEMORY_TAG("shader_reflection");
+
+    // Skip reflection too when the SPIR-V is already loaded
+    ShaderModule id = find_shader_module(get_shader_module_create_info(shader_source.spirv_source));
+    if (id.is_valid()) {
+        m_name_to_shader_module[Strings::intern(shader_source.name)] = id;
+        return id;
+    }
+
     ShaderModuleCreateInfo new_shader_module;
-    deserialize_reflection_data(shader_source.reflection_json, new_shader_module);
+    if (shader_source.reflection.size > 0) {
+        deserialize_reflection_data(shader_source.reflection, new_shader_module);
+    } else {
+        Memory::ScratchScope scratch(m_reflection_scratch);
+        reflect_spirv(shader_source.spirv_source, scratch, new_shader_module);
+    }
 
     return request_shader_module(shader_source.name, shader_source.spirv_source, new_shader_module);
 }
 
 VkPipeline ResourceManager::request_pipeline(const VkGraphicsPipelineCreateInfo& create_info) {
+    PipelineStateWriter writer;
+    auto module_serial = [this](VkShaderModule module, uint64_t& serial) {
+        return get_shader_module_serial(module, serial);
+    };
+    if (!write_pipeline_state(create_info, writer, module_serial)) {
+        m_pipeline_stats.uncached++;
+        VkPipeline pipeline = create_pipeline(create_info);
+        m_pipelines.push_back(pipeline);
+        return pipeline;
+    }
+
+    GraphicsPipelineKey key;
+    key.hash      = Hash::hash64(writer.words, writer.num_words * sizeof(uint32_t));
+    key.num_words = writer.num_words;
+    key.words     = writer.words;
+
+    auto it = m_pipeline_state_cache.find(key);
+    if (it != m_pipeline_state_cache.end()) {
+        m_pipeline_stats.hits++;
+        return it->second;
+    }
+
+    // Already requested asynchronously. Waiting is cheaper than compiling it
+    // twice. The caller can't release what it gets back, so it pins the entry
+    auto async_it = m_async_pipeline_cache.find(key);
+    if (async_it != m_async_pipeline_cache.end()) {
+        m_pipeline_stats.hits++;
+        AsyncPipelineEntry& entry = *m_async_pipelines.get(async_it->second);
+        if (entry.pending) {
+            m_pipeline_compiler->wait(&entry.request);
+            collect_pipeline(entry);
+        }
+        entry.ref_count++;
+        return entry.pipeline;
+    }
+
+    m_pipeline_stats.misses++;
+    VkPipeline pipeline = create_pipeline(create_info);
+    m_pipelines.push_back(pipeline);
+
+    // The writer is on the stack, the cached key needs its own copy
+    uint32_t* words = m_cache_allocator.allocate< uint32_t >(key.num_words);
+    memcpy(words, writer.words, key.num_words * sizeof(uint32_t));
+    key.words = words;
+
+    m_pipeline_state_cache.emplace(key, pipeline);
+    return pipeline;
+}
+
+VkPipeline ResourceManager::create_pipeline(const VkGraphicsPipelineCreateInfo& create_info) {
+    auto start = std::chrono::steady_clock::now();
+
     VkPipeline pipeline;
     VK_CHECK(vkCreateGraphicsPipelines(m_app.device, this->m_pipeline_cache, 1, &create_info, nullptr,
                                        &pipeline));
-    m_pipelines.push_back(pipeline);
+
+    m_pipeline_stats.compile_ns += std::chrono::duration_cast< std::chrono::nanoseconds >(
+                                       std::chrono::steady_clock::now() - start)
+                                       .count();
     return pipeline;
 }
 
+AsyncPipeline ResourceManager::request_pipeline_async(const VkGraphicsPipelineCreateInfo& create_info,
+                                                      VkPipeline fallback) {
+    PipelineStateWriter writer;
+    auto module_serial = [this](VkShaderModule module, uint64_t& serial) {
+        return get_shader_module_serial(module, serial);
+    };
+    if (!write_pipeline_state(create_info, writer, module_serial)) {
+        // Without a key there's nothing to copy the create info by, so
+        // uncacheable pipelines are built here and now
+        m_pipeline_stats.uncached++;
+        return create_ready_pipeline(create_pipeline(create_info), true);
+    }
+
+    GraphicsPipelineKey key;
+    key.hash      = Hash::hash64(writer.words, writer.num_words * sizeof(uint32_t));
+    key.num_words = writer.num_words;
+    key.words     = writer.words;
+
+    auto async_it = m_async_pipeline_cache.find(key);
+    if (async_it != m_async_pipeline_cache.end()) {
+        m_pipeline_stats.hits++;
+        m_async_pipelines.get(async_it->second)->ref_count++;
+        return async_it->second;
+    }
+
+    // The writer is on the stack. Async entries own their key's words, so
+    // they can be freed on release or rebuild
+    key.words = copy_pipeline_key_words(writer.words, writer.num_words);
+
+    // Built synchronously before. The pipeline stays request_pipeline's to
+    // destroy
+    auto it = m_pipeline_state_cache.find(key);
+    if (it != m_pipeline_state_cache.end()) {
+        m_pipeline_stats.hits++;
+        AsyncPipeline id = create_ready_pipeline(it->second, false);
+        m_async_pipelines.get(id)->key = key;
+        m_async_pipeline_cache.emplace(key, id);
+        return id;
+    }
+
+    m_pipeline_stats.misses++;
+
+    AsyncPipeline id          = m_async_pipelines.create();
+    AsyncPipelineEntry* entry = m_async_pipelines.get(id);
+    entry->key                = key;
+    entry->fallback           = fallback;
+
+    if (copy_graphics_pipeline_create_info(create_info, m_cache_allocator, entry->create_info)) {
+        track_pipeline_dependencies(id, *entry);
+        submit_pipeline(*entry);
+    } else {
+        // Extension structs the key ignores can't be copied either
+        entry->pipeline = create_pipeline(create_info);
+    }
+
+    m_async_pipeline_cache.emplace(key, id);
+    return id;
+}
+
+void ResourceManager::submit_pipeline(AsyncPipelineEntry& entry) {
+    entry.request.create_info = entry.create_info;
+    entry.pending             = true;
+    m_num_pending_pipelines++;
+    m_pipeline_compiler->submit(&entry.request);
+}
+
+AsyncPipeline ResourceManager::create_ready_pipeline(VkPipeline pipeline, bool owns_pipeline) {
+    AsyncPipeline id          = m_async_pipelines.create();
+    AsyncPipelineEntry* entry = m_async_pipelines.get(id);
+    entry->pipeline           = pipeline;
+    entry->owns_pipeline      = owns_pipeline;
+    return id;
+}
+
+const uint32_t* ResourceManager::copy_pipeline_key_words(const uint32_t* words, uint32_t num_words) {
+    uint32_t* copy = m_allocator.allocate< uint32_t >(num_words);
+    memcpy(copy, words, num_words * sizeof(uint32_t));
+    return copy;
+}
+
+void ResourceManager::collect_pipeline(AsyncPipelineEntry& entry) {
+    ASSERT(entry.pending && m_pipeline_compiler->is_done(&entry.request));
+    VK_CHECK(entry.request.result);
+
+    // Rebuilt pipelines replace the one built from the old shaders
+    if (entry.pipeline != VK_NULL_HANDLE && entry.owns_pipeline) {
+        destroy_deferred(entry.pipeline);
+    }
+
+    entry.pending  = false;
+    entry.pipeline = entry.request.pipeline;
+    m_pipeline_stats.compile_ns += entry.request.compile_ns;
+
+    // Once nothing is in flight, what the workers learned is folded into the
+    // cache that gets saved
+    if (--m_num_pending_pipelines == 0) {
+        m_pipeline_compiler->merge_caches(m_pipeline_cache);
+    }
+}
+
+bool ResourceManager::is_pipeline_ready(const AsyncPipeline& pipeline) {
+    AsyncPipelineEntry* entry = m_async_pipelines.get(pipeline);
+    if (!entry) {
+        RUNTIME_ERROR("Invalid or stale pipeline handle %u:%u", pipeline.index, pipeline.generation);
+    }
+    if (entry->pending && m_pipeline_compiler->is_done(&entry->request)) {
+        collect_pipeline(*entry);
+    }
+    return !entry->pending;
+}
+
+VkPipeline ResourceManager::get_pipeline(const AsyncPipeline& pipeline) {
+    is_pipeline_ready(pipeline);
+
+    // Pending with a pipeline when it's being rebuilt
+    AsyncPipelineEntry* entry = m_async_pipelines.get(pipeline);
+    return entry->pipeline != VK_NULL_HANDLE ? entry->pipeline : entry->fallback;
+}
+
+void ResourceManager::release_pipeline(const AsyncPipeline& pipeline) {
+    AsyncPipelineEntry* entry = m_async_pipelines.get(pipeline);
+    if (!entry || --entry->ref_count > 0) {
+        return;
+    }
+
+    if (entry->pending) {
+        m_pipeline_compiler->wait(&entry->request);
+        collect_pipeline(*entry);
+    }
+
+    if (entry->owns_pipeline) {
+        destroy_deferred(entry->pipeline);
+    }
+
+    // A rebuilt pipeline's key may belong to another entry
+    if (entry->key.words) {
+        auto it = m_async_pipeline_cache.find(entry->key);
+        if (it != m_async_pipeline_cache.end() && it->second == pipeline) {
+            m_async_pipeline_cache.erase(it);
+        }
+        m_allocator.free((void*) entry->key.words);
+    }
+    untrack_pipeline_dependencies(pipeline, *entry);
+    m_async_pipelines.release(pipeline);
+}
+
+void ResourceManager::wait_for_pipelines() {
+    if (m_num_pending_pipelines == 0) {
+        return;
+    }
+
+    m_pipeline_compiler->wait_idle();
+
+    m_async_pipelines.for_each([&](const AsyncPipeline&, AsyncPipelineEntry& entry) {
+        if (entry.pending) {
+            collect_pipeline(entry);
+        }
+    });
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Hot reload ///////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Every module keeps the async pipelines built from it, so a reload only
+// touches those. Rebuilds go through the compiler like any other request.
+
+void ResourceManager::track_pipeline_dependencies(const AsyncPipeline& id, AsyncPipelineEntry& entry) {
+    const VkGraphicsPipelineCreateInfo& create_info = entry.create_info;
+    if (create_info.stageCount > VULKAN_MAX_SHADER_STAGES) {
+        return;
+    }
+
+    // Stages with modules from elsewhere can't be reloaded
+    for (uint32_t i = 0; i < create_info.stageCount; i++) {
+        auto it = m_vk_to_shader_module.find(create_info.pStages[i].module);
+        if (it == m_vk_to_shader_module.end()) {
+            return;
+        }
+        entry.stage_modules[i] = it->second;
+    }
+    entry.num_stage_modules = create_info.stageCount;
+
+    for (uint32_t i = 0; i < entry.num_stage_modules; i++) {
+        std::pmr::vector< AsyncPipeline >& dependents
+            = m_shader_modules.get(entry.stage_modules[i])->dependents;
+        if (dependents.empty() || dependents.back() != id) {
+            dependents.push_back(id);
+        }
+    }
+
+    // Stages can be in any order, so the modules are compared as sets
+    const ShaderModule* stages_begin = entry.stage_modules;
+    const ShaderModule* stages_end   = entry.stage_modules + entry.num_stage_modules;
+    for (const DerivedLayout& derived : m_derived_layouts) {
+        if (derived.layout == create_info.layout && derived.num_shader_modules == entry.num_stage_modules
+            && std::is_permutation(stages_begin, stages_end, derived.shader_modules)) {
+            entry.derived_layout = true;
+            break;
+        }
+    }
+}
+
+void ResourceManager::untrack_pipeline_dependencies(const AsyncPipeline& id, AsyncPipelineEntry& entry) {
+    for (uint32_t i = 0; i < entry.num_stage_modules; i++) {
+        ShaderModuleEntry* module = m_shader_modules.get(entry.stage_modules[i]);
+        if (module) {
+            std::pmr::vector< AsyncPipeline >& dependents = module->dependents;
+            dependents.erase(std::remove(dependents.begin(), dependents.end(), id), dependents.end());
+        }
+    }
+}
+
+// Replaces the module's Vulkan object, reflection and code key. Returns false
+// if the SPIR-V hasn't changed, which is common since saving a file often
+// raises more than one event
+bool ResourceManager::reload_shader_module(const ShaderModule& id, const Memory::Buffer& spirv_source) {
+    ShaderModuleEntry& entry                = *m_shader_modules.get(id);
+    VkShaderModuleCreateInfo vk_create_info = get_shader_module_create_info(spirv_source);
+    if (Equals< VkShaderModuleCreateInfo >()(vk_create_info, entry.code)) {
+        return false;
+    }
+    if (!is_spirv(spirv_source)) {
+        LOG_WARNING("Not SPIR-V, keeping the previous module");
+        return false;
+    }
+
+    ShaderModuleCreateInfo info;
+    {
+        Memory::ScratchScope scratch(m_reflection_scratch);
+        reflect_spirv(spirv_source, scratch, info);
+    }
+
+    VkShaderModule vk_module;
+    VK_CHECK(vkCreateShaderModule(m_app.device, &vk_create_info, nullptr, &vk_module));
+
+    uint32_t* code = m_allocator.allocate< uint32_t >(spirv_source.size / sizeof(uint32_t));
+    memcpy(code, spirv_source.data, spirv_source.size);
+    vk_create_info.pCode = code;
+
+    // If another module already has the new code, it keeps the key. Either
+    // way nothing refers to the old copy after this
+    auto code_it = m_code_to_shader_module.find(entry.code);
+    if (code_it != m_code_to_shader_module.end() && code_it->second == id) {
+        m_code_to_shader_module.erase(code_it);
+    }
+    m_allocator.free((void*) entry.code.pCode);
+    m_code_to_shader_module.emplace(vk_create_info, id);
+
+    m_vk_to_shader_module.erase(entry.module);
+    m_vk_to_shader_module[vk_module] = id;
+
+    // Pipelines built from the old module don't need it any more
+    destroy_deferred(entry.module);
+
+    entry.info   = info;
+    entry.module = vk_module;
+    entry.serial = ++m_last_shader_module_serial;
+    entry.code   = vk_create_info;
+    return true;
+}
+
+void ResourceManager::rebuild_pipeline(const AsyncPipeline& id, AsyncPipelineEntry& entry) {
+    VkPipelineShaderStageCreateInfo* stages = (VkPipelineShaderStageCreateInfo*) entry.create_info.pStages;
+    for (uint32_t i = 0; i < entry.num_stage_modules; i++) {
+        if (!m_shader_modules.contains(entry.stage_modules[i])) {
+            LOG_WARNING("Pipeline %u:%u uses a released shader module, not rebuilding", id.index,
+                        id.generation);
+            return;
+        }
+    }
+
+    // The stages point into the entry's own copy, so they're patched in place
+    for (uint32_t i = 0; i < entry.num_stage_modules; i++) {
+        const ShaderModuleEntry& module = *m_shader_modules.get(entry.stage_modules[i]);
+        stages[i].module = module.module;
+        stages[i].pName  = module.info.entry_point;
+    }
+    if (entry.derived_layout) {
+        entry.create_info.layout = request_pipeline_layout(entry.stage_modules, entry.num_stage_modules);
+    }
+
+    // New modules make a new key. It keeps going to this entry even if
+    // another one has the same state now
+    PipelineStateWriter writer;
+    auto module_serial = [this](VkShaderModule module, uint64_t& serial) {
+        return get_shader_module_serial(module, serial);
+    };
+    if (!write_pipeline_state(entry.create_info, writer, module_serial)) {
+        RUNTIME_ERROR("Rebuilt pipeline %u:%u can no longer be keyed", id.index, id.generation);
+    }
+
+    auto key_it = m_async_pipeline_cache.find(entry.key);
+    if (key_it != m_async_pipeline_cache.end() && key_it->second == id) {
+        m_async_pipeline_cache.erase(key_it);
+    }
+    m_allocator.free((void*) entry.key.words);
+
+    entry.key.hash      = Hash::hash64(writer.words, writer.num_words * sizeof(uint32_t));
+    entry.key.num_words = writer.num_words;
+    entry.key.words     = copy_pipeline_key_words(writer.words, writer.num_words);
+    m_async_pipeline_cache.emplace(entry.key, id);
+
+    submit_pipeline(entry);
+}
+
+bool ResourceManager::is_shader_module_aliased(const ShaderModule& id, Strings::StringId name) {
+    for (const auto& alias : m_name_to_shader_module) {
+        if (alias.second == id && alias.first != name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ResourceManager::reload_shader_modules(const char* const* paths, size_t num_paths) {
+    MEMORY_TAG("shader_reload");
+    auto start = std::chrono::steady_clock::now();
+
+    // Requests in flight are compiling from the copies rebuilds patch
+    wait_for_pipelines();
+
+    std::vector< ShaderModule > reloaded;
+    for (size_t i = 0; i < num_paths; i++) {
+        ShaderModule id = find_shader_module(paths[i]);
+        if (!id.is_valid() || !FileSystem::exists(paths[i])) {
+            continue;
+        }
+        if (is_shader_module_aliased(id, Strings::hash(paths[i]))) {
+            LOG_WARNING("%s had the same SPIR-V as another shader and shares its module, not "
+                        "reloading it. Pipelines don't record which name they used",
+                        paths[i]);
+            continue;
+        }
+        FileSystem::load_temp_file(paths[i], [&](const Memory::Buffer& spirv_source) {
+            if (reload_shader_module(id, spirv_source)) {
+                reloaded.push_back(id);
+            }
+        });
+    }
+
+    // Pipelines using several of the modules are rebuilt once
+    std::vector< AsyncPipeline > pipelines;
+    for (const ShaderModule& id : reloaded) {
+        for (const AsyncPipeline& pipeline : m_shader_modules.get(id)->dependents) {
+            if (std::find(pipelines.begin(), pipelines.end(), pipeline) == pipelines.end()) {
+                pipelines.push_back(pipeline);
+            }
+        }
+    }
+    for (const AsyncPipeline& pipeline : pipelines) {
+        rebuild_pipeline(pipeline, *m_async_pipelines.get(pipeline));
+    }
+
+    uint64_t reload_ns = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    m_pipeline_stats.reloads++;
+    m_pipeline_stats.reload_ns += reload_ns;
+
+    LOG_INFO("Reloaded %zu shader modules and submitted %zu pipelines in %.2f ms", reloaded.size(),
+             pipelines.size(), reload_ns / 1e6);
+}
+
+const PipelineStats& ResourceManager::pipeline_stats() const {
+    return m_pipeline_stats;
+}
+
+VkDescriptorSetLayout
+ResourceManager::request_descriptor_set_layout(const DescriptorSetLayoutCreateInfo& create_info,
+                                               bool push_descriptor) {
+    VkDescriptorSetLayoutCreateFlags flags
+        = push_descriptor ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
+    return request_descriptor_set_layout(DescriptorSetLayoutKey(create_info, flags));
+}
+
+bool ResourceManager::can_push_descriptors(const DescriptorSetLayoutKey& key) {
+    if (m_app.cmd_push_descriptor_set_with_template == nullptr
+        || key.count_descriptors() > m_app.max_push_descriptors) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < key.num_bindings; i++) {
+        VkDescriptorType type = (VkDescriptorType) key.bindings[i].descriptor_type;
+        if (type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+            || type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC) {
+            return false;
+        }
+    }
+    return true;
+}
+
 VkDescriptorSetLayout
-ResourceManager::request_descriptor_set_layout(const DescriptorSetLayoutCreateInfo& create_info) {
-    auto it = m_descriptor_set_layout_cache.find(create_info);
+ResourceManager::request_descriptor_set_layout(const DescriptorSetLayoutKey& key) {
+    auto it = m_descriptor_set_layout_cache.find(key);
     if (it != m_descriptor_set_layout_cache.end()) {
         return it->second;
     }
 
+    // Layouts the device can't push fall back to pooled sets. The push key
+    // is cached too, so it's only checked once
+    if (key.is_push_descriptor() && !can_push_descriptors(key)) {
+        DescriptorSetLayoutKey pooled_key = key;
+        pooled_key.flags &= ~VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+        pooled_key.rehash();
+
+        VkDescriptorSetLayout set_layout   = request_descriptor_set_layout(pooled_key);
+        m_descriptor_set_layout_cache[key] = set_layout;
+        return set_layout;
+    }
+
     VkDescriptorSetLayoutBinding bindings[VULKAN_MAX_DESCRIPTOR_BINDINGS];
 
     VkDescriptorSetLayoutCreateInfo vk_create_info = {};
     vk_create_info.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    vk_create_info.flags        = key.flags;
     vk_create_info.pBindings    = bindings;
-    vk_create_info.bindingCount = 0;
+    vk_create_info.bindingCount = key.num_bindings;
 
-    for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
-        if (create_info.bindings[i].stage_flags == 0) {
-            continue;
-        }
+    // Packed bindings are in binding order, so walking the mask pairs them up
+    uint32_t mask = key.binding_mask;
+    for (uint32_t i = 0; i < key.num_bindings; i++) {
+        const DescriptorSetLayoutKey::PackedBinding& packed = key.bindings[i];
 
-        bindings[vk_create_info.bindingCount].binding = 0;
-        bindings[vk_create_info.bindingCount].descriptorCount
-            = create_info.bindings[i].descriptor_count;
-        bindings[vk_create_info.bindingCount].descriptorType
-            = create_info.bindings[i].descriptor_type;
+        bindings[i].binding            = (uint32_t) Utils::bit_scan_forward(mask);
+        bindings[i].descriptorType     = (VkDescriptorType) packed.descriptor_type;
+        bindings[i].descriptorCount    = packed.descriptor_count;
+        bindings[i].stageFlags         = packed.stage_flags;
+        bindings[i].pImmutableSamplers = nullptr;
 
-        vk_create_info.bindingCount++;
+        mask &= mask - 1;
     }
 
     VkDescriptorSetLayout set_layout;
     VK_CHECK(vkCreateDescriptorSetLayout(m_app.device, &vk_create_info, nullptr, &set_layout));
 
-    m_descriptor_set_layout_cache[create_info] = set_layout;
+    // Sets with the layout are written through its template, so it's made
+    // once up front rather than on the first write. Push templates depend on
+    // the pipeline layout, so they're made with those instead
+    DescriptorSetLayoutEntry entry;
+    entry.key             = key;
+    entry.update_template = VK_NULL_HANDLE;
+    if (!key.is_push_descriptor()) {
+        entry.update_template = create_descriptor_update_template(m_app.device, set_layout, key);
+    }
+
+    m_descriptor_set_layout_cache[key]   = set_layout;
+    m_descriptor_set_layouts[set_layout] = entry;
     return set_layout;
 }
 
+const ResourceManager::DescriptorSetLayoutEntry&
+ResourceManager::get_descriptor_set_layout(VkDescriptorSetLayout layout) {
+    auto it = m_descriptor_set_layouts.find(layout);
+    if (it == m_descriptor_set_layouts.end()) {
+        RUNTIME_ERROR("Descriptor set layout wasn't requested from the resource manager");
+    }
+    return it->second;
+}
+
+void ResourceManager::update_descriptor_set(VkDescriptorSet set, VkDescriptorSetLayout layout,
+                                            const DescriptorInfo* descriptors) {
+    const DescriptorSetLayoutEntry& entry = get_descriptor_set_layout(layout);
+    if (entry.update_template != VK_NULL_HANDLE) {
+        vkUpdateDescriptorSetWithTemplate(m_app.device, set, entry.update_template, descriptors);
+    }
+}
+
+VkDescriptorSet ResourceManager::allocate_descriptor_set(VkDescriptorSetLayout layout,
+                                                         const DescriptorInfo* descriptors) {
+    const DescriptorSetLayoutEntry& entry = get_descriptor_set_layout(layout);
+    if (entry.key.is_push_descriptor()) {
+        RUNTIME_ERROR("Sets can't be allocated with push descriptor layouts, see push_descriptor_set");
+    }
+
+    VkDescriptorSet set = m_descriptor_allocator.allocate(m_app.current_frame, layout, entry.key);
+    if (entry.update_template != VK_NULL_HANDLE) {
+        vkUpdateDescriptorSetWithTemplate(m_app.device, set, entry.update_template, descriptors);
+    }
+    return set;
+}
+
+VkDescriptorSet ResourceManager::request_descriptor_set(VkDescriptorSetLayout layout,
+                                                        const DescriptorInfo* descriptors) {
+    const DescriptorSetLayoutEntry& entry = get_descriptor_set_layout(layout);
+    if (entry.key.is_push_descriptor()) {
+        RUNTIME_ERROR("Sets can't be allocated with push descriptor layouts, see push_descriptor_set");
+    }
+
+    DescriptorSetKey set_key(layout, descriptors, entry.key.count_descriptors());
+    auto it = m_descriptor_set_cache.find(set_key);
+    if (it != m_descriptor_set_cache.end()) {
+        return it->second;
+    }
+
+    VkDescriptorSet set = m_descriptor_allocator.allocate_persistent(layout, entry.key);
+    if (entry.update_template != VK_NULL_HANDLE) {
+        vkUpdateDescriptorSetWithTemplate(m_app.device, set, entry.update_template, descriptors);
+    }
+
+    // The caller's descriptors are usually temporary, the cached key gets its own copy
+    DescriptorInfo* descriptors_copy = m_cache_allocator.allocate< DescriptorInfo >(set_key.num_descriptors);
+    memcpy((void*) descriptors_copy, descriptors, set_key.num_descriptors * sizeof(DescriptorInfo));
+    set_key.descriptors = descriptors_copy;
+
+    m_descriptor_set_cache.emplace(set_key, set);
+    return set;
+}
+
+void ResourceManager::push_descriptor_set(VkCommandBuffer command_buffer, VkPipelineLayout layout,
+                                          uint32_t set, const DescriptorInfo* descriptors) {
+    auto it = m_pipeline_layouts.find(layout);
+    if (it == m_pipeline_layouts.end()) {
+        RUNTIME_ERROR("Pipeline layout wasn't requested from the resource manager");
+    }
+    const PipelineLayoutEntry& entry = it->second;
+
+    if (set >= VULKAN_MAX_DESCRIPTOR_SETS || entry.set_layouts[set] == VK_NULL_HANDLE) {
+        RUNTIME_ERROR("Pipeline layout has no descriptor set %u", set);
+    }
+    if (set == entry.push_set) {
+        if (entry.push_template != VK_NULL_HANDLE) {
+            m_app.cmd_push_descriptor_set_with_template(command_buffer, entry.push_template, layout,
+                                                        set, descriptors);
+        }
+        return;
+    }
+
+    VkDescriptorSet descriptor_set = allocate_descriptor_set(entry.set_layouts[set], descriptors);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, set, 1,
+                            &descriptor_set, 0, nullptr);
+}
+
 VkPipelineLayout ResourceManager::request_pipeline_layout(const PipelineLayoutCreateInfo& create_info) {
-    auto it = m_pipeline_layout_cache.find(create_info);
+    return request_pipeline_layout(PipelineLayoutKey(create_info));
+}
+
+VkPipelineLayout ResourceManager::request_pipeline_layout(const PipelineLayoutKey& key) {
+    auto it = m_pipeline_layout_cache.find(key);
     if (it != m_pipeline_layout_cache.end()) {
         return it->second;
     }
 
-    VkDescriptorSetLayout set_layouts[VULKAN_MAX_DESCRIPTOR_SETS];
-
     VkPipelineLayoutCreateInfo vk_create_info = {};
     vk_create_info.sType                      = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    vk_create_info.pPushConstantRanges        = create_info.push_constant_ranges;
-    vk_create_info.pushConstantRangeCount     = create_info.num_push_constant_ranges;
-    vk_create_info.pSetLayouts                = set_layouts;
-    vk_create_info.setLayoutCount             = 0;
-
-    for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
-        if (create_info.descriptor_set_layouts[i] == VK_NULL_HANDLE) {
-            continue;
+    vk_create_info.pPushConstantRanges        = key.push_constant_ranges;
+    vk_create_info.pushConstantRangeCount     = key.num_push_constant_ranges;
+
+    // Set layouts by set number, to push or bind sets with the layout
+    PipelineLayoutEntry entry = {};
+    entry.push_set            = VULKAN_MAX_DESCRIPTOR_SETS;
+    uint32_t mask             = key.set_layout_mask;
+    for (uint32_t i = 0; i < key.num_set_layouts; i++) {
+        uint32_t set           = (uint32_t) Utils::bit_scan_forward(mask);
+        entry.set_layouts[set] = key.set_layouts[i];
+        mask &= mask - 1;
+
+        // Layouts made elsewhere can't be push descriptor layouts of ours
+        auto set_layout = m_descriptor_set_layouts.find(key.set_layouts[i]);
+        if (set_layout != m_descriptor_set_layouts.end()
+            && set_layout->second.key.is_push_descriptor()) {
+            if (entry.push_set != VULKAN_MAX_DESCRIPTOR_SETS) {
+                RUNTIME_ERROR("Pipeline layouts can have one push descriptor set, not %u and %u",
+                              entry.push_set, set);
+            }
+            entry.push_set = set;
         }
+    }
 
-        set_layouts[vk_create_info.setLayoutCount] = create_info.descriptor_set_layouts[i];
-        vk_create_info.setLayoutCount++;
+    // Vulkan numbers sets by their index in pSetLayouts, so sets up to the
+    // highest one used are passed, with unused ones given an empty layout
+    VkDescriptorSetLayout set_layouts[VULKAN_MAX_DESCRIPTOR_SETS];
+    uint32_t num_set_layouts = 0;
+    if (key.set_layout_mask != 0) {
+        num_set_layouts = (uint32_t) Utils::bit_scan_reverse(key.set_layout_mask) + 1;
+    }
+    for (uint32_t set = 0; set < num_set_layouts; set++) {
+        set_layouts[set] = entry.set_layouts[set];
+        if (set_layouts[set] == VK_NULL_HANDLE) {
+            set_layouts[set] = request_descriptor_set_layout(DescriptorSetLayoutCreateInfo());
+        }
     }
+    vk_create_info.pSetLayouts    = set_layouts;
+    vk_create_info.setLayoutCount = num_set_layouts;
 
     VkPipelineLayout pipeline_layout;
     VK_CHECK(vkCreatePipelineLayout(m_app.device, &vk_create_info, nullptr, &pipeline_layout));
 
-    m_pipeline_layout_cache[create_info] = pipeline_layout;
+    if (entry.push_set != VULKAN_MAX_DESCRIPTOR_SETS) {
+        VkDescriptorSetLayout set_layout = entry.set_layouts[entry.push_set];
+        entry.push_template              = create_descriptor_update_template(
+            m_app.device, set_layout, get_descriptor_set_layout(set_layout).key, pipeline_layout,
+            entry.push_set);
+    }
+
+    m_pipeline_layout_cache[key]        = pipeline_layout;
+    m_pipeline_layouts[pipeline_layout] = entry;
     return pipeline_layout;
 }
 
@@ -429,63 +1552,108 @@ const App& ResourceManager::app() {
     return m_app;
 }
 
-VkPipelineLayout create_pipeline_layout(
-    ResourceManager& resource_manager,
-    const std::vector<ShaderModule>& shader_modules
-) {
+VkPipelineLayout ResourceManager::request_pipeline_layout(const ShaderModule* shader_modules,
+                                                          size_t num_shader_modules) {
     PipelineLayoutCreateInfo create_info;
 
     // Attempt to merge shader resource requirements into one cohesive collection of sets and bindings
     DescriptorBinding descriptor_bindings[VULKAN_MAX_DESCRIPTOR_SETS][VULKAN_MAX_DESCRIPTOR_BINDINGS];
-    for (auto& module : shader_modules) {
-        const ShaderResourceCreateInfo& module_resources = resource_manager.get_shader_module_info(module).resource_info;
+    for (size_t i = 0; i < num_shader_modules; i++) {
+        const ShaderResourceCreateInfo& module_resources = get_shader_module_info(shader_modules[i]).resource_info;
 
         for (int set = 0; set < VULKAN_MAX_DESCRIPTOR_SETS; set++) {
-            DescriptorSetLayoutCreateInfo desc_layout_create_info;
             for (int binding = 0; binding < VULKAN_MAX_DESCRIPTOR_BINDINGS; binding++) {
                 const DescriptorBinding& this_binding = module_resources.descriptor_bindings[set][binding];
-                const DescriptorBinding& current_binding = module_resources.descriptor_bindings[set][binding];
+                DescriptorBinding& current_binding = descriptor_bindings[set][binding];
                 // If the binding is empty, skip
                 if (this_binding.stage_flags == 0) {
                     continue;
                 }
                 // If the current binding is not initialized, assign this binding to it
                 else if (current_binding.stage_flags == 0) {
-                    descriptor_bindings[set][binding] = this_binding;
+                    current_binding = this_binding;
                 }
-                // If the current binding is initialized, check if it's equal. If so, continue. If not, error
-                else if (current_binding == this_binding) {
-                    continue;
+                // If the current binding is initialized, check if it's compatible. If so, it's
+                // shared between the stages. If not, error
+                else if (current_binding.descriptor_type == this_binding.descriptor_type
+                         && current_binding.descriptor_count == this_binding.descriptor_count) {
+                    current_binding.stage_flags |= this_binding.stage_flags;
                 } else {
-                    RUNTIME_ERROR("Descriptor binding collision in shader %s, at set %d, binding %");
+                    RUNTIME_ERROR("Descriptor binding collision at set %d, binding %d", set, binding);
                 }
             }
         }
     }
 
+    // Stages share one push constant range covering all of their blocks
+    for (size_t i = 0; i < num_shader_modules; i++) {
+        const VkPushConstantRange& range = get_shader_module_info(shader_modules[i]).resource_info.push_constant_range;
+        if (range.size == 0) {
+            continue;
+        }
+
+        VkPushConstantRange& merged = create_info.push_constant_ranges[0];
+        if (create_info.num_push_constant_ranges == 0) {
+            merged = range;
+            create_info.num_push_constant_ranges = 1;
+        } else {
+            uint32_t end = std::max(merged.offset + merged.size, range.offset + range.size);
+            merged.offset = std::min(merged.offset, range.offset);
+            merged.size = end - merged.offset;
+            merged.stageFlags |= range.stageFlags;
+        }
+    }
+
+    DescriptorSetLayoutCreateInfo desc_set_layout_create_infos[VULKAN_MAX_DESCRIPTOR_SETS];
+    uint32_t set_mask = 0;
     for (int set = 0; set < VULKAN_MAX_DESCRIPTOR_SETS; set++) {
-        DescriptorSetLayoutCreateInfo desc_set_layout_create_info;
-        bool is_empty = true;
         for (int binding = 0; binding < VULKAN_MAX_DESCRIPTOR_BINDINGS; binding++) {
             const DescriptorBinding& this_binding = descriptor_bindings[set][binding];
             if (this_binding.stage_flags == 0) {
                 continue;
             }
-            desc_set_layout_create_info.bindings[binding] = descriptor_bindings[set][binding];
+            desc_set_layout_create_infos[set].bindings[binding] = descriptor_bindings[set][binding];
 
             // If there's a binding in this set, it's not empty
-            is_empty = false;
+            set_mask |= 1u << set;
         }
+    }
 
-        // If the set is empty, skip it
-        if (is_empty) {
-            continue;
-        }
-        VkDescriptorSetLayout desc_set_layout = resource_manager.request_descriptor_set_layout(desc_set_layout_create_info);
-        create_info.descriptor_set_layouts[set] = desc_set_layout;
+    // Sets are numbered from least to most often bound, so the last one is
+    // pushed when the device can push it. The others come from pools
+    for (uint32_t mask = set_mask; mask != 0; mask &= mask - 1) {
+        uint32_t set         = (uint32_t) Utils::bit_scan_forward(mask);
+        bool push_descriptor = (mask & (mask - 1)) == 0;
+        create_info.descriptor_set_layouts[set]
+            = request_descriptor_set_layout(desc_set_layout_create_infos[set], push_descriptor);
+    }
+
+    VkPipelineLayout layout = request_pipeline_layout(create_info);
+
+    // Remembered so pipelines using the layout can follow the modules when
+    // they're reloaded
+    ASSERT(num_shader_modules <= VULKAN_MAX_SHADER_STAGES);
+    auto same_modules = [&](const DerivedLayout& derived) {
+        return derived.layout == layout && derived.num_shader_modules == num_shader_modules
+               && std::equal(shader_modules, shader_modules + num_shader_modules,
+                             derived.shader_modules);
+    };
+    if (num_shader_modules <= VULKAN_MAX_SHADER_STAGES
+        && std::none_of(m_derived_layouts.begin(), m_derived_layouts.end(), same_modules)) {
+        DerivedLayout derived;
+        derived.layout             = layout;
+        derived.num_shader_modules = (uint32_t) num_shader_modules;
+        std::copy(shader_modules, shader_modules + num_shader_modules, derived.shader_modules);
+        m_derived_layouts.push_back(derived);
     }
+    return layout;
+}
 
-    return resource_manager.request_pipeline_layout(create_info);
+VkPipelineLayout create_pipeline_layout(
+    ResourceManager& resource_manager,
+    const std::vector<ShaderModule>& shader_modules
+) {
+    return resource_manager.request_pipeline_layout(shader_modules.data(), shader_modules.size());
 }
 
 }    // namespace Vulkan
\ No newline at end of file
@@ -3,10 +3,13 @@
 #include "vulkan_app.h"
 #include "vulkan_types.h"
 #include "vulkan_utils.h"
+#include "vulkan_pipeline_compiler.h"
+#include "vulkan_descriptor_allocator.h"
+#include "handle.h"
 #include "memory.h"
 
 #include <limits>
-
+#include <memory>
 #include <vector>
 
 #include <parallel_hashmap/phmap.h>
@@ -15,21 +18,15 @@ namespace Vulkan {
 
 // ID types
 
-static const size_t HANDLE_INVALID_INDEX = (size_t) (~0);
 static const size_t INVALID_OFFSET = (size_t) (~0);
 
-template <typename PHANTOM_T>
-struct Handle {
-    size_t index = HANDLE_INVALID_INDEX;
-    inline bool is_valid() const {
-        return index != HANDLE_INVALID_INDEX;
-    }
-    inline static Handle<PHANTOM_T> create_invalid() {
-        return { HANDLE_INVALID_INDEX };
-    }
-};
-
 typedef Handle<struct ShaderModule_T> ShaderModule;
+typedef Handle<struct AsyncPipeline_T> AsyncPipeline;
+
+// Hash map whose storage comes from an IAllocator
+template < typename K, typename V, typename H = phmap::priv::hash_default_hash< K >,
+           typename E = phmap::priv::hash_default_eq< K > >
+using AllocatorMap = phmap::flat_hash_map< K, V, H, E, Memory::Allocator< std::pair< const K, V > > >;
 
 struct BufferLayout {
     struct Attribute {
@@ -49,63 +46,329 @@ struct BufferLayout {
     size_t num_bindings = 0;
 };
 
+// Counts of request_pipeline calls. Pipelines with extension structs in their
+// create info can't be keyed, so they're always created
+struct PipelineStats {
+    uint64_t hits     = 0;
+    uint64_t misses   = 0;
+    uint64_t uncached = 0;
+    // Time spent in vkCreateGraphicsPipelines
+    uint64_t compile_ns = 0;
+    // reload_shader_modules calls, and time spent in them. Rebuilt pipelines
+    // compile afterwards, on the worker threads
+    uint64_t reloads   = 0;
+    uint64_t reload_ns = 0;
+};
+
 class ResourceManager {
   public:
-    ResourceManager(Vulkan::App& app, Memory::IAllocator& allocator);
+    // If pipeline_cache_path is set, the pipeline cache is loaded from it (when
+    // it was saved by the same device and driver) and saved back on destruction
+    ResourceManager(Vulkan::App& app, Memory::IAllocator& allocator,
+                    const char* pipeline_cache_path = nullptr);
     ~ResourceManager();
 
     // Get handles by name
-    ShaderModule find_shader_module(const char* name);
+    ShaderModule find_shader_module(Strings::StringId name);
+    inline ShaderModule find_shader_module(const char* name) {
+        return find_shader_module(Strings::hash(name));
+    }
 
     // Get resource info
     const ShaderModuleCreateInfo& get_shader_module_info(const ShaderModule& module);
     VkShaderModule get_shader_module(const ShaderModule& module);
 
     // Member functions
-    // Initialize shader module info from reflection json
-    void deserialize_reflection_data(const Memory::Buffer& reflection_json,
-                              ShaderModuleCreateInfo& out_reflection_data);
+    // Initialize shader module info from a reflection blob or spirv-cross
+    // reflection JSON. Shader sources without either are reflected from their
+    // SPIR-V instead
+    void deserialize_reflection_data(const Memory::Buffer& reflection,
+                                     ShaderModuleCreateInfo& out_reflection_data);
 
     // Request vulkan resources from cache. These functions will create
     // the resource if an identical one does not yet exist
+    //
+    // Pipelines are deduplicated on their normalized state, see GraphicsPipelineKey.
+    // Only stages with modules from request_shader_module can be cached
     VkPipeline request_pipeline(const VkGraphicsPipelineCreateInfo& create_info);
-    VkDescriptorSetLayout request_descriptor_set_layout(const DescriptorSetLayoutCreateInfo& create_info);
+    // Push descriptor layouts, for sets written into the command buffer with
+    // push_descriptor_set, need VK_KHR_push_descriptor. Where the device
+    // can't push the set a normal layout is returned instead
+    VkDescriptorSetLayout request_descriptor_set_layout(const DescriptorSetLayoutCreateInfo& create_info,
+                                                        bool push_descriptor = false);
     VkPipelineLayout request_pipeline_layout(const PipelineLayoutCreateInfo& create_info);
+    // Keys hash themselves once, so callers requesting the same layout often
+    // can keep the key around and skip rebuilding it
+    VkDescriptorSetLayout request_descriptor_set_layout(const DescriptorSetLayoutKey& key);
+    VkPipelineLayout request_pipeline_layout(const PipelineLayoutKey& key);
+    // Layout merged from the shader modules' reflection. Async pipelines
+    // using it get the new layout when one of the modules is reloaded. The
+    // highest numbered set is taken to change per draw and gets a push
+    // descriptor layout
+    VkPipelineLayout request_pipeline_layout(const ShaderModule* shader_modules,
+                                             size_t num_shader_modules);
     ShaderModule request_shader_module(const ShaderSource& shader_source);
     ShaderModule request_shader_module(const char* name, const Memory::Buffer& spirv_source,
                                       const ShaderModuleCreateInfo& create_info);
 
+    // Descriptor sets, for layouts from request_descriptor_set_layout. The
+    // descriptors are the layout's count_descriptors() DescriptorInfo.
+    //
+    // Sets for the current frame only. They come from the frame slot's pools
+    // and are recycled in bulk when the slot comes around again
+    VkDescriptorSet allocate_descriptor_set(VkDescriptorSetLayout layout,
+                                            const DescriptorInfo* descriptors);
+    // Sets for long lived bindings, eg. materials, cached on what they bind.
+    // Identical requests share one set, allocated and written once, which
+    // lives until clear()
+    VkDescriptorSet request_descriptor_set(VkDescriptorSetLayout layout,
+                                           const DescriptorInfo* descriptors);
+    // Rewrite every descriptor of a set with the layout in one
+    // vkUpdateDescriptorSetWithTemplate call. Not for cached sets, which
+    // other requests may share
+    void update_descriptor_set(VkDescriptorSet set, VkDescriptorSetLayout layout,
+                               const DescriptorInfo* descriptors);
+    // Bind a set of the graphics pipeline layout for the next draws on the
+    // command buffer. Push descriptor sets are pushed through the layout's
+    // template. Other sets are allocated for the current frame, written and
+    // bound, so callers don't need to know which kind the device gave them
+    void push_descriptor_set(VkCommandBuffer command_buffer, VkPipelineLayout layout, uint32_t set,
+                             const DescriptorInfo* descriptors);
+
+    // Compile a pipeline on the worker threads. The handle is ready straight
+    // away when an identical pipeline was already built. Until then
+    // get_pipeline returns the fallback, which may be VK_NULL_HANDLE if the
+    // caller would rather skip the draw
+    AsyncPipeline request_pipeline_async(const VkGraphicsPipelineCreateInfo& create_info,
+                                         VkPipeline fallback = VK_NULL_HANDLE);
+    bool is_pipeline_ready(const AsyncPipeline& pipeline);
+    VkPipeline get_pipeline(const AsyncPipeline& pipeline);
+    // Block until every async pipeline requested so far is ready
+    void wait_for_pipelines();
+
+    // Release a resource before clear(). The handle and any copies of it go
+    // stale, and the slot is reused. The Vulkan object is destroyed once
+    // frames in flight are done with it, see destroy_deferred.
+    //
+    // Async pipelines are shared by everyone who requested the same state and
+    // only destroyed when each of them has released it. Pipelines from
+    // request_pipeline live until clear()
+    void release_shader_module(const ShaderModule& module);
+    void release_pipeline(const AsyncPipeline& pipeline);
+
+    // Hot reload. Modules are found by name, so ones named after the file
+    // they were loaded from can be reloaded from it. Modules whose SPIR-V
+    // changed are replaced in place, with handles to them staying valid, and
+    // only the async pipelines using them are rebuilt. Until a rebuilt
+    // pipeline is ready get_pipeline keeps returning the old one. Old objects
+    // go through destroy_deferred.
+    //
+    // Pipelines from request_pipeline, and ones whose create info couldn't
+    // be copied, aren't rebuilt. Modules shared by several names, because
+    // their files had identical SPIR-V, aren't reloaded at all since the new
+    // code would apply to every name
+    void reload_shader_modules(const char* const* paths, size_t num_paths);
+
+    // Destroy an object once every frame that may have used it has finished
+    // on the GPU, rather than idling the device. Anything released through
+    // the resource manager, or cleared, goes through here too
+    inline void destroy_deferred(VkPipeline pipeline) {
+        defer_destroy(VK_OBJECT_TYPE_PIPELINE, (uint64_t) pipeline);
+    }
+    inline void destroy_deferred(VkPipelineLayout pipeline_layout) {
+        defer_destroy(VK_OBJECT_TYPE_PIPELINE_LAYOUT, (uint64_t) pipeline_layout);
+    }
+    inline void destroy_deferred(VkDescriptorSetLayout descriptor_set_layout) {
+        defer_destroy(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, (uint64_t) descriptor_set_layout);
+    }
+    inline void destroy_deferred(VkShaderModule shader_module) {
+        defer_destroy(VK_OBJECT_TYPE_SHADER_MODULE, (uint64_t) shader_module);
+    }
+    inline void destroy_deferred(VkRenderPass render_pass) {
+        defer_destroy(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t) render_pass);
+    }
+    inline void destroy_deferred(VkFramebuffer framebuffer) {
+        defer_destroy(VK_OBJECT_TYPE_FRAMEBUFFER, (uint64_t) framebuffer);
+    }
+    inline void destroy_deferred(VkDescriptorPool descriptor_pool) {
+        defer_destroy(VK_OBJECT_TYPE_DESCRIPTOR_POOL, (uint64_t) descriptor_pool);
+    }
+    inline void destroy_deferred(VkDescriptorUpdateTemplate update_template) {
+        defer_destroy(VK_OBJECT_TYPE_DESCRIPTOR_UPDATE_TEMPLATE, (uint64_t) update_template);
+    }
+
+    // Destroys queued objects whose frames have finished and recycles the
+    // frame slot's descriptor sets. Call after App::begin_frame
+    void begin_frame();
+
     // Find vulkan resources from cache
     VkPipelineLayout find_pipeline_layout(const VkPipelineLayoutCreateInfo& create_info);
     VkDescriptorSetLayout
     find_descriptor_set_layout(const VkDescriptorSetLayoutCreateInfo& create_info);
-    VkShaderModule find_shader_module(const VkShaderModuleCreateInfo& create_info);
+    // Module created from identical SPIR-V, whatever name it was requested under
+    ShaderModule find_shader_module(const VkShaderModuleCreateInfo& create_info);
 
     const Vulkan::App& app();
+    const PipelineStats& pipeline_stats() const;
 
-    // Clears all resources
+    // Clears all resources. Waits for pipelines still compiling first. The
+    // Vulkan objects are destroyed deferred, so frames in flight can finish
     void clear();
 
   private:
+    struct ShaderModuleEntry {
+        ShaderModuleCreateInfo info;
+        VkShaderModule module;
+        // Unique to the VkShaderModule. Pipeline keys use it rather than the
+        // handle, which may be reused once the module is destroyed
+        uint64_t serial;
+        // Key in m_code_to_shader_module. The code is a copy in m_allocator,
+        // freed when the module is reloaded or released
+        VkShaderModuleCreateInfo code;
+        // Async pipelines to rebuild when the module is reloaded
+        std::pmr::vector< AsyncPipeline > dependents;
+    };
+
+    struct AsyncPipelineEntry {
+        PipelineCompiler::Request request;
+        // Empty for pipelines which can't be keyed. The words are a copy in
+        // m_allocator, freed when the pipeline is rebuilt or released
+        GraphicsPipelineKey key;
+        // Copy in m_cache_allocator that requests are compiled from, kept to
+        // rebuild the pipeline. Stage i uses stage_modules[i]. Pipelines
+        // without stage modules can't be rebuilt
+        VkGraphicsPipelineCreateInfo create_info;
+        ShaderModule stage_modules[VULKAN_MAX_SHADER_STAGES];
+        uint32_t num_stage_modules = 0;
+        // The layout came from request_pipeline_layout(stage_modules)
+        bool derived_layout = false;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkPipeline fallback = VK_NULL_HANDLE;
+        // Requests sharing the entry. request_pipeline hits pin it
+        uint32_t ref_count = 1;
+        // False when it's a pipeline request_pipeline built and owns
+        bool owns_pipeline = true;
+        // Submitted, and the result not yet collected. A rebuilding pipeline
+        // keeps its previous one until then
+        bool pending = false;
+    };
+
+    struct DescriptorSetLayoutEntry {
+        DescriptorSetLayoutKey key;
+        // VK_NULL_HANDLE when the layout has no bindings
+        VkDescriptorUpdateTemplate update_template;
+    };
+
+    struct PipelineLayoutEntry {
+        // By set number, VK_NULL_HANDLE for unused sets
+        VkDescriptorSetLayout set_layouts[VULKAN_MAX_DESCRIPTOR_SETS];
+        // VULKAN_MAX_DESCRIPTOR_SETS when no set is pushed
+        uint32_t push_set;
+        VkDescriptorUpdateTemplate push_template;
+    };
+
+    struct DerivedLayout {
+        VkPipelineLayout layout;
+        ShaderModule shader_modules[VULKAN_MAX_SHADER_STAGES];
+        uint32_t num_shader_modules;
+    };
+
+    struct DeferredDestroy {
+        VkObjectType type;
+        uint64_t handle;
+        // Frame number when it was released
+        uint64_t frame;
+    };
+
     // Members
     Vulkan::App& m_app;
 
-    // Caches
-    phmap::flat_hash_map< DescriptorSetLayoutCreateInfo, VkDescriptorSetLayout >
-        m_descriptor_set_layout_cache;
-    phmap::flat_hash_map< PipelineLayoutCreateInfo, VkPipelineLayout > m_pipeline_layout_cache;
+    // Allocators. Declared before the containers which use them.
+    //
+    // The caches, indices and tables below live in m_cache_allocator. It's
+    // only cleared in bulk, after the containers have been emptied, so storage
+    // they outgrow stays behind until then and lookups never reach malloc.
+    Memory::IAllocator& m_allocator;
+    Memory::MemoryResource m_resource;
+    Memory::LinearAllocator m_cache_allocator;
+    Memory::MemoryResource m_cache_resource;
+    // Per-id tables while reflecting SPIR-V, rewound after each module
+    Memory::VirtualHeap m_reflection_scratch;
+
+    // Caches. Layout keys and update templates are kept by layout too, for
+    // allocating and writing sets
+    AllocatorMap< DescriptorSetLayoutKey, VkDescriptorSetLayout > m_descriptor_set_layout_cache;
+    AllocatorMap< VkDescriptorSetLayout, DescriptorSetLayoutEntry > m_descriptor_set_layouts;
+    AllocatorMap< DescriptorSetKey, VkDescriptorSet > m_descriptor_set_cache;
+    AllocatorMap< PipelineLayoutKey, VkPipelineLayout > m_pipeline_layout_cache;
+    AllocatorMap< VkPipelineLayout, PipelineLayoutEntry > m_pipeline_layouts;
+    AllocatorMap< GraphicsPipelineKey, VkPipeline > m_pipeline_state_cache;
     VkPipelineCache m_pipeline_cache;
 
-    // Indices
-    phmap::flat_hash_map< const char*, ShaderModule, Hash::Hash<const char*> > m_name_to_shader_module;
+    // Persistence for m_pipeline_cache. The cold stats come from the run that
+    // started without a cache file, and are kept in the file to report the
+    // time it saves
+    const char* m_pipeline_cache_path;
+    bool m_pipeline_cache_loaded = false;
+    uint64_t m_cold_pipeline_compiles   = 0;
+    uint64_t m_cold_pipeline_compile_ns = 0;
 
-    // Resource arrays
-    std::vector< std::pair< ShaderModuleCreateInfo, VkShaderModule > > m_shader_modules;
-    std::vector< VkPipeline > m_pipelines;
+    // Async pipelines by state, pending or not. They're kept apart from
+    // m_pipeline_state_cache since they can be released. Requests point at
+    // the entries' create info copies, which stay in m_cache_allocator until
+    // clear()
+    std::unique_ptr< PipelineCompiler > m_pipeline_compiler;
+    AllocatorMap< GraphicsPipelineKey, AsyncPipeline > m_async_pipeline_cache;
+    size_t m_num_pending_pipelines = 0;
 
-    // Allocators
-    Memory::IAllocator& m_allocator;
-    Memory::LinearAllocator m_string_allocator;
+    // Indices. Shader modules are content addressed, names are aliases for
+    // them. The SPIR-V keys point at the module entries' copies. Names of
+    // released modules are dropped when they're next looked up
+    AllocatorMap< Strings::StringId, ShaderModule > m_name_to_shader_module;
+    AllocatorMap< VkShaderModuleCreateInfo, ShaderModule, Hash::Hash< VkShaderModuleCreateInfo >,
+                  Equals< VkShaderModuleCreateInfo > >
+        m_code_to_shader_module;
+    // Which module pipeline stages refer to, to track what to rebuild. Layouts
+    // merged from modules' reflection, to rebuild them too
+    AllocatorMap< VkShaderModule, ShaderModule > m_vk_to_shader_module;
+    std::pmr::vector< DerivedLayout > m_derived_layouts;
+    // Never reset, so serials aren't reused across clear() either
+    uint64_t m_last_shader_module_serial = 0;
+
+    // Resource tables. Entries stay at stable addresses as the tables grow,
+    // and released slots are reused. m_pipelines holds what request_pipeline
+    // built
+    SlotMap< ShaderModuleEntry, ShaderModule > m_shader_modules;
+    SlotMap< AsyncPipelineEntry, AsyncPipeline > m_async_pipelines;
+    std::pmr::vector< VkPipeline > m_pipelines;
+
+    // Persistent sets are cached above, their pools are retired by clear()
+    DescriptorAllocator m_descriptor_allocator;
+
+    // Objects waiting for their frame to finish, in release order. Outlives
+    // clear(), so it's backed by m_allocator rather than the cache allocator
+    std::pmr::vector< DeferredDestroy > m_deletion_queue;
+
+    PipelineStats m_pipeline_stats;
+
+    VkPipeline create_pipeline(const VkGraphicsPipelineCreateInfo& create_info);
+    AsyncPipeline create_ready_pipeline(VkPipeline pipeline, bool owns_pipeline);
+    const uint32_t* copy_pipeline_key_words(const uint32_t* words, uint32_t num_words);
+    void collect_pipeline(AsyncPipelineEntry& entry);
+    void track_pipeline_dependencies(const AsyncPipeline& id, AsyncPipelineEntry& entry);
+    void untrack_pipeline_dependencies(const AsyncPipeline& id, AsyncPipelineEntry& entry);
+    void submit_pipeline(AsyncPipelineEntry& entry);
+    bool reload_shader_module(const ShaderModule& id, const Memory::Buffer& spirv_source);
+    bool is_shader_module_aliased(const ShaderModule& id, Strings::StringId name);
+    void rebuild_pipeline(const AsyncPipeline& id, AsyncPipelineEntry& entry);
+    const DescriptorSetLayoutEntry& get_descriptor_set_layout(VkDescriptorSetLayout layout);
+    bool get_shader_module_serial(VkShaderModule module, uint64_t& serial);
+    bool can_push_descriptors(const DescriptorSetLayoutKey& key);
+    void create_pipeline_cache();
+    void save_pipeline_cache();
+    void defer_destroy(VkObjectType type, uint64_t handle);
+    void destroy_object(VkObjectType type, uint64_t handle);
+    void destroy_expired_objects(uint64_t last_finished_frame);
 };
 
 
@@ -6,18 +6,21 @@
 #include "utils.h"
 #include "hash.h"
 #include "memory.h"
+#include "string_id.h"
 
 #define VULKAN_MAX_DESCRIPTOR_SETS 8
 #define VULKAN_MAX_DESCRIPTOR_BINDINGS 16
 #define VULKAN_MAX_VERTEX_INPUTS 8
 #define VULKAN_MAX_PUSH_CONSTANT_RANGES 1
+#define VULKAN_MAX_SHADER_STAGES 8
+// Core descriptor types, VK_DESCRIPTOR_TYPE_SAMPLER to VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT
+#define VULKAN_NUM_DESCRIPTOR_TYPES 11
 
 namespace Hash {
 template <>
 struct Hash< VkShaderModuleCreateInfo > {
     inline size_t operator()(const VkShaderModuleCreateInfo& create_info) const {
-        return phmap::HashState().combine(
-            0, create_info.flags, djb2_hash((char*) create_info.pCode, create_info.codeSize));
+        return hash64(create_info.pCode, create_info.codeSize, create_info.flags);
     }
 };
 }    // namespace Hash
@@ -33,17 +36,16 @@ struct Equals : std::false_type {};
 
 template <>
 struct Equals< VkShaderModuleCreateInfo > {
-    inline size_t operator()(const VkShaderModuleCreateInfo& l,
-                             const VkShaderModuleCreateInfo& r) const {
-        using namespace std;
-        return memcmp(l.pCode, r.pCode, min(l.codeSize, r.codeSize))
-               && l.codeSize == r.codeSize;
+    inline bool operator()(const VkShaderModuleCreateInfo& l,
+                           const VkShaderModuleCreateInfo& r) const {
+        return l.codeSize == r.codeSize && l.flags == r.flags
+               && memcmp(l.pCode, r.pCode, l.codeSize) == 0;
     };
 };
 
 template <>
 struct Equals< VkPushConstantRange > {
-    inline size_t operator()(const VkPushConstantRange& l, const VkPushConstantRange& r) const {
+    inline bool operator()(const VkPushConstantRange& l, const VkPushConstantRange& r) const {
         return l.offset == r.offset && l.size == r.size && l.stageFlags == r.stageFlags;
     };
 };
@@ -53,7 +55,7 @@ struct Equals< VkPushConstantRange > {
 ////////////////////////////////////////////////////////////////////////////////
 
 struct DescriptorBinding {
-    const char* name;
+    Strings::StringId name = Strings::INVALID_STRING_ID;
 
     VkDescriptorType descriptor_type;
     uint32_t descriptor_count      = 0;
@@ -74,29 +76,50 @@ struct DescriptorBinding {
 
 struct DescriptorSetLayoutCreateInfo {
     DescriptorBinding bindings[VULKAN_MAX_DESCRIPTOR_BINDINGS];
+};
 
-    inline friend size_t hash_value(const DescriptorSetLayoutCreateInfo& info) {
-        size_t hash = 0;
-        phmap::HashState state;
-        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
-            if (info.bindings[i].stage_flags == 0) {
-                continue;
-            }
-            hash = state.combine(hash, hash_value(info.bindings[i]));
-        }
-        return hash;
+// One descriptor's resource. Sets are written from arrays of these: the
+// set's descriptors in binding order, with a binding's array elements next to
+// each other. Sets are cached on these bytes, so build them with the helpers,
+// which zero what the descriptor type doesn't use
+union DescriptorInfo {
+    VkDescriptorBufferInfo buffer;
+    VkDescriptorImageInfo image;
+    VkBufferView texel_buffer_view;
+
+    static inline DescriptorInfo from_buffer(VkBuffer buffer, VkDeviceSize offset = 0,
+                                             VkDeviceSize range = VK_WHOLE_SIZE) {
+        DescriptorInfo info;
+        memset(&info, 0, sizeof(info));
+        info.buffer.buffer = buffer;
+        info.buffer.offset = offset;
+        info.buffer.range  = range;
+        return info;
     }
 
-    inline bool operator==(const DescriptorSetLayoutCreateInfo& other) const {
-        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
-            if (!(bindings[i] == other.bindings[i])) {
-                return false;
-            }
-        }
-        return true;
+    static inline DescriptorInfo from_image(VkSampler sampler, VkImageView image_view,
+                                            VkImageLayout image_layout) {
+        DescriptorInfo info;
+        memset(&info, 0, sizeof(info));
+        info.image.sampler     = sampler;
+        info.image.imageView   = image_view;
+        info.image.imageLayout = image_layout;
+        return info;
+    }
+
+    static inline DescriptorInfo from_texel_buffer_view(VkBufferView texel_buffer_view) {
+        DescriptorInfo info;
+        memset(&info, 0, sizeof(info));
+        info.texel_buffer_view = texel_buffer_view;
+        return info;
     }
 };
 
+// Update templates read every descriptor type from arrays of DescriptorInfo at this stride
+static_assert(sizeof(DescriptorInfo) == sizeof(VkDescriptorBufferInfo)
+                  && sizeof(DescriptorInfo) == sizeof(VkDescriptorImageInfo),
+              "DescriptorInfo must have the stride of the Vulkan descriptor infos");
+
 struct PipelineLayoutCreateInfo {
     PipelineLayoutCreateInfo() {
         for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
@@ -107,39 +130,131 @@ struct PipelineLayoutCreateInfo {
     VkDescriptorSetLayout descriptor_set_layouts[VULKAN_MAX_DESCRIPTOR_SETS];
     VkPushConstantRange push_constant_ranges[VULKAN_MAX_PUSH_CONSTANT_RANGES];
     size_t num_push_constant_ranges = 0;
+};
 
-    inline friend size_t hash_value(const PipelineLayoutCreateInfo& info) {
-        size_t hash = 0;
-        phmap::HashState state;
-        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
-            if (info.descriptor_set_layouts[i] == VK_NULL_HANDLE) {
+////////////////////////////////////////////////////////////////////////////////
+// Cache keys
+////////////////////////////////////////////////////////////////////////////////
+
+// Keys hold only the active entries, packed to the front and flagged in a
+// mask, and hash themselves once on construction. Comparing the stored hashes
+// settles almost every lookup, so the packed entries are only compared when
+// the key is actually in the cache.
+
+struct DescriptorSetLayoutKey {
+    struct PackedBinding {
+        uint32_t descriptor_type;
+        uint32_t descriptor_count;
+        uint32_t stage_flags;
+    };
+
+    uint64_t hash         = 0;
+    uint32_t binding_mask = 0;
+    uint32_t num_bindings = 0;
+    VkDescriptorSetLayoutCreateFlags flags = 0;
+    PackedBinding bindings[VULKAN_MAX_DESCRIPTOR_BINDINGS] = {};
+
+    DescriptorSetLayoutKey() = default;
+
+    explicit DescriptorSetLayoutKey(const DescriptorSetLayoutCreateInfo& create_info,
+                                    VkDescriptorSetLayoutCreateFlags layout_flags = 0)
+        : flags(layout_flags) {
+        for (uint32_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
+            const DescriptorBinding& binding = create_info.bindings[i];
+            if (binding.stage_flags == 0) {
                 continue;
             }
-            hash = state.combine(hash, info.descriptor_set_layouts[i]);
+
+            binding_mask |= 1u << i;
+            bindings[num_bindings++]
+                = { (uint32_t) binding.descriptor_type, binding.descriptor_count,
+                    (uint32_t) binding.stage_flags };
         }
-        for (size_t i = 0; i < info.num_push_constant_ranges; i++) {
-            hash = state.combine(hash, info.push_constant_ranges[i].offset,
-                                 info.push_constant_ranges[i].size,
-                                 info.push_constant_ranges[i].stageFlags);
+
+        rehash();
+    }
+
+    inline void rehash() {
+        uint64_t seed = ((uint64_t) flags << 32) | binding_mask;
+        hash          = Hash::hash64(bindings, num_bindings * sizeof(PackedBinding), seed);
+    }
+
+    inline bool is_push_descriptor() const {
+        return (flags & VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR) != 0;
+    }
+
+    // Number of DescriptorInfo a set with this layout is written from
+    inline uint32_t count_descriptors() const {
+        uint32_t num_descriptors = 0;
+        for (uint32_t i = 0; i < num_bindings; i++) {
+            num_descriptors += bindings[i].descriptor_count;
         }
-        return hash;
+        return num_descriptors;
     }
 
-    inline bool operator==(const PipelineLayoutCreateInfo& other) const {
-        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
-            if (descriptor_set_layouts[i] != other.descriptor_set_layouts[i]) {
-                return false;
+    inline friend size_t hash_value(const DescriptorSetLayoutKey& key) {
+        return key.hash;
+    }
+
+    inline bool operator==(const DescriptorSetLayoutKey& other) const {
+        return hash == other.hash && binding_mask == other.binding_mask && flags == other.flags
+               && memcmp(bindings, other.bindings, num_bindings * sizeof(PackedBinding)) == 0;
+    }
+};
+
+struct PipelineLayoutKey {
+    uint64_t hash                     = 0;
+    uint32_t set_layout_mask          = 0;
+    uint32_t num_set_layouts          = 0;
+    uint32_t num_push_constant_ranges = 0;
+    VkDescriptorSetLayout set_layouts[VULKAN_MAX_DESCRIPTOR_SETS]           = {};
+    VkPushConstantRange push_constant_ranges[VULKAN_MAX_PUSH_CONSTANT_RANGES] = {};
+
+    PipelineLayoutKey() = default;
+
+    explicit PipelineLayoutKey(const PipelineLayoutCreateInfo& create_info) {
+        for (uint32_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
+            if (create_info.descriptor_set_layouts[i] == VK_NULL_HANDLE) {
+                continue;
             }
+
+            set_layout_mask |= 1u << i;
+            set_layouts[num_set_layouts++] = create_info.descriptor_set_layouts[i];
         }
 
-        if (num_push_constant_ranges != other.num_push_constant_ranges) {
+        ASSERT(create_info.num_push_constant_ranges <= VULKAN_MAX_PUSH_CONSTANT_RANGES);
+        num_push_constant_ranges = (uint32_t) create_info.num_push_constant_ranges;
+        for (uint32_t i = 0; i < num_push_constant_ranges; i++) {
+            push_constant_ranges[i] = create_info.push_constant_ranges[i];
+        }
+
+        uint64_t seed = ((uint64_t) num_push_constant_ranges << 32) | set_layout_mask;
+        hash = Hash::hash64(set_layouts, num_set_layouts * sizeof(VkDescriptorSetLayout), seed);
+        if (num_push_constant_ranges > 0) {
+            hash = Hash::hash64(push_constant_ranges,
+                                num_push_constant_ranges * sizeof(VkPushConstantRange), hash);
+        }
+    }
+
+    inline friend size_t hash_value(const PipelineLayoutKey& key) {
+        return key.hash;
+    }
+
+    inline bool operator==(const PipelineLayoutKey& other) const {
+        if (hash != other.hash || set_layout_mask != other.set_layout_mask
+            || num_push_constant_ranges != other.num_push_constant_ranges) {
             return false;
         }
 
-        for (size_t i = 0; i < num_push_constant_ranges; i++) {
-            if (!Equals< VkPushConstantRange >()(
-                push_constant_ranges[i], 
-                other.push_constant_ranges[i])) {
+        for (uint32_t i = 0; i < num_set_layouts; i++) {
+            if (set_layouts[i] != other.set_layouts[i]) {
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < num_push_constant_ranges; i++) {
+            if (!Equals< VkPushConstantRange >()(push_constant_ranges[i],
+                                                 other.push_constant_ranges[i])) {
                 return false;
             }
         }
@@ -148,17 +263,68 @@ struct PipelineLayoutCreateInfo {
     }
 };
 
+// A set's layout and the resources bound to it. The descriptors aren't owned,
+// cached keys point at copies
+struct DescriptorSetKey {
+    uint64_t hash                     = 0;
+    VkDescriptorSetLayout layout      = VK_NULL_HANDLE;
+    uint32_t num_descriptors          = 0;
+    const DescriptorInfo* descriptors = nullptr;
+
+    DescriptorSetKey() = default;
+
+    DescriptorSetKey(VkDescriptorSetLayout set_layout, const DescriptorInfo* set_descriptors,
+                     uint32_t set_num_descriptors)
+        : layout(set_layout)
+        , num_descriptors(set_num_descriptors)
+        , descriptors(set_descriptors) {
+        hash = Hash::hash64(descriptors, num_descriptors * sizeof(DescriptorInfo), (uint64_t) layout);
+    }
+
+    inline friend size_t hash_value(const DescriptorSetKey& key) {
+        return key.hash;
+    }
+
+    inline bool operator==(const DescriptorSetKey& other) const {
+        return hash == other.hash && layout == other.layout
+               && num_descriptors == other.num_descriptors
+               && memcmp(descriptors, other.descriptors, num_descriptors * sizeof(DescriptorInfo)) == 0;
+    }
+};
+
+// Normalized graphics pipeline state, flattened to words by the resource
+// manager. State the pipeline ignores (disabled blending, dynamic viewports,
+// unused stencil ops, ...) is left out and arrays are sorted, so create infos
+// that would build the same pipeline produce the same words.
+struct GraphicsPipelineKey {
+    uint64_t hash         = 0;
+    uint32_t num_words    = 0;
+    const uint32_t* words = nullptr;
+
+    inline friend size_t hash_value(const GraphicsPipelineKey& key) {
+        return key.hash;
+    }
+
+    inline bool operator==(const GraphicsPipelineKey& other) const {
+        return hash == other.hash && num_words == other.num_words
+               && memcmp(words, other.words, num_words * sizeof(uint32_t)) == 0;
+    }
+};
+
 struct ShaderResourceCreateInfo {
     struct VertexInput {
-        const char* name;
+        Strings::StringId name = Strings::INVALID_STRING_ID;
         VkFormat format;
     };
 
     VertexInput vertex_inputs[VULKAN_MAX_VERTEX_INPUTS];
     DescriptorBinding descriptor_bindings[VULKAN_MAX_DESCRIPTOR_SETS][VULKAN_MAX_DESCRIPTOR_BINDINGS];
+    // Size is 0 if the shader has no push constants
+    VkPushConstantRange push_constant_range = {};
 };
 
 struct ShaderModuleCreateInfo {
+    // Interned, so it can be handed straight to Vulkan
     const char* entry_point;
     VkShaderStageFlagBits stage;
     ShaderResourceCreateInfo resource_info;
@@ -167,7 +333,9 @@ struct ShaderModuleCreateInfo {
 struct ShaderSource {
     const char* name;
     const Memory::Buffer spirv_source;
-    const Memory::Buffer reflection_json;
+    // Baked reflection blob (see shader_reflection.h) or spirv-cross JSON.
+    // Leave empty to reflect the SPIR-V directly
+    const Memory::Buffer reflection;
 };
 
 
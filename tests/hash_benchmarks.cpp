@@ -0,0 +1,115 @@
+#include "hash.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Compares Hash::hash64 against byte at a time djb2 on the SPIR-V modules in the shader
+// directory given as the first argument, plus synthetic inputs covering the range of module
+// sizes. Results are written to the JSON file given as the second argument.
+
+using Clock = std::chrono::high_resolution_clock;
+
+struct BenchmarkResult {
+    std::string input;
+    size_t size;
+    double djb2_gb_per_sec;
+    double hash64_gb_per_sec;
+};
+
+static std::vector< BenchmarkResult > results;
+
+static volatile uint64_t sink;
+
+template < typename F >
+static double gb_per_sec(size_t size, F&& hash) {
+    // Repeat until about 64MB have been hashed so small inputs time reliably
+    size_t iterations = std::max< size_t >(1, MB(64) / std::max< size_t >(size, 1));
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = hash();
+    }
+    double ns = (double) std::chrono::duration_cast< std::chrono::nanoseconds >(Clock::now() - start)
+                    .count();
+
+    return (double) size * iterations / ns;
+}
+
+static void bench(const std::string& input, const std::vector< uint8_t >& data) {
+    const char* bytes = (const char*) data.data();
+    size_t size       = data.size();
+
+    BenchmarkResult result;
+    result.input             = input;
+    result.size              = size;
+    result.djb2_gb_per_sec   = gb_per_sec(size, [&]() { return Hash::djb2_hash(bytes, size); });
+    result.hash64_gb_per_sec = gb_per_sec(size, [&]() { return Hash::hash64(bytes, size); });
+    results.push_back(result);
+
+    printf("%-32s %10zu %12.2f %12.2f %8.1fx\n", input.c_str(), size, result.djb2_gb_per_sec,
+           result.hash64_gb_per_sec, result.hash64_gb_per_sec / result.djb2_gb_per_sec);
+}
+
+static bool write_results(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open %s", path);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file,
+                "    { \"input\": \"%s\", \"size\": %zu, \"djb2_gb_per_sec\": %.3f, "
+                "\"hash64_gb_per_sec\": %.3f }%s\n",
+                result.input.c_str(), result.size, result.djb2_gb_per_sec,
+                result.hash64_gb_per_sec, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+    printf("Wrote %zu results to %s\n", results.size(), path);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* shader_dir  = argc > 1 ? argv[1] : "app/shaders";
+    const char* output_path = argc > 2 ? argv[2] : "hash_benchmarks.json";
+
+    printf("%-32s %10s %12s %12s %9s\n", "input", "bytes", "djb2 GB/s", "hash64 GB/s", "speedup");
+
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(shader_dir, error)) {
+        if (entry.path().extension() != ".spv") {
+            continue;
+        }
+
+        std::ifstream file(entry.path(), std::ios::binary);
+        std::vector< uint8_t > data((std::istreambuf_iterator< char >(file)),
+                                    std::istreambuf_iterator< char >());
+        bench(entry.path().filename().string(), data);
+    }
+    if (error) {
+        LOG_ERROR("Failed to read %s: %s", shader_dir, error.message().c_str());
+    }
+
+    // Shader modules range from a few hundred bytes to tens of kilobytes
+    uint32_t random = 12345;
+    for (size_t size = 256; size <= KB(64); size *= 4) {
+        std::vector< uint8_t > data(size);
+        for (uint8_t& byte : data) {
+            random = random * 1664525 + 1013904223;
+            byte   = (uint8_t) (random >> 24);
+        }
+        bench("random_" + std::to_string(size), data);
+    }
+
+    return write_results(output_path) ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+#include "vulkan_types.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+// Compares descriptor set layout and pipeline layout cache lookups keyed by the full create
+// info structs (hashed and compared field by field on every lookup, as the resource manager
+// used to) against the compact pre-hashed keys. Results are written to the JSON file given as
+// the first argument.
+
+using namespace Vulkan;
+
+using Clock = std::chrono::high_resolution_clock;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Baseline keys ////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct FullDescriptorSetLayoutKey {
+    DescriptorSetLayoutCreateInfo info;
+
+    inline friend size_t hash_value(const FullDescriptorSetLayoutKey& key) {
+        size_t hash = 0;
+        phmap::HashState state;
+        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
+            const DescriptorBinding& binding = key.info.bindings[i];
+            if (binding.stage_flags == 0) {
+                continue;
+            }
+            hash = state.combine(hash, binding.descriptor_type, binding.descriptor_count,
+                                 binding.stage_flags);
+        }
+        return hash;
+    }
+
+    inline bool operator==(const FullDescriptorSetLayoutKey& other) const {
+        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_BINDINGS; i++) {
+            if (!(info.bindings[i] == other.info.bindings[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+struct FullPipelineLayoutKey {
+    PipelineLayoutCreateInfo info;
+
+    inline friend size_t hash_value(const FullPipelineLayoutKey& key) {
+        size_t hash = 0;
+        phmap::HashState state;
+        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
+            if (key.info.descriptor_set_layouts[i] == VK_NULL_HANDLE) {
+                continue;
+            }
+            hash = state.combine(hash, key.info.descriptor_set_layouts[i]);
+        }
+        for (size_t i = 0; i < key.info.num_push_constant_ranges; i++) {
+            hash = state.combine(hash, key.info.push_constant_ranges[i].offset,
+                                 key.info.push_constant_ranges[i].size,
+                                 key.info.push_constant_ranges[i].stageFlags);
+        }
+        return hash;
+    }
+
+    inline bool operator==(const FullPipelineLayoutKey& other) const {
+        for (size_t i = 0; i < VULKAN_MAX_DESCRIPTOR_SETS; i++) {
+            if (info.descriptor_set_layouts[i] != other.info.descriptor_set_layouts[i]) {
+                return false;
+            }
+        }
+        if (info.num_push_constant_ranges != other.info.num_push_constant_ranges) {
+            return false;
+        }
+        for (size_t i = 0; i < info.num_push_constant_ranges; i++) {
+            if (!Equals< VkPushConstantRange >()(info.push_constant_ranges[i],
+                                                 other.info.push_constant_ranges[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks ///////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct BenchmarkResult {
+    std::string name;
+    size_t entries;
+    double ns_per_lookup;
+};
+
+static std::vector< BenchmarkResult > results;
+
+static volatile uintptr_t sink;
+
+static const size_t LOOKUPS = 1 << 20;
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random() {
+    random_state = random_state * 1664525 + 1013904223;
+    return random_state >> 8;
+}
+
+template < typename F >
+static void record(const std::string& name, size_t entries, F&& lookup) {
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        sink = lookup(i % entries);
+    }
+    double ns = (double) std::chrono::duration_cast< std::chrono::nanoseconds >(Clock::now() - start)
+                    .count();
+
+    BenchmarkResult result = { name, entries, ns / LOOKUPS };
+    results.push_back(result);
+
+    printf("%-40s %8zu %10.2f\n", name.c_str(), entries, result.ns_per_lookup);
+}
+
+static DescriptorSetLayoutCreateInfo random_set_layout() {
+    static const VkDescriptorType types[]
+        = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+
+    // A handful of bindings, like the layouts reflected from the demo shaders
+    DescriptorSetLayoutCreateInfo info;
+    size_t num_bindings = 1 + next_random() % 4;
+    for (size_t i = 0; i < num_bindings; i++) {
+        DescriptorBinding& binding = info.bindings[next_random() % VULKAN_MAX_DESCRIPTOR_BINDINGS];
+        binding.descriptor_type    = types[next_random() % ARRAY_LENGTH(types)];
+        binding.descriptor_count   = 1 + next_random() % 2;
+        binding.stage_flags        = VK_SHADER_STAGE_VERTEX_BIT << (next_random() % 5);
+    }
+    return info;
+}
+
+static PipelineLayoutCreateInfo random_pipeline_layout() {
+    PipelineLayoutCreateInfo info;
+    size_t num_sets = 1 + next_random() % 3;
+    for (size_t i = 0; i < num_sets; i++) {
+        info.descriptor_set_layouts[i] = (VkDescriptorSetLayout) (uintptr_t) (next_random() << 4);
+    }
+    if (next_random() % 2) {
+        info.push_constant_ranges[0]  = { VK_SHADER_STAGE_VERTEX_BIT, 0, 64 };
+        info.num_push_constant_ranges = 1;
+    }
+    return info;
+}
+
+static void bench_set_layouts(size_t entries) {
+    std::vector< DescriptorSetLayoutCreateInfo > infos;
+    phmap::flat_hash_map< FullDescriptorSetLayoutKey, uintptr_t > full_cache;
+    phmap::flat_hash_map< DescriptorSetLayoutKey, uintptr_t > key_cache;
+    std::vector< DescriptorSetLayoutKey > keys;
+
+    while (infos.size() < entries) {
+        DescriptorSetLayoutCreateInfo info = random_set_layout();
+        if (!key_cache.emplace(DescriptorSetLayoutKey(info), infos.size()).second) {
+            continue;
+        }
+        full_cache.emplace(FullDescriptorSetLayoutKey{ info }, infos.size());
+        keys.push_back(DescriptorSetLayoutKey(info));
+        infos.push_back(info);
+    }
+
+    std::string suffix = " " + std::to_string(entries);
+    record("set_layout_full_info" + suffix, entries,
+           [&](size_t i) { return full_cache.find(FullDescriptorSetLayoutKey{ infos[i] })->second; });
+    record("set_layout_key_build_and_find" + suffix, entries,
+           [&](size_t i) { return key_cache.find(DescriptorSetLayoutKey(infos[i]))->second; });
+    record("set_layout_key_find" + suffix, entries,
+           [&](size_t i) { return key_cache.find(keys[i])->second; });
+}
+
+static void bench_pipeline_layouts(size_t entries) {
+    std::vector< PipelineLayoutCreateInfo > infos;
+    phmap::flat_hash_map< FullPipelineLayoutKey, uintptr_t > full_cache;
+    phmap::flat_hash_map< PipelineLayoutKey, uintptr_t > key_cache;
+    std::vector< PipelineLayoutKey > keys;
+
+    while (infos.size() < entries) {
+        PipelineLayoutCreateInfo info = random_pipeline_layout();
+        if (!key_cache.emplace(PipelineLayoutKey(info), infos.size()).second) {
+            continue;
+        }
+        full_cache.emplace(FullPipelineLayoutKey{ info }, infos.size());
+        keys.push_back(PipelineLayoutKey(info));
+        infos.push_back(info);
+    }
+
+    std::string suffix = " " + std::to_string(entries);
+    record("pipeline_layout_full_info" + suffix, entries,
+           [&](size_t i) { return full_cache.find(FullPipelineLayoutKey{ infos[i] })->second; });
+    record("pipeline_layout_key_build_and_find" + suffix, entries,
+           [&](size_t i) { return key_cache.find(PipelineLayoutKey(infos[i]))->second; });
+    record("pipeline_layout_key_find" + suffix, entries,
+           [&](size_t i) { return key_cache.find(keys[i])->second; });
+}
+
+static bool write_results(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open %s", path);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"entries\": %zu, \"ns_per_lookup\": %.3f }%s\n",
+                result.name.c_str(), result.entries, result.ns_per_lookup,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+    printf("Wrote %zu results to %s\n", results.size(), path);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* output_path = argc > 1 ? argv[1] : "layout_key_benchmarks.json";
+
+    printf("%-40s %8s %10s\n", "benchmark", "entries", "ns/lookup");
+
+    // Demo sized caches up to the size of a real material library
+    for (size_t entries = 16; entries <= 4096; entries *= 16) {
+        bench_set_layouts(entries);
+        bench_pipeline_layouts(entries);
+    }
+
+    return write_results(output_path) ? 0 : 1;
+}
@@ -0,0 +1,269 @@
+#include "memory.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+// Allocator throughput benchmarks. Prints a table per benchmark and writes every result to the
+// JSON file given as the first argument (memory_benchmarks.json by default), so runs can be
+// compared over time.
+
+using Clock = std::chrono::high_resolution_clock;
+
+struct BenchmarkResult {
+    const char* name;
+    size_t size;
+    size_t align;
+    size_t chain_length;
+    size_t operations;
+    double ns_per_op;
+};
+
+static std::vector< BenchmarkResult > results;
+
+// Keeps the optimizer from dropping allocations whose results are never used
+static volatile uintptr_t sink;
+
+static const size_t SIZES[]      = { 16, 64, 512, 4096 };
+static const size_t ALIGNMENTS[] = { 1, 16, 64 };
+
+static double elapsed_ns(Clock::time_point start) {
+    return (double) std::chrono::duration_cast< std::chrono::nanoseconds >(Clock::now() - start)
+        .count();
+}
+
+static void record(const char* name, size_t size, size_t align, size_t chain_length,
+                   size_t operations, double ns) {
+    BenchmarkResult result = { name, size, align, chain_length, operations, ns / operations };
+    results.push_back(result);
+    printf("%-40s %8zu %6zu %8zu %12zu %10.2f %14.0f\n", name, size, align, chain_length,
+           operations, result.ns_per_op, operations / (ns * 1e-9));
+}
+
+// Number of allocations per round. Large sizes get fewer so every round stays within a few
+// megabytes
+static size_t operations_for(size_t size) {
+    return std::min< size_t >(100000, MB(64) / size);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation ///////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void bench_arena_push(size_t size, size_t align) {
+    size_t operations = operations_for(size);
+    size_t buffer_size = operations * (size + align);
+
+    Memory::Arena arena;
+    arena.buffer.data = (uint8_t*) malloc(buffer_size);
+    arena.buffer.size = buffer_size;
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        sink = (uintptr_t) arena.push(size, align);
+    }
+    record("Arena::push", size, align, 0, operations, elapsed_ns(start));
+
+    free(arena.buffer.data);
+}
+
+static void bench_virtual_heap(size_t size, size_t align) {
+    size_t operations = operations_for(size);
+    Memory::VirtualHeap heap(GB(1));
+
+    // Cold: every commit happens during the timed loop
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        sink = (uintptr_t) heap.allocate_data(size, align);
+    }
+    record("VirtualHeap::allocate_data (cold)", size, align, 0, operations, elapsed_ns(start));
+
+    // Warm: the pages are already committed, which is the steady state of a frame heap
+    heap.clear();
+    start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        sink = (uintptr_t) heap.allocate_data(size, align);
+    }
+    record("VirtualHeap::allocate_data (warm)", size, align, 0, operations, elapsed_ns(start));
+}
+
+static void bench_linear_allocator(size_t size, size_t align) {
+    size_t operations = operations_for(size);
+    Memory::VirtualHeap backing_heap(GB(1));
+    Memory::LinearAllocator allocator(KB(64), backing_heap);
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        sink = (uintptr_t) allocator.allocate_data(size, align);
+    }
+    record("LinearAllocator::allocate_data (cold)", size, align, allocator.arena_count(),
+           operations, elapsed_ns(start));
+
+    allocator.clear();
+    start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        sink = (uintptr_t) allocator.allocate_data(size, align);
+    }
+    record("LinearAllocator::allocate_data (warm)", size, align, allocator.arena_count(),
+           operations, elapsed_ns(start));
+}
+
+static void bench_malloc(size_t size, size_t align) {
+    size_t operations = operations_for(size);
+    std::vector< void* > pointers(operations);
+
+    // malloc only guarantees fundamental alignment, so over-allocate for anything stricter,
+    // the same way a caller would have to
+    size_t padded_size = align > alignof(std::max_align_t) ? size + align - 1 : size;
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        pointers[i] = malloc(padded_size);
+    }
+    record("malloc", size, align, 0, operations, elapsed_ns(start));
+
+    start = Clock::now();
+    for (size_t i = 0; i < operations; i++) {
+        free(pointers[i]);
+    }
+    record("free", size, align, 0, operations, elapsed_ns(start));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Clear and reset //////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void bench_clear() {
+    const size_t rounds = 1000;
+
+    Memory::VirtualHeap heap(GB(1));
+    Clock::time_point start;
+    double ns = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        heap.allocate_data(MB(1), 16);
+        start = Clock::now();
+        heap.clear();
+        ns += elapsed_ns(start);
+    }
+    record("VirtualHeap::clear", MB(1), 16, 0, rounds, ns);
+
+    // release gives the pages back, so the next round has to commit them again
+    ns = 0;
+    for (size_t i = 0; i < rounds / 10; i++) {
+        memset(heap.allocate_data(MB(1), 16), 1, MB(1));
+        start = Clock::now();
+        heap.release();
+        ns += elapsed_ns(start);
+    }
+    record("VirtualHeap::release", MB(1), 16, 0, rounds / 10, ns);
+
+    // LinearAllocator::clear walks the chain, so measure it at several lengths. Arenas double
+    // in size, so 16 is about as long as a chain gets within the reservation
+    for (size_t chain_length = 1; chain_length <= 16; chain_length *= 2) {
+        Memory::VirtualHeap backing_heap(GB(4));
+        Memory::LinearAllocator allocator(KB(4), backing_heap);
+        while (allocator.arena_count() < chain_length) {
+            allocator.allocate_data(KB(1), 16);
+        }
+
+        ns = 0;
+        for (size_t i = 0; i < rounds; i++) {
+            allocator.allocate_data(KB(1), 16);
+            start = Clock::now();
+            allocator.clear();
+            ns += elapsed_ns(start);
+        }
+        record("LinearAllocator::clear", KB(1), 16, allocator.arena_count(), rounds, ns);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// LinearAllocator chain length /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Allocates string sized blocks until the arena chain reaches max_chain_length, timing the
+// allocations made at each chain length. Each arena is left with a small unusable tail, which
+// is the case that used to make every allocation walk the whole chain.
+static void bench_linear_allocator_chain_length(size_t max_chain_length) {
+    Memory::VirtualHeap backing_heap(GB(8));
+    Memory::LinearAllocator allocator(KB(4), backing_heap);
+
+    uint32_t random = 12345;
+    size_t chain_length = 0;
+    size_t num_allocations = 0;
+    Clock::time_point start = Clock::now();
+
+    while (chain_length <= max_chain_length) {
+        // Sizes in the range of resource names
+        random = random * 1664525 + 1013904223;
+        size_t size = 16 + (random >> 16) % 48;
+
+        if (!allocator.allocate_data(size, 1)) {
+            LOG_ERROR("Allocation of %zu bytes failed", size);
+            return;
+        }
+        num_allocations++;
+
+        if (allocator.arena_count() != chain_length) {
+            if (chain_length > 0) {
+                record("LinearAllocator::allocate_data (chain)", 40, 1, chain_length,
+                       num_allocations, elapsed_ns(start));
+            }
+
+            chain_length    = allocator.arena_count();
+            num_allocations = 0;
+            start           = Clock::now();
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// Output ///////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool write_results(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open %s", path);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file,
+                "    { \"name\": \"%s\", \"size\": %zu, \"align\": %zu, \"chain_length\": %zu, "
+                "\"operations\": %zu, \"ns_per_op\": %.3f }%s\n",
+                result.name, result.size, result.align, result.chain_length, result.operations,
+                result.ns_per_op, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+    printf("Wrote %zu results to %s\n", results.size(), path);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* output_path = argc > 1 ? argv[1] : "memory_benchmarks.json";
+
+    printf("%-40s %8s %6s %8s %12s %10s %14s\n", "benchmark", "size", "align", "chain",
+           "operations", "ns/op", "ops/sec");
+
+    for (size_t size : SIZES) {
+        for (size_t align : ALIGNMENTS) {
+            bench_arena_push(size, align);
+            bench_virtual_heap(size, align);
+            bench_linear_allocator(size, align);
+            bench_malloc(size, align);
+        }
+    }
+
+    bench_clear();
+    bench_linear_allocator_chain_length(14);
+
+    return write_results(output_path) ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+#include "handle.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Correctness tests for the allocators. Exits with a non-zero status on the first failed check.
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                 \
+        }                                                                            \
+    } while (0)
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// ThreadHeaps //////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const size_t NUM_THREADS = 8;
+
+// Every thread gets its own slice, keeps it across calls, and reset() rewinds all of them
+static void test_thread_heaps_local() {
+    Memory::ThreadHeaps heaps(NUM_THREADS, MB(1));
+
+    Memory::VirtualHeap* thread_heaps[NUM_THREADS] = {};
+    uint8_t* first_allocations[NUM_THREADS]        = {};
+
+    const auto run = [&](size_t thread) {
+        Memory::VirtualHeap& heap = heaps.local();
+        CHECK(&heap == &heaps.local());
+        thread_heaps[thread] = &heap;
+
+        uint8_t* data = heap.allocate< uint8_t >(KB(64), 64);
+        CHECK(data != nullptr);
+        memset(data, (int) thread, KB(64));
+        first_allocations[thread] = data;
+    };
+
+    std::vector< std::thread > threads;
+    for (size_t i = 0; i < NUM_THREADS; i++) {
+        threads.emplace_back(run, i);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    CHECK(heaps.thread_count() == NUM_THREADS);
+    for (size_t i = 0; i < NUM_THREADS; i++) {
+        for (size_t j = i + 1; j < NUM_THREADS; j++) {
+            CHECK(thread_heaps[i] != thread_heaps[j]);
+        }
+        // No thread wrote into another's slice
+        for (size_t byte = 0; byte < KB(64); byte++) {
+            CHECK(first_allocations[i][byte] == i);
+        }
+    }
+
+    // After a reset every slice hands out its first allocation again
+    heaps.reset();
+    for (size_t i = 0; i < heaps.thread_count(); i++) {
+        uint8_t* data = heaps.get(i).allocate< uint8_t >(KB(64), 64);
+        bool found    = false;
+        for (size_t j = 0; j < NUM_THREADS; j++) {
+            found |= data == first_allocations[j];
+        }
+        CHECK(found);
+    }
+}
+
+// A long lived thread can go through any number of registries as long as few are alive at once
+static void test_thread_heaps_churn() {
+    std::thread thread([]() {
+        for (size_t i = 0; i < 64; i++) {
+            Memory::ThreadHeaps heaps(2, KB(64));
+            Memory::ThreadHeaps other(2, KB(64));
+            CHECK(heaps.local().allocate< uint64_t >(16) != nullptr);
+            CHECK(other.local().allocate< uint64_t >(16) != nullptr);
+            CHECK(heaps.thread_count() == 1);
+            CHECK(other.thread_count() == 1);
+        }
+    });
+    thread.join();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// TLSFAllocator ////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void fill(void* ptr, size_t size, uint8_t value) {
+    memset(ptr, value, size);
+}
+
+static bool filled_with(const void* ptr, size_t size, uint8_t value) {
+    const uint8_t* bytes = (const uint8_t*) ptr;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_tlsf_allocate_free() {
+    Memory::TLSFAllocator allocator(MB(64));
+
+    void* a = allocator.allocate_data(100, 8);
+    void* b = allocator.allocate_data(100, 8);
+    CHECK(a && b && a != b);
+    CHECK(allocator.usable_size(a) >= 100);
+    CHECK((uint8_t*) b >= (uint8_t*) a + allocator.usable_size(a)
+          || (uint8_t*) a >= (uint8_t*) b + allocator.usable_size(b));
+
+    fill(a, 100, 0xaa);
+    fill(b, 100, 0xbb);
+    CHECK(filled_with(a, 100, 0xaa));
+    CHECK(filled_with(b, 100, 0xbb));
+
+    // A freed block is handed out again for the same size
+    allocator.free(a);
+    CHECK(allocator.allocate_data(100, 8) == a);
+    CHECK(filled_with(b, 100, 0xbb));
+
+    // Allocations larger than the first chunk grow the pool
+    void* large = allocator.allocate_data(MB(4), 16);
+    CHECK(large != nullptr);
+    fill(large, MB(4), 0xcc);
+    allocator.free(large);
+}
+
+static void test_tlsf_coalescing() {
+    Memory::TLSFAllocator allocator(MB(64));
+
+    void* a     = allocator.allocate_data(256, 8);
+    void* b     = allocator.allocate_data(256, 8);
+    void* guard = allocator.allocate_data(256, 8);
+    CHECK(a && b && guard);
+
+    // Neither block fits 500 bytes on its own, only once merged
+    allocator.free(a);
+    allocator.free(b);
+    void* merged = allocator.allocate_data(500, 8);
+    CHECK(merged == a);
+    CHECK(allocator.usable_size(merged) >= 500);
+
+    // Freeing in the other order merges with the next block instead
+    allocator.free(merged);
+    void* c = allocator.allocate_data(256, 8);
+    void* d = allocator.allocate_data(256, 8);
+    CHECK(c == a);
+    allocator.free(d);
+    allocator.free(c);
+    CHECK(allocator.allocate_data(500, 8) == a);
+    allocator.free(guard);
+}
+
+static void test_tlsf_alignment() {
+    Memory::TLSFAllocator allocator(MB(64));
+
+    static const size_t ALIGNMENTS[] = { 8, 16, 64, 256, 4096 };
+    std::vector< void* > allocations;
+    for (size_t round = 0; round < 4; round++) {
+        for (size_t align : ALIGNMENTS) {
+            size_t size = 24 + round * 40;
+            void* ptr   = allocator.allocate_data(size, align);
+            CHECK(ptr != nullptr);
+            CHECK(((uintptr_t) ptr & (align - 1)) == 0);
+            fill(ptr, size, (uint8_t) align);
+            allocations.push_back(ptr);
+        }
+    }
+    for (void* ptr : allocations) {
+        allocator.free(ptr);
+    }
+}
+
+static void test_tlsf_reallocate() {
+    Memory::TLSFAllocator allocator(MB(64));
+
+    void* a     = allocator.allocate_data(256, 8);
+    void* b     = allocator.allocate_data(256, 8);
+    void* guard = allocator.allocate_data(256, 8);
+    fill(a, 256, 0x11);
+
+    // Grows in place into the free neighbour
+    allocator.free(b);
+    void* grown = allocator.reallocate_data(a, 400, 8);
+    CHECK(grown == a);
+    CHECK(allocator.usable_size(grown) >= 400);
+    CHECK(filled_with(grown, 256, 0x11));
+    fill(grown, 400, 0x22);
+
+    // Shrinks in place and gives the tail back
+    void* shrunk = allocator.reallocate_data(grown, 64, 8);
+    CHECK(shrunk == a);
+    CHECK(allocator.usable_size(shrunk) < 400);
+    CHECK(filled_with(shrunk, 64, 0x22));
+    void* tail = allocator.allocate_data(256, 8);
+    CHECK((uint8_t*) tail > (uint8_t*) shrunk && (uint8_t*) tail < (uint8_t*) guard);
+
+    // Moves when the neighbour is in use, keeping the contents
+    void* moved = allocator.reallocate_data(shrunk, 1024, 8);
+    CHECK(moved != nullptr && moved != a);
+    CHECK(filled_with(moved, 64, 0x22));
+
+    allocator.free(moved);
+    allocator.free(tail);
+    allocator.free(guard);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+// SlotMap //////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct TestObject {
+    uint64_t value;
+};
+using TestHandle = Vulkan::Handle< TestObject >;
+
+static void test_slot_map_stale_handles() {
+    Vulkan::SlotMap< TestObject, TestHandle > slot_map(MB(16));
+
+    TestHandle a = slot_map.create(TestObject{ 1 });
+    TestHandle b = slot_map.create(TestObject{ 2 });
+    CHECK(slot_map.get(a)->value == 1 && slot_map.get(b)->value == 2);
+    CHECK(slot_map.size() == 2);
+
+    // Released handles go stale, and releasing them again does nothing
+    slot_map.release(a);
+    CHECK(!slot_map.contains(a) && slot_map.get(a) == nullptr);
+    slot_map.release(a);
+    CHECK(slot_map.size() == 1 && slot_map.get(b)->value == 2);
+
+    // The slot is reused under a new generation, which the old handle doesn't match
+    TestHandle c = slot_map.create(TestObject{ 3 });
+    CHECK(c.index == a.index && c.generation != a.generation);
+    CHECK(!slot_map.contains(a) && slot_map.get(c)->value == 3);
+
+    CHECK(!slot_map.contains(TestHandle::create_invalid()));
+    CHECK(!slot_map.contains(TestHandle{ 1000, 1 }));
+
+    // Handles from before a clear stay stale after it
+    slot_map.clear();
+    CHECK(slot_map.size() == 0 && !slot_map.contains(b) && !slot_map.contains(c));
+    TestHandle d = slot_map.create(TestObject{ 4 });
+    CHECK(!slot_map.contains(b) && !slot_map.contains(c) && slot_map.get(d)->value == 4);
+
+    size_t live = 0;
+    slot_map.for_each([&](const TestHandle& handle, TestObject& object) {
+        CHECK(handle == d && object.value == 4);
+        live++;
+    });
+    CHECK(live == 1);
+}
+
+// Create and release reuse freed slots, so churn never grows the table past its peak
+static void test_slot_map_churn() {
+    Vulkan::SlotMap< TestObject, TestHandle > slot_map(MB(16), KB(4));
+
+    static const size_t NUM_LIVE = 1000;
+    std::vector< TestHandle > handles;
+    for (size_t i = 0; i < NUM_LIVE; i++) {
+        handles.push_back(slot_map.create(TestObject{ i }));
+    }
+    size_t peak_capacity = slot_map.capacity();
+
+    for (size_t round = 0; round < 100; round++) {
+        for (size_t i = round % 2; i < NUM_LIVE; i += 2) {
+            TestHandle old_handle = handles[i];
+            slot_map.release(old_handle);
+            handles[i] = slot_map.create(TestObject{ round * NUM_LIVE + i });
+            CHECK(!slot_map.contains(old_handle));
+        }
+    }
+
+    CHECK(slot_map.capacity() == peak_capacity);
+    CHECK(slot_map.size() == NUM_LIVE);
+    for (size_t i = 0; i < NUM_LIVE; i++) {
+        CHECK(slot_map.get(handles[i])->value % NUM_LIVE == i);
+    }
+}
+
+int main() {
+    test_thread_heaps_local();
+    test_thread_heaps_churn();
+    test_tlsf_allocate_free();
+    test_tlsf_coalescing();
+    test_tlsf_alignment();
+    test_tlsf_reallocate();
+    test_slot_map_stale_handles();
+    test_slot_map_churn();
+
+    printf("memory_tests passed\n");
+    return 0;
+}
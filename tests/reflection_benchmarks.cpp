@@ -0,0 +1,195 @@
+#include "shader_reflection.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Compares reflecting a shader from its spirv-cross JSON, from the baked reflection blob and
+// straight from the SPIR-V, on the modules in the shader directory given as the first argument.
+// Every path has to agree with the native reflector. Results are written to the JSON file
+// given as the second argument.
+
+using namespace Vulkan;
+
+using Clock = std::chrono::high_resolution_clock;
+
+struct BenchmarkResult {
+    std::string shader;
+    size_t spirv_size;
+    size_t json_size;
+    double json_us;
+    double blob_us;    // 0 without a baked blob
+    double native_us;
+};
+
+static std::vector< BenchmarkResult > results;
+
+static volatile uintptr_t sink;
+
+static const size_t ITERATIONS = 1 << 12;
+
+static std::vector< uint8_t > read_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector< uint8_t >((std::istreambuf_iterator< char >(file)),
+                                  std::istreambuf_iterator< char >());
+}
+
+static Memory::Buffer as_buffer(std::vector< uint8_t >& data) {
+    return { data.data(), data.size() };
+}
+
+template < typename F >
+static double us_per_reflection(F&& reflect) {
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        ShaderModuleCreateInfo info;
+        reflect(info);
+        sink = (uintptr_t) info.entry_point;
+    }
+    double ns = (double) std::chrono::duration_cast< std::chrono::nanoseconds >(Clock::now() - start)
+                    .count();
+    return ns / ITERATIONS / 1000.0;
+}
+
+static bool same_reflection(const ShaderModuleCreateInfo& a, const ShaderModuleCreateInfo& b) {
+    if (a.stage != b.stage || strcmp(a.entry_point, b.entry_point) != 0) {
+        return false;
+    }
+
+    const ShaderResourceCreateInfo& ra = a.resource_info;
+    const ShaderResourceCreateInfo& rb = b.resource_info;
+    for (size_t i = 0; i < VULKAN_MAX_VERTEX_INPUTS; i++) {
+        // Unused locations are left uninitialized apart from the name
+        if (ra.vertex_inputs[i].name != rb.vertex_inputs[i].name) {
+            return false;
+        }
+        if (ra.vertex_inputs[i].name != Strings::INVALID_STRING_ID
+            && ra.vertex_inputs[i].format != rb.vertex_inputs[i].format) {
+            return false;
+        }
+    }
+    for (size_t set = 0; set < VULKAN_MAX_DESCRIPTOR_SETS; set++) {
+        for (size_t binding = 0; binding < VULKAN_MAX_DESCRIPTOR_BINDINGS; binding++) {
+            const DescriptorBinding& ba = ra.descriptor_bindings[set][binding];
+            const DescriptorBinding& bb = rb.descriptor_bindings[set][binding];
+            if (ba.stage_flags != bb.stage_flags || ba.name != bb.name) {
+                return false;
+            }
+            if (ba.stage_flags != 0
+                && (ba.descriptor_type != bb.descriptor_type
+                    || ba.descriptor_count != bb.descriptor_count)) {
+                return false;
+            }
+        }
+    }
+    return ra.push_constant_range.stageFlags == rb.push_constant_range.stageFlags
+           && ra.push_constant_range.offset == rb.push_constant_range.offset
+           && ra.push_constant_range.size == rb.push_constant_range.size;
+}
+
+static bool bench(const std::filesystem::path& spirv_path, Memory::VirtualHeap& scratch_heap) {
+    std::filesystem::path json_path = spirv_path, blob_path = spirv_path;
+    json_path.replace_extension(".json");
+    blob_path.replace_extension(".refl");
+
+    std::string shader = spirv_path.stem().string();
+    if (!std::filesystem::exists(json_path)) {
+        printf("%-24s skipped, no reflection JSON\n", shader.c_str());
+        return true;
+    }
+
+    std::vector< uint8_t > spirv = read_file(spirv_path);
+    std::vector< uint8_t > json  = read_file(json_path);
+    std::vector< uint8_t > blob;
+    if (std::filesystem::exists(blob_path)) {
+        blob = read_file(blob_path);
+    }
+
+    auto reflect_native = [&](ShaderModuleCreateInfo& info) {
+        Memory::ScratchScope scratch(scratch_heap);
+        reflect_spirv(as_buffer(spirv), scratch, info);
+    };
+    auto reflect_json = [&](ShaderModuleCreateInfo& info) { parse_reflection_json(as_buffer(json), info); };
+    auto reflect_blob = [&](ShaderModuleCreateInfo& info) { read_reflection_blob(as_buffer(blob), info); };
+
+    ShaderModuleCreateInfo native_info, json_info, blob_info;
+    reflect_native(native_info);
+    reflect_json(json_info);
+    if (!same_reflection(native_info, json_info)) {
+        LOG_ERROR("%s: SPIR-V and JSON reflection differ", shader.c_str());
+        return false;
+    }
+    if (!blob.empty()) {
+        reflect_blob(blob_info);
+        if (!same_reflection(native_info, blob_info)) {
+            LOG_ERROR("%s: SPIR-V and blob reflection differ", shader.c_str());
+            return false;
+        }
+    }
+
+    BenchmarkResult result;
+    result.shader     = shader;
+    result.spirv_size = spirv.size();
+    result.json_size  = json.size();
+    result.json_us    = us_per_reflection(reflect_json);
+    result.blob_us    = blob.empty() ? 0.0 : us_per_reflection(reflect_blob);
+    result.native_us  = us_per_reflection(reflect_native);
+    results.push_back(result);
+
+    printf("%-24s %10zu %10zu %10.2f %10.2f %10.2f\n", shader.c_str(), result.spirv_size,
+           result.json_size, result.json_us, result.blob_us, result.native_us);
+    return true;
+}
+
+static bool write_results(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open %s", path);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file,
+                "    { \"shader\": \"%s\", \"spirv_size\": %zu, \"json_size\": %zu, "
+                "\"json_us\": %.3f, \"blob_us\": %.3f, \"native_us\": %.3f }%s\n",
+                result.shader.c_str(), result.spirv_size, result.json_size, result.json_us,
+                result.blob_us, result.native_us, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+    printf("Wrote %zu results to %s\n", results.size(), path);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* shader_dir  = argc > 1 ? argv[1] : "app/shaders";
+    const char* output_path = argc > 2 ? argv[2] : "reflection_benchmarks.json";
+
+    Memory::VirtualHeap scratch_heap(MB(16));
+
+    printf("%-24s %10s %10s %10s %10s %10s\n", "shader", "spv bytes", "json bytes", "json us",
+           "blob us", "native us");
+
+    bool agreed = true;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(shader_dir, error)) {
+        if (entry.path().extension() == ".spv") {
+            agreed &= bench(entry.path(), scratch_heap);
+        }
+    }
+    if (error) {
+        LOG_ERROR("Failed to read %s: %s", shader_dir, error.message().c_str());
+        return 1;
+    }
+
+    return write_results(output_path) && agreed ? 0 : 1;
+}